@@ -81,6 +81,10 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err=-1;
+#if OPT_SHELL
+	off_t pos;
+	int whence;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -114,21 +118,56 @@ syscall(struct trapframe *tf)
 #if OPT_SHELL
 
 	case SYS_write:
-	        retval = sys_write((int)tf->tf_a0,
-				(userptr_t)tf->tf_a1,
-				(size_t)tf->tf_a2);
-		/* error: function not implemented */
-                if (retval<0) err = ENOSYS; 
-		else err = 0;
-                break;
+		err = sys_write((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+				(size_t)tf->tf_a2, &retval);
+		break;
 
 	case SYS_read:
-	        retval = sys_read((int)tf->tf_a0,
-				(userptr_t)tf->tf_a1,
-				(size_t)tf->tf_a2);
-                if (retval<0) err = ENOSYS; 
-		else err = 0;
-                break;
+		err = sys_read((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			       (size_t)tf->tf_a2, &retval);
+		break;
+
+	/*
+	 * The positional calls have their 64-bit offset in the
+	 * first stack argument slot: a2/a3 are not free for it.
+	 */
+	case SYS_pread:
+		err = copyin((userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+		if (err) break;
+		err = sys_pread((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+				(size_t)tf->tf_a2, pos, &retval);
+		break;
+
+	case SYS_pwrite:
+		err = copyin((userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+		if (err) break;
+		err = sys_pwrite((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+				 (size_t)tf->tf_a2, pos, &retval);
+		break;
+
+	case SYS_readv:
+		err = sys_readv((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+				(int)tf->tf_a2, &retval);
+		break;
+
+	case SYS_writev:
+		err = sys_writev((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+				 (int)tf->tf_a2, &retval);
+		break;
+
+	case SYS_preadv:
+		err = copyin((userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+		if (err) break;
+		err = sys_preadv((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+				 (int)tf->tf_a2, pos, &retval);
+		break;
+
+	case SYS_pwritev:
+		err = copyin((userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+		if (err) break;
+		err = sys_pwritev((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+				  (int)tf->tf_a2, pos, &retval);
+		break;
 
 	case SYS__exit:
 	        /* TODO: just avoid crash */
@@ -189,9 +228,20 @@ syscall(struct trapframe *tf)
 
 		break;
 
+	/*
+	 * lseek's 64-bit offset goes in a2/a3 (a1 is padding to align
+	 * it), whence in the first stack argument slot, and the 64-bit
+	 * result comes back in v0/v1.
+	 */
 	case SYS_lseek:
-		err = sys_lseek((int)tf->tf_a0, (off_t)tf->tf_a1, (int)tf->tf_a2);
-
+		pos = ((off_t)tf->tf_a2 << 32) | (uint32_t)tf->tf_a3;
+		err = copyin((userptr_t)(tf->tf_sp + 16), &whence,
+			     sizeof(whence));
+		if (err) break;
+		err = sys_lseek((int)tf->tf_a0, pos, whence, &pos);
+		if (err) break;
+		retval = (int32_t)(pos >> 32);
+		tf->tf_v1 = (uint32_t)pos;
 		break;
 
 	
@@ -33,12 +33,19 @@
 #include <spl.h>
 #include <cpu.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <proc.h>
 #include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <bitmap.h>
+#include <clock.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <swap.h>
 #include <opt-shell.h>
+#include <opt-tlbrandom.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -66,14 +73,68 @@
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 #if OPT_SHELL
+/*
+ * Physical frames are managed by a binary buddy allocator. A free
+ * block of 2^k frames starting at frame i (i a multiple of 2^k) is
+ * linked into freeList[k] through the block itself, and bit i>>k of
+ * freeMap[k] is set so its buddy can tell in O(1) whether it may
+ * merge. allocOrder remembers the order each allocated block was
+ * handed out with, so freeppages knows how much to give back.
+ * Frames below firstFrame were taken with ram_stealmem before
+ * vm_bootstrap and are never returned.
+ */
+#define BUDDY_MAXORDER  16
+#define BUDDY_NONE      ((unsigned)-1)
+
+struct buddy_link {
+  unsigned next, prev;            /* frame numbers, or BUDDY_NONE */
+};
+
 static struct spinlock freemem_lock = SPINLOCK_INITIALIZER;
 
-static unsigned char *freeRamFrames = NULL;
-static unsigned long *allocSize = NULL;
-static int nRamFrames = 0;
+static struct bitmap *freeMap[BUDDY_MAXORDER+1];
+static unsigned freeList[BUDDY_MAXORDER+1];
+static unsigned freeCount[BUDDY_MAXORDER+1];   /* blocks per order */
+static unsigned char *allocOrder = NULL;
+/* number of address spaces sharing each frame (copy-on-write fork) */
+static unsigned short *frameRefCount = NULL;
+static unsigned nRamFrames = 0;
+static unsigned firstFrame = 0;
+static unsigned maxOrder = 0;
+static unsigned freePages = 0;
+
+static struct {
+  unsigned long allocs, frees, failures;
+  unsigned long splits, merges;
+} buddyStats;
 
 static int allocTableActive = 0;
 
+/*
+ * Paging. frameInfo records which page of which address space each
+ * user frame holds, for the clock that picks page-out victims; fi_as
+ * is NULL for free and kernel frames, for frames shared copy-on-write
+ * (nobody tracks all their owners, so they stay resident) and for
+ * frames being written out. fi_ref is set whenever the page is loaded
+ * into a TLB and cleared as the clock hand passes it.
+ *
+ * vmLock serializes faults, page-outs and page table walks in
+ * as_copy/as_destroy; it is dropped around disk I/O, during which the
+ * page table entry is marked PTE_BUSY and others wait on vmBusyCv.
+ */
+#define VM_FREETARGET   16      /* start paging out below this many */
+
+struct frameinfo {
+  struct addrspace *fi_as;
+  vaddr_t fi_vaddr;
+  bool fi_ref;
+};
+
+static struct frameinfo *frameInfo = NULL;
+static unsigned clockHand = 0;
+static struct lock *vmLock;
+static struct cv *vmBusyCv;
+
 static int isTableActive () {
   int active;
   spinlock_acquire(&freemem_lock);
@@ -82,24 +143,125 @@ static int isTableActive () {
   return active;
 }
 
+static struct buddy_link *
+buddy_link(unsigned frame)
+{
+  return (struct buddy_link *)PADDR_TO_KVADDR((paddr_t)frame*PAGE_SIZE);
+}
+
+static void
+buddy_push(unsigned frame, unsigned order)
+{
+  struct buddy_link *l = buddy_link(frame);
+
+  KASSERT(spinlock_do_i_hold(&freemem_lock));
+  l->prev = BUDDY_NONE;
+  l->next = freeList[order];
+  if (l->next != BUDDY_NONE) {
+    buddy_link(l->next)->prev = frame;
+  }
+  freeList[order] = frame;
+  freeCount[order]++;
+  freePages += 1U << order;
+  bitmap_mark(freeMap[order], frame >> order);
+}
+
+static void
+buddy_unlink(unsigned frame, unsigned order)
+{
+  struct buddy_link *l = buddy_link(frame);
+
+  KASSERT(spinlock_do_i_hold(&freemem_lock));
+  if (l->prev != BUDDY_NONE) {
+    buddy_link(l->prev)->next = l->next;
+  }
+  else {
+    freeList[order] = l->next;
+  }
+  if (l->next != BUDDY_NONE) {
+    buddy_link(l->next)->prev = l->prev;
+  }
+  freeCount[order]--;
+  freePages -= 1U << order;
+  bitmap_unmark(freeMap[order], frame >> order);
+}
+
+/* Give back the block at FRAME, merging it with free buddies. */
+static void
+buddy_free(unsigned frame)
+{
+  unsigned order, buddy;
+
+  KASSERT(spinlock_do_i_hold(&freemem_lock));
+  KASSERT(frame >= firstFrame && frame < nRamFrames);
+  order = allocOrder[frame];
+  while (order < maxOrder) {
+    buddy = frame ^ (1U << order);
+    if (buddy < firstFrame || buddy + (1U << order) > nRamFrames ||
+        !bitmap_isset(freeMap[order], buddy >> order)) {
+      break;
+    }
+    buddy_unlink(buddy, order);
+    buddyStats.merges++;
+    if (buddy < frame) frame = buddy;
+    order++;
+  }
+  buddy_push(frame, order);
+  buddyStats.frees++;
+}
+
+static unsigned
+buddy_order(unsigned long npages)
+{
+  unsigned order = 0;
+
+  while ((1UL << order) < npages) order++;
+  return order;
+}
+
 void
 vm_bootstrap(void)
 {
-  int i;
-  nRamFrames = ((int)ram_getsize())/PAGE_SIZE;  
-  /* alloc freeRamFrame and allocSize */  
-  freeRamFrames = kmalloc(sizeof(unsigned char)*nRamFrames);
-  if (freeRamFrames==NULL) return;  
-  allocSize     = kmalloc(sizeof(unsigned long)*nRamFrames);
-  if (allocSize==NULL) {    
-    /* reset to disable this vm management */
-    freeRamFrames = NULL; return;
+  unsigned i, k;
+
+  vmLock = lock_create("vm");
+  vmBusyCv = cv_create("vmbusy");
+  if (vmLock == NULL || vmBusyCv == NULL) {
+    panic("vm_bootstrap: out of memory\n");
   }
-  for (i=0; i<nRamFrames; i++) {    
-    freeRamFrames[i] = (unsigned char)0;
-    allocSize[i]     = 0;  
+
+  nRamFrames = ram_getsize()/PAGE_SIZE;
+  while (maxOrder < BUDDY_MAXORDER && (2U << maxOrder) <= nRamFrames) {
+    maxOrder++;
   }
+  /* all of this is taken with ram_stealmem, before firstFrame */
+  allocOrder = kmalloc(sizeof(unsigned char)*nRamFrames);
+  frameRefCount = kmalloc(sizeof(unsigned short)*nRamFrames);
+  frameInfo = kmalloc(sizeof(struct frameinfo)*nRamFrames);
+  if (allocOrder==NULL || frameRefCount==NULL || frameInfo==NULL) return;
+  for (k=0; k<=maxOrder; k++) {
+    freeMap[k] = bitmap_create((nRamFrames >> k) + 1);
+    if (freeMap[k] == NULL) return;
+    freeList[k] = BUDDY_NONE;
+  }
+  for (i=0; i<nRamFrames; i++) {
+    allocOrder[i] = 0;
+    frameRefCount[i] = 0;
+    frameInfo[i].fi_as = NULL;
+    frameInfo[i].fi_ref = false;
+  }
+
+  /* from now on every frame belongs to the buddy allocator */
+  firstFrame = DIVROUNDUP(ram_getfirstfree(), PAGE_SIZE);
+  clockHand = firstFrame;
   spinlock_acquire(&freemem_lock);
+  for (i=firstFrame; i<nRamFrames; i += 1U << k) {
+    /* largest aligned block that starts here and fits */
+    for (k=maxOrder; k>0; k--) {
+      if ((i & ((1U << k)-1)) == 0 && i + (1U << k) <= nRamFrames) break;
+    }
+    buddy_push(i, k);
+  }
   allocTableActive = 1;
   spinlock_release(&freemem_lock);
 }
@@ -123,78 +285,357 @@ dumbvm_can_sleep(void)
 	}
 }
 
-static paddr_t 
-getfreeppages(unsigned long npages) {
-  paddr_t addr;	
-  long i, first, found, np = (long)npages;
+/*
+ * Take a block of at least NPAGES frames (rounded up to a power of
+ * two) off the smallest free list that has one, splitting larger
+ * blocks on the way down.
+ */
+static paddr_t
+getppages(unsigned long npages)
+{
+  paddr_t addr;
+  unsigned i, k, order, frame;
 
-  if (!isTableActive()) return 0; 
   spinlock_acquire(&freemem_lock);
-  for (i=0,first=found=-1; i<nRamFrames; i++) {
-    if (freeRamFrames[i]) {
-      if (i==0 || !freeRamFrames[i-1]) 
-        first = i; /* set first free in an interval */   
-      if (i-first+1 >= np) {
-        found = first;
-        break;
-      }
-    }
+  if (!allocTableActive) {
+    spinlock_release(&freemem_lock);
+    /* before vm_bootstrap: call stealmem */
+    spinlock_acquire(&stealmem_lock);
+    addr = ram_stealmem(npages);
+    spinlock_release(&stealmem_lock);
+    return addr;
   }
-	
-  if (found>=0) {
-    for (i=found; i<found+np; i++) {
-      freeRamFrames[i] = (unsigned char)0;
-    }
-    allocSize[found] = np;
-    addr = (paddr_t) found*PAGE_SIZE;
+
+  order = buddy_order(npages);
+  for (k=order; k<=maxOrder && freeList[k]==BUDDY_NONE; k++);
+  if (k > maxOrder) {
+    buddyStats.failures++;
+    spinlock_release(&freemem_lock);
+    return 0;
   }
-  else {
-    addr = 0;
+  frame = freeList[k];
+  buddy_unlink(frame, k);
+  while (k > order) {
+    k--;
+    buddy_push(frame + (1U << k), k);
+    buddyStats.splits++;
+  }
+  allocOrder[frame] = order;
+  for (i=0; i < (1U << order); i++) {
+    frameRefCount[frame + i] = 1;
   }
+  buddyStats.allocs++;
+  spinlock_release(&freemem_lock);
 
+  return (paddr_t)frame*PAGE_SIZE;
+}
+
+static int 
+freeppages(paddr_t addr){
+  unsigned frame = addr/PAGE_SIZE;
+
+  if (!isTableActive()) return 0; 
+  if (frame < firstFrame) {
+    /* stolen before vm_bootstrap: not ours to free */
+    return 0;
+  }
+  KASSERT(frame < nRamFrames);
+
+  spinlock_acquire(&freemem_lock);
+  frameRefCount[frame] = 0;
+  buddy_free(frame);
   spinlock_release(&freemem_lock);
 
-  return addr;
+  return 1;
 }
 
-static paddr_t
-getppages(unsigned long npages)
+/*
+ * Print the free blocks of each order, how fragmented free memory
+ * is, and the allocator counters; then time a few allocations.
+ */
+#define BUDDY_PROBES 1000
+
+static unsigned long
+buddy_probe(unsigned long npages)
 {
+  struct timespec before, after, duration;
   paddr_t addr;
+  unsigned i;
 
-  /* try freed pages first */
-  addr = getfreeppages(npages);
-  if (addr == 0) {
-    /* call stealmem */
-    spinlock_acquire(&stealmem_lock);
-    addr = ram_stealmem(npages);
-    spinlock_release(&stealmem_lock);
+  gettime(&before);
+  for (i=0; i<BUDDY_PROBES; i++) {
+    addr = getppages(npages);
+    if (addr == 0) {
+      return 0;
+    }
+    freeppages(addr);
   }
-  if (addr!=0 && isTableActive()) {
-    spinlock_acquire(&freemem_lock);
-    allocSize[addr/PAGE_SIZE] = npages;
-    spinlock_release(&freemem_lock);
-  } 
+  gettime(&after);
+  timespec_sub(&after, &before, &duration);
+  return (unsigned long)(((uint64_t)duration.tv_sec * 1000000000 +
+			  duration.tv_nsec) / BUDDY_PROBES);
+}
 
-  return addr;
+void
+vm_printstats(void)
+{
+  unsigned counts[BUDDY_MAXORDER+1];
+  unsigned k, freepages = 0, largest = 0;
+
+  if (!isTableActive()) {
+    kprintf("dumbvm: frame allocator not active\n");
+    return;
+  }
+
+  spinlock_acquire(&freemem_lock);
+  for (k=0; k<=maxOrder; k++) {
+    counts[k] = freeCount[k];
+  }
+  spinlock_release(&freemem_lock);
+
+  kprintf("Physical frame allocator: %u frames, %u managed\n",
+	  nRamFrames, nRamFrames - firstFrame);
+  kprintf("  order  blocks   pages\n");
+  for (k=0; k<=maxOrder; k++) {
+    if (counts[k] == 0) continue;
+    kprintf("  %5u %7u %7u\n", k, counts[k], counts[k] << k);
+    freepages += counts[k] << k;
+    largest = 1U << k;
+  }
+  /* share of free memory not in the largest free block size */
+  kprintf("  %u pages free, largest block %u pages, fragmentation %u%%\n",
+	  freepages, largest,
+	  freepages ? 100 - largest * 100 / freepages : 0);
+  kprintf("  %lu allocs, %lu frees, %lu failed, %lu splits, %lu merges\n",
+	  buddyStats.allocs, buddyStats.frees, buddyStats.failures,
+	  buddyStats.splits, buddyStats.merges);
+  kprintf("  alloc+free latency: 1 page %lu ns, 8 pages %lu ns\n",
+	  buddy_probe(1), buddy_probe(8));
+  swap_printstats();
 }
 
-static int 
-freeppages(paddr_t addr, unsigned long npages){
-  long i, first, np=(long)npages;	
+/*
+ * Copy-on-write support. as_copy does not copy the parent's memory:
+ * parent and child point at the same frames, whose frameRefCount is
+ * raised, and map them read-only. The first write fault on a shared
+ * page gives the writer a private copy of that page.
+ */
+static void
+frames_share(paddr_t addr, unsigned long npages)
+{
+  unsigned i, first = addr/PAGE_SIZE;
 
-  if (!isTableActive()) return 0; 
-  first = addr/PAGE_SIZE;
-  KASSERT(allocSize!=NULL);
-  KASSERT(nRamFrames>first);
+  if (!isTableActive() || addr == 0) return;
+  spinlock_acquire(&freemem_lock);
+  for (i=first; i<first+npages; i++) {
+    KASSERT(frameRefCount[i] > 0);
+    frameRefCount[i]++;
+  }
+  spinlock_release(&freemem_lock);
+}
+
+/* Drop one reference to each frame, freeing those nobody uses any more. */
+static void
+frames_release(paddr_t addr, unsigned long npages)
+{
+  unsigned i, first = addr/PAGE_SIZE;
 
+  if (!isTableActive() || addr == 0) return;
   spinlock_acquire(&freemem_lock);
-  for (i=first; i<first+np; i++) {
-    freeRamFrames[i] = (unsigned char)1;
+  for (i=first; i<first+npages; i++) {
+    KASSERT(frameRefCount[i] > 0);
+    frameRefCount[i]--;
+    if (frameRefCount[i] == 0) {
+      /* user pages are single-frame blocks */
+      KASSERT(allocOrder[i] == 0);
+      buddy_free(i);
+    }
   }
   spinlock_release(&freemem_lock);
+}
 
-  return 1;
+static unsigned
+frame_refcount(paddr_t addr)
+{
+  unsigned count;
+
+  if (!isTableActive()) return 1;
+  spinlock_acquire(&freemem_lock);
+  count = frameRefCount[addr/PAGE_SIZE];
+  spinlock_release(&freemem_lock);
+  return count;
+}
+
+static void
+tlb_invalidate_all(void)
+{
+  int i, spl;
+
+  spl = splhigh();
+  for (i=0; i<NUM_TLB; i++) {
+    tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+  }
+  curcpu->c_tlb_invalidations++;
+  splx(spl);
+}
+
+/*
+ * Address space IDs. Each cpu hands out the TLB PIDs 1..NUM_TLBPIDS-1
+ * in order to the address spaces that run on it, stamped with its
+ * current generation. When they run out it flushes its TLB and starts
+ * a new generation, which makes every PID it handed out stale. So
+ * switching among a few processes keeps their TLB entries warm
+ * instead of flushing on every as_activate. With tlbUseAsids off
+ * (for comparison) everything runs with PID 0 and flushes as before.
+ *
+ * tlbLock covers handing out PIDs and publishing c_curas, so that a
+ * cpu deciding whether another one may still be using an address
+ * space cannot race with that cpu activating it.
+ */
+static bool tlbUseAsids = true;
+static struct spinlock tlbLock = SPINLOCK_INITIALIZER;
+
+bool
+vm_setasids(bool on)
+{
+  bool old = tlbUseAsids;
+
+  tlbUseAsids = on;
+  return old;
+}
+
+/* Return the PID field for AS on this cpu. Interrupts must be off. */
+static uint32_t
+as_tlbpid(struct addrspace *as)
+{
+  struct cpu *c = curcpu->c_self;
+  struct as_tlbpid *tp;
+
+  if (!tlbUseAsids || c->c_number >= AS_MAXCPUS) {
+    return 0;
+  }
+  tp = &as->as_tlbpid[c->c_number];
+  if (tp->tp_gen == 0 || tp->tp_gen != c->c_tlb_pidgen) {
+    if (c->c_tlb_nextpid == 0 || c->c_tlb_nextpid == NUM_TLBPIDS) {
+      tlb_invalidate_all();
+      c->c_tlb_pidgen++;
+      c->c_tlb_nextpid = 1;
+    }
+    tp->tp_gen = c->c_tlb_pidgen;
+    tp->tp_pid = c->c_tlb_nextpid++;
+  }
+  return tp->tp_pid << TLBHI_PIDSHIFT;
+}
+
+/*
+ * Make the TLB entries AS may have left behind unreachable, on every
+ * cpu or only on the others. It gets a fresh PID where it runs next.
+ * Called with tlbLock held.
+ */
+static void
+as_tlbforget(struct addrspace *as, bool othersonly)
+{
+  unsigned i;
+
+  KASSERT(spinlock_do_i_hold(&tlbLock));
+  for (i=0; i<AS_MAXCPUS; i++) {
+    if (othersonly && i == curcpu->c_number) continue;
+    as->as_tlbpid[i].tp_gen = 0;
+  }
+}
+
+/*
+ * Make sure no other cpu goes on using TLB entries for AS, after its
+ * pages were made read-only or given new frames. AS gets fresh PIDs
+ * (on every cpu, or only on the others), and the cpus that have it
+ * loaded right now also get their TLB flushed by IPI.
+ */
+static void
+as_shootdown(struct addrspace *as, bool othersonly)
+{
+  struct tlbshootdown ts;
+  struct cpu *c;
+  unsigned i;
+
+  bzero(&ts, sizeof(ts));
+  spinlock_acquire(&tlbLock);
+  as_tlbforget(as, othersonly);
+  for (i=0; i<cpu_count(); i++) {
+    c = cpu_get(i);
+    if (c != curcpu->c_self && c->c_curas == as) {
+      ipi_tlbshootdown(c, &ts);
+    }
+  }
+  spinlock_release(&tlbLock);
+}
+
+/*
+ * Load EHI/ELO into the TLB of this cpu: over an existing entry for
+ * the same page, else into a free slot, else over a victim chosen
+ * round-robin or (with the tlbrandom option) by the hardware's random
+ * register. Interrupts must be off.
+ */
+static void
+tlb_load(uint32_t ehi, uint32_t elo)
+{
+  uint32_t oehi, oelo;
+  int i;
+
+  curcpu->c_tlb_faults++;
+
+  /* a read-only entry for this page may already be there */
+  i = tlb_probe(ehi, 0);
+  if (i >= 0) {
+    tlb_write(ehi, elo, i);
+    return;
+  }
+
+  for (i=0; i<NUM_TLB; i++) {
+    tlb_read(&oehi, &oelo, i);
+    if (!(oelo & TLBLO_VALID)) {
+      tlb_write(ehi, elo, i);
+      return;
+    }
+  }
+
+  curcpu->c_tlb_replacements++;
+#if OPT_TLBRANDOM
+  tlb_random(ehi, elo);
+#else
+  tlb_write(ehi, elo, curcpu->c_tlb_victim);
+  curcpu->c_tlb_victim = (curcpu->c_tlb_victim + 1) % NUM_TLB;
+#endif
+}
+
+void
+vm_printtlbstats(bool reset)
+{
+  struct cpu *c;
+  unsigned n;
+
+  kprintf("TLB (%s replacement, address space IDs %s):\n",
+	  OPT_TLBRANDOM ? "random" : "round-robin",
+	  tlbUseAsids ? "on" : "off");
+  kprintf("  cpu      faults    replaced  flushes  replaced%%\n");
+  for (n=0; n<cpu_count(); n++) {
+    c = cpu_get(n);
+    kprintf("  %3u %11lu %11lu %8lu  %8lu%%\n", n, c->c_tlb_faults,
+	    c->c_tlb_replacements, c->c_tlb_invalidations,
+	    c->c_tlb_faults ?
+	      c->c_tlb_replacements * 100 / c->c_tlb_faults : 0);
+    if (reset) {
+      /* racy against the owning cpu, good enough for statistics */
+      c->c_tlb_faults = 0;
+      c->c_tlb_replacements = 0;
+      c->c_tlb_invalidations = 0;
+    }
+  }
+}
+
+static void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+  bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -213,31 +654,314 @@ alloc_kpages(unsigned npages)
 
 void 
 free_kpages(vaddr_t addr){
-  if (isTableActive()) {
-    paddr_t paddr = addr - MIPS_KSEG0;
-    long first = paddr/PAGE_SIZE;	
-    KASSERT(allocSize!=NULL);
-    KASSERT(nRamFrames>first);
-    freeppages(paddr, allocSize[first]);	
-  }
+  freeppages(addr - MIPS_KSEG0);
 }
 
+/* Every shootdown flushes the whole TLB; see as_shootdown. */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
 	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	tlb_invalidate_all();
+}
+
+/*
+ * Find the regions containing VADDR. Returns false if there are none,
+ * otherwise sets *WRITEABLE if any of them may be written.
+ */
+static bool
+as_lookup(struct addrspace *as, vaddr_t vaddr, bool *writeable)
+{
+	struct as_region *r;
+	unsigned i;
+	bool found = false;
+
+	*writeable = false;
+	for (i=0; i<as->as_nregions; i++) {
+		r = &as->as_regions[i];
+		if (vaddr >= r->ar_vbase &&
+		    vaddr < r->ar_vbase + r->ar_npages * PAGE_SIZE) {
+			found = true;
+			if (r->ar_writeable) {
+				*writeable = true;
+			}
+		}
+	}
+	return found;
+}
+
+/*
+ * Return the page table entry for VADDR, or NULL if its second level
+ * table does not exist and CREATE is false or it cannot be allocated.
+ */
+static uint32_t *
+as_pte(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	uint32_t **tabp;
+
+	tabp = &as->as_ptdir[PT_DIRINDEX(vaddr)];
+	if (*tabp == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		*tabp = kmalloc(PT_TABSIZE * sizeof(uint32_t));
+		if (*tabp == NULL) {
+			return NULL;
+		}
+		bzero(*tabp, PT_TABSIZE * sizeof(uint32_t));
+	}
+	return &(*tabp)[PT_TABINDEX(vaddr)];
+}
+
+/*
+ * Fill the (already zeroed) frame PADDR that backs page VADDR with
+ * whatever parts of the executable the regions map there.
+ */
+static int
+as_fill_page(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	struct as_region *r;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t lo, hi;
+	unsigned i;
+	int result;
+
+	for (i=0; i<as->as_nregions; i++) {
+		r = &as->as_regions[i];
+		if (r->ar_filesize == 0) {
+			continue;
+		}
+		lo = r->ar_filevaddr > vaddr ? r->ar_filevaddr : vaddr;
+		hi = r->ar_filevaddr + r->ar_filesize;
+		if (hi > vaddr + PAGE_SIZE) {
+			hi = vaddr + PAGE_SIZE;
+		}
+		if (lo >= hi) {
+			continue;
+		}
+
+		KASSERT(as->as_file != NULL);
+		uio_kinit(&iov, &ku,
+			  (void *)(PADDR_TO_KVADDR(paddr) + (lo - vaddr)),
+			  hi - lo, r->ar_fileoffset + (lo - r->ar_filevaddr),
+			  UIO_READ);
+		result = VOP_READ(as->as_file, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			kprintf("dumbvm: short read paging in 0x%x\n", vaddr);
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Drop the TLB entry for VADDR of AS before its page goes out. Returns
+ * false if AS may be running on another cpu, whose TLB we cannot
+ * reach synchronously; the caller then picks another victim. This is
+ * all done under tlbLock, which as_activate holds to load AS and
+ * publish c_curas; so no other cpu can start using AS, with a PID
+ * whose TLB entries may still map the page, after the check.
+ */
+static bool
+vm_unmap(struct addrspace *as, vaddr_t vaddr)
+{
+	struct cpu *c;
+	uint32_t pid;
+	unsigned i;
+	bool here;
+	int idx;
+
+	spinlock_acquire(&tlbLock);
+	here = curcpu->c_curas == as;
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		if (c != curcpu->c_self && c->c_curas == as) {
+			spinlock_release(&tlbLock);
+			return false;
+		}
+	}
+	/* any PID AS had elsewhere is stale from now on */
+	as_tlbforget(as, here);
+	if (here) {
+		pid = as_tlbpid(as);
+		idx = tlb_probe(vaddr | pid, 0);
+		if (idx >= 0) {
+			tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+		}
+		tlb_setpid(pid);
+	}
+	spinlock_release(&tlbLock);
+	return true;
+}
+
+/*
+ * Page out one user page chosen by the clock (second chance on
+ * fi_ref) and return its frame, or 0 if there is no candidate or no
+ * swap space left. Called with vmLock held; drops it during the write.
+ */
+static paddr_t
+vm_evict(void)
+{
+	struct frameinfo *fi = NULL;
+	struct addrspace *as;
+	uint32_t *pte;
+	paddr_t paddr;
+	vaddr_t vaddr;
+	unsigned n, frame = 0, slot;
+	bool found = false;
+	int result;
+
+	KASSERT(lock_do_i_hold(vmLock));
+	if (swap_alloc(&slot)) {
+		return 0;
+	}
+
+	/* two sweeps: the first may only clear reference bits */
+	for (n=0; n < 2*(nRamFrames - firstFrame) && !found; n++) {
+		frame = clockHand;
+		clockHand = frame + 1 < nRamFrames ? frame + 1 : firstFrame;
+		fi = &frameInfo[frame];
+		if (fi->fi_as == NULL) {
+			continue;
+		}
+		if (fi->fi_ref) {
+			fi->fi_ref = false;
+			continue;
+		}
+		found = vm_unmap(fi->fi_as, fi->fi_vaddr);
+	}
+	if (!found) {
+		swap_free(slot);
+		return 0;
+	}
+
+	as = fi->fi_as;
+	vaddr = fi->fi_vaddr;
+	paddr = (paddr_t)frame * PAGE_SIZE;
+	pte = as_pte(as, vaddr, false);
+	KASSERT(pte != NULL && (*pte & PTE_VALID));
+	KASSERT((*pte & PTE_FRAME) == paddr);
+
+	/* as_destroy waits for PTE_BUSY, so AS stays around */
+	*pte = PTE_BUSY;
+	fi->fi_as = NULL;
+	lock_release(vmLock);
+	result = swap_out(paddr, slot);
+	lock_acquire(vmLock);
+
+	if (result) {
+		kprintf("dumbvm: page-out of 0x%x: %s\n", vaddr,
+			strerror(result));
+		*pte = paddr | PTE_VALID;
+		fi->fi_as = as;
+		swap_free(slot);
+		cv_broadcast(vmBusyCv, vmLock);
+		return 0;
+	}
+	*pte = PTE_SWAPPED | PTE_MKSLOT(slot);
+	as->as_resident--;
+	cv_broadcast(vmBusyCv, vmLock);
+	return paddr;
+}
+
+/*
+ * Get a frame for a user page: page something out first if free
+ * memory is low and swap is attached. Kernel allocations never wait
+ * for a page-out. Called with vmLock held.
+ */
+static paddr_t
+vm_userpage(void)
+{
+	paddr_t paddr;
+	unsigned nfree;
+
+	if (swap_enabled()) {
+		spinlock_acquire(&freemem_lock);
+		nfree = freePages;
+		spinlock_release(&freemem_lock);
+		if (nfree < VM_FREETARGET) {
+			paddr = vm_evict();
+			if (paddr != 0) {
+				return paddr;
+			}
+		}
+	}
+	return getppages(1);
+}
+
+/* Record that the frame at PADDR now holds page VADDR of AS. */
+static void
+vm_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct frameinfo *fi;
+
+	if (!isTableActive() || paddr/PAGE_SIZE < firstFrame) {
+		return;
+	}
+	fi = &frameInfo[paddr/PAGE_SIZE];
+	fi->fi_as = as;
+	fi->fi_vaddr = vaddr;
+	fi->fi_ref = true;
+}
+
+/*
+ * Bring page VADDR of AS, whose entry PTE is not valid, into memory:
+ * from swap if it was paged out, otherwise zero-filled plus whatever
+ * the executable has there. Called with vmLock held; drops it for I/O.
+ */
+static int
+vm_pagein(struct addrspace *as, vaddr_t vaddr, uint32_t *pte)
+{
+	paddr_t paddr;
+	uint32_t old;
+	int result;
+
+	paddr = vm_userpage();
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	old = *pte;
+	*pte = PTE_BUSY;
+	lock_release(vmLock);
+	if (old & PTE_SWAPPED) {
+		result = swap_in(paddr, PTE_SLOT(old));
+	}
+	else {
+		as_zero_region(paddr, 1);
+		result = as_fill_page(as, vaddr, paddr);
+	}
+	lock_acquire(vmLock);
+
+	if (result) {
+		*pte = old;
+		frames_release(paddr, 1);
+		cv_broadcast(vmBusyCv, vmLock);
+		return result;
+	}
+	if (old & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(old));
+	}
+	*pte = paddr | PTE_VALID;
+	vm_setowner(paddr, as, vaddr);
+	as->as_resident++;
+	cv_broadcast(vmBusyCv, vmLock);
+	return 0;
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	paddr_t paddr;
-	int i;
+	paddr_t paddr, newpaddr;
+	uint32_t *pte;
+	int result;
 	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
+	bool writeable;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -245,8 +969,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
+		/* write to a page shared copy-on-write */
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -272,62 +995,73 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
+	if (!as_lookup(as, faultaddress, &writeable)) {
+		return EFAULT;
+	}
+	if (faulttype != VM_FAULT_READ && !writeable) {
+		return EFAULT;
+	}
 
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
+	lock_acquire(vmLock);
+	pte = as_pte(as, faultaddress, true);
+	if (pte == NULL) {
+		lock_release(vmLock);
+		return ENOMEM;
 	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
+	while (*pte & PTE_BUSY) {
+		/* being paged out */
+		cv_wait(vmBusyCv, vmLock);
 	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
+
+	if ((*pte & PTE_VALID) == 0) {
+		/* first touch, or paged out */
+		result = vm_pagein(as, faultaddress, pte);
+		if (result) {
+			lock_release(vmLock);
+			return result;
+		}
 	}
-	else {
-		return EFAULT;
+	paddr = *pte & PTE_FRAME;
+
+	if (faulttype != VM_FAULT_READ && frame_refcount(paddr) > 1) {
+		/* break the copy-on-write sharing of this page */
+		newpaddr = vm_userpage();
+		if (newpaddr == 0) {
+			lock_release(vmLock);
+			return ENOMEM;
+		}
+		/* shared frames are never paged out, so PADDR is still ours */
+		memmove((void *)PADDR_TO_KVADDR(newpaddr),
+			(const void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		frames_release(paddr, 1);
+		paddr = newpaddr;
+		*pte = paddr | PTE_VALID;
+		vm_setowner(paddr, as, faultaddress);
+		/* other cpus may still map the old frame */
+		as_shootdown(as, true);
+	}
+	if (frame_refcount(paddr) == 1) {
+		/* (again) our own page: referenced, and fair game */
+		vm_setowner(paddr, as, faultaddress);
 	}
 
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
+	elo = paddr | TLBLO_VALID;
+	if (writeable && frame_refcount(paddr) == 1) {
+		/* still shared pages stay read-only until copied */
+		elo |= TLBLO_DIRTY;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
+	/* (tlbLock also keeps interrupts off while frobbing the TLB) */
+	spinlock_acquire(&tlbLock);
+	ehi = faultaddress | as_tlbpid(as);
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tlb_load(ehi, elo);
+	spinlock_release(&tlbLock);
+	lock_release(vmLock);
+	return 0;
 }
 
 struct addrspace *
@@ -338,29 +1072,56 @@ as_create(void)
 		return NULL;
 	}
 
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_stackpbase = 0;
+	bzero(as->as_ptdir, sizeof(as->as_ptdir));
+	as->as_nregions = 0;
+	as->as_file = NULL;
+	as->as_resident = 0;
+	bzero(as->as_tlbpid, sizeof(as->as_tlbpid));
 
 	return as;
 }
 
 void as_destroy(struct addrspace *as){
+  unsigned i, j;
+
+  uint32_t *pte;
+  paddr_t paddr;
+
   dumbvm_can_sleep();
-  freeppages(as->as_pbase1, as->as_npages1);
-  freeppages(as->as_pbase2, as->as_npages2);
-  freeppages(as->as_stackpbase, DUMBVM_STACKPAGES);
+  DEBUG(DB_VM, "dumbvm: as_destroy: %u pages resident\n", as->as_resident);
+  lock_acquire(vmLock);
+  for (i=0; i<PT_DIRSIZE; i++) {
+    if (as->as_ptdir[i] == NULL) continue;
+    for (j=0; j<PT_TABSIZE; j++) {
+      pte = &as->as_ptdir[i][j];
+      while (*pte & PTE_BUSY) {
+        /* wait for the page-out to finish with it */
+        cv_wait(vmBusyCv, vmLock);
+      }
+      /* frames still shared with a fork relative are only unreferenced */
+      if (*pte & PTE_VALID) {
+        paddr = *pte & PTE_FRAME;
+        if (frameInfo != NULL && frameInfo[paddr/PAGE_SIZE].fi_as == as) {
+          frameInfo[paddr/PAGE_SIZE].fi_as = NULL;
+        }
+        frames_release(paddr, 1);
+      }
+      else if (*pte & PTE_SWAPPED) {
+        swap_free(PTE_SLOT(*pte));
+      }
+    }
+    kfree(as->as_ptdir[i]);
+  }
+  lock_release(vmLock);
+  if (as->as_file != NULL) {
+    VOP_DECREF(as->as_file);
+  }
   kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -368,14 +1129,15 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	/* (tlbLock also keeps interrupts off while frobbing the TLB) */
+	spinlock_acquire(&tlbLock);
+	if (!tlbUseAsids || curcpu->c_number >= AS_MAXCPUS) {
+		tlb_invalidate_all();
 	}
-
-	splx(spl);
+	/* kernel-only threads leave the last PID in place */
+	tlb_setpid(as_tlbpid(as));
+	curcpu->c_curas = as;
+	spinlock_release(&tlbLock);
 }
 
 void
@@ -384,6 +1146,26 @@ as_deactivate(void)
 	/* nothing */
 }
 
+static int
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	      int writeable)
+{
+	struct as_region *r;
+
+	if (as->as_nregions == AS_MAXREGIONS) {
+		kprintf("dumbvm: Warning: too many regions\n");
+		return ENOSYS;
+	}
+	r = &as->as_regions[as->as_nregions++];
+	r->ar_vbase = vaddr;
+	r->ar_npages = npages;
+	r->ar_writeable = writeable;
+	r->ar_filevaddr = vaddr;
+	r->ar_filesize = 0;
+	r->ar_fileoffset = 0;
+	return 0;
+}
+
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
@@ -401,65 +1183,66 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
-	/* We don't use these - all pages are read-write */
+	/* Every page is readable; only writes are checked */
 	(void)readable;
-	(void)writeable;
 	(void)executable;
 
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		return 0;
-	}
+	return as_add_region(as, vaddr, npages, writeable);
+}
 
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		return 0;
+/*
+ * Attach the executable contents to the region that load_elf defined
+ * at VADDR. Nothing is read here: vm_fault does that page by page.
+ */
+int
+as_define_file(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t filesize)
+{
+	struct as_region *r;
+	unsigned i;
+
+	for (i=0; i<as->as_nregions; i++) {
+		r = &as->as_regions[i];
+		if (vaddr >= r->ar_vbase &&
+		    vaddr + filesize <= r->ar_vbase + r->ar_npages * PAGE_SIZE) {
+			break;
+		}
 	}
-
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	kprintf("dumbvm: Warning: too many regions\n");
-	return ENOSYS;
+	if (i == as->as_nregions) {
+		return EFAULT;
+	}
+	if (as->as_file != NULL && as->as_file != v) {
+		/* all segments come from the one executable */
+		return EINVAL;
+	}
+	if (as->as_file == NULL) {
+		VOP_INCREF(v);
+		as->as_file = v;
+	}
+	r->ar_filevaddr = vaddr;
+	r->ar_filesize = filesize;
+	r->ar_fileoffset = offset;
+	return 0;
 }
 
-static
 void
-as_zero_region(paddr_t paddr, unsigned npages)
+as_getsize(struct addrspace *as, unsigned *virtpages, unsigned *respages)
 {
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+	unsigned i;
+
+	*virtpages = 0;
+	for (i=0; i<as->as_nregions; i++) {
+		*virtpages += as->as_regions[i].ar_npages;
+	}
+	*respages = as->as_resident;
 }
 
 int
 as_prepare_load(struct addrspace *as)
 {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
-
+	/* nothing is allocated until it is touched */
 	dumbvm_can_sleep();
-
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
-		return ENOMEM;
-	}
-
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
-		return ENOMEM;
-	}
-
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
-		return ENOMEM;
-	}
-
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
-
+	(void)as;
 	return 0;
 }
 
@@ -474,7 +1257,13 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	KASSERT(as->as_stackpbase != 0);
+	int result;
+
+	result = as_add_region(as, USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE,
+			       DUMBVM_STACKPAGES, 1);
+	if (result) {
+		return result;
+	}
 
 	*stackptr = USERSTACK;
 	return 0;
@@ -484,6 +1273,8 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	paddr_t paddr;
+	unsigned i, j;
 
 	dumbvm_can_sleep();
 
@@ -492,32 +1283,73 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
-
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
+	memcpy(new->as_regions, old->as_regions, sizeof(old->as_regions));
+	new->as_nregions = old->as_nregions;
+	new->as_file = old->as_file;
+	if (new->as_file != NULL) {
+		VOP_INCREF(new->as_file);
 	}
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
+	lock_acquire(vmLock);
+	for (i=0; i<PT_DIRSIZE; i++) {
+		if (old->as_ptdir[i] == NULL) {
+			continue;
+		}
+		new->as_ptdir[i] = kmalloc(PT_TABSIZE * sizeof(uint32_t));
+		if (new->as_ptdir[i] == NULL) {
+			lock_release(vmLock);
+			as_destroy(new);
+			return ENOMEM;
+		}
+		bzero(new->as_ptdir[i], PT_TABSIZE * sizeof(uint32_t));
+		for (j=0; j<PT_TABSIZE; j++) {
+			while (old->as_ptdir[i][j] & PTE_BUSY) {
+				cv_wait(vmBusyCv, vmLock);
+			}
+			new->as_ptdir[i][j] = old->as_ptdir[i][j];
+			if (old->as_ptdir[i][j] & PTE_SWAPPED) {
+				/* both read the same slot back */
+				swap_share(PTE_SLOT(old->as_ptdir[i][j]));
+				continue;
+			}
+			if ((old->as_ptdir[i][j] & PTE_VALID) == 0) {
+				continue;
+			}
+			paddr = old->as_ptdir[i][j] & PTE_FRAME;
+			if (isTableActive()) {
+				/* whoever writes first gets the copy */
+				frames_share(paddr, 1);
+				/* and it stays resident until then */
+				frameInfo[paddr/PAGE_SIZE].fi_as = NULL;
+			}
+			else {
+				/* no reference counts: copy now */
+				paddr = getppages(1);
+				if (paddr == 0) {
+					new->as_ptdir[i][j] = 0;
+					lock_release(vmLock);
+					as_destroy(new);
+					return ENOMEM;
+				}
+				memmove((void *)PADDR_TO_KVADDR(paddr),
+					(const void *)PADDR_TO_KVADDR(
+					    old->as_ptdir[i][j] & PTE_FRAME),
+					PAGE_SIZE);
+				new->as_ptdir[i][j] = paddr | PTE_VALID;
+			}
+			new->as_resident++;
+		}
+	}
+	lock_release(vmLock);
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		DUMBVM_STACKPAGES*PAGE_SIZE);
+	/*
+	 * The parent may still hold writable TLB entries for what are
+	 * now shared frames, here and on the cpus it ran on before.
+	 */
+	as_shootdown(old, false);
+	if (old == proc_getas()) {
+		as_activate();
+	}
 
 	*ret = new;
 	return 0;
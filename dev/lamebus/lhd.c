@@ -36,7 +36,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -60,6 +60,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Most sectors per request when lhd_io has to copy the data */
+#define LHD_MAXBOUNCE   16
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,41 +99,152 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the disk on the current sector of the active request.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct lhd_request *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL && req->lr_cur < req->lr_nsect);
+
+	/* If writing, transfer the data to the on-card buffer. */
+	if (req->lr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)req->lr_data + req->lr_cur * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want, and start the operation. */
+	lh->lh_headpos = req->lr_sector + req->lr_cur;
+	lhd_wreg(lh, LHD_REG_SECT, lh->lh_headpos);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * The disk is idle: start the next pending request, if any. That is
+ * the first one at or past the sector the head is on, or failing
+ * that the first one of all.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_startnext(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request **rp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lh->lh_active == NULL);
+
+	for (rp = &lh->lh_pending; *rp != NULL; rp = &(*rp)->lr_next) {
+		if ((*rp)->lr_sector >= lh->lh_headpos) {
+			break;
+		}
+	}
+	if (*rp == NULL) {
+		rp = &lh->lh_pending;
+	}
+	if (*rp == NULL) {
+		return;
+	}
+
+	lh->lh_active = *rp;
+	*rp = lh->lh_active->lr_next;
+	lh->lh_active->lr_next = NULL;
+	lhd_startsector(lh);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, and either start the next sector of the request or finish
+ * the request, start the next one, and call the completion function.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct lhd_request *req;
 	uint32_t val;
+	int result;
+
+	spinlock_acquire(&lh->lh_lock);
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
-		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	lhd_wreg(lh, LHD_REG_STAT, 0);
+	result = lhd_code_to_errno(lh, val);
+
+	req = lh->lh_active;
+	if (req == NULL) {
+		/* Not ours; ignore it */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/* If reading, transfer the data out of the on-card buffer. */
+	if (result == 0 && !req->lr_write) {
+		membar_load_load();
+		memcpy((char *)req->lr_data + req->lr_cur * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+
+	req->lr_cur++;
+	if (result == 0 && req->lr_cur < req->lr_nsect) {
+		lhd_startsector(lh);
+		spinlock_release(&lh->lh_lock);
+		return;
 	}
+
+	lh->lh_active = NULL;
+	lhd_startnext(lh);
+	spinlock_release(&lh->lh_lock);
+
+	req->lr_done(req, result);
+}
+
+/*
+ * Queue a request. Fails only if the sectors aren't on the disk.
+ */
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_request *req)
+{
+	struct lhd_request **rp;
+
+	if (req->lr_nsect == 0 ||
+	    req->lr_sector >= lh->lh_dev.d_blocks ||
+	    req->lr_nsect > lh->lh_dev.d_blocks - req->lr_sector) {
+		return EINVAL;
+	}
+	req->lr_cur = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+	for (rp = &lh->lh_pending; *rp != NULL; rp = &(*rp)->lr_next) {
+		if ((*rp)->lr_sector > req->lr_sector) {
+			break;
+		}
+	}
+	req->lr_next = *rp;
+	*rp = req;
+	if (lh->lh_active == NULL) {
+		lhd_startnext(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+	return 0;
 }
 
 /*
@@ -179,8 +293,175 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Synchronous I/O: a batch of requests, submitted together, whose
+ * last completion wakes up the thread that submitted them.
+ */
+struct lhd_wait {
+	struct lhd_softc *lw_lh;
+	unsigned lw_pending;		/* requests not yet finished */
+	int lw_result;			/* first error */
+};
+
+static
+void
+lhd_waitdone(struct lhd_request *req, int result)
+{
+	struct lhd_wait *lw = req->lr_arg;
+	struct lhd_softc *lh = lw->lw_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	if (lw->lw_result == 0) {
+		lw->lw_result = result;
+	}
+	KASSERT(lw->lw_pending > 0);
+	lw->lw_pending--;
+	if (lw->lw_pending == 0) {
+		wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Do the N requests in REQS, of which the caller has filled in the
+ * sectors and data, and wait for all of them.
+ */
+static
+int
+lhd_runreqs(struct lhd_softc *lh, struct lhd_request *reqs, unsigned n,
+	    enum uio_rw rw)
+{
+	struct lhd_wait lw;
+	unsigned i;
+	int result;
+
+	lw.lw_lh = lh;
+	lw.lw_pending = n;
+	lw.lw_result = 0;
+
+	for (i=0; i<n; i++) {
+		reqs[i].lr_write = (rw == UIO_WRITE);
+		reqs[i].lr_done = lhd_waitdone;
+		reqs[i].lr_arg = &lw;
+		result = lhd_submit(lh, &reqs[i]);
+		if (result) {
+			/* don't wait for this one and the rest */
+			spinlock_acquire(&lh->lh_lock);
+			if (lw.lw_result == 0) {
+				lw.lw_result = result;
+			}
+			lw.lw_pending -= n - i;
+			spinlock_release(&lh->lh_lock);
+			break;
+		}
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	while (lw.lw_pending > 0) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return lw.lw_result;
+}
+
+static
+int
+lhd_rw(struct lhd_softc *lh, uint32_t sector, uint32_t nsect, void *data,
+       enum uio_rw rw)
+{
+	struct lhd_request req;
+
+	req.lr_sector = sector;
+	req.lr_nsect = nsect;
+	req.lr_data = data;
+	return lhd_runreqs(lh, &req, 1, rw);
+}
+
+/*
+ * Transfer the whole of UIO, a kernel uio whose iovecs each hold
+ * whole sectors, straight to or from its buffers: one request per
+ * iovec, all submitted at once, so that the disk goes from one to
+ * the next without waiting for us and we are woken once at the end.
+ * Returns EAGAIN, having done nothing, if the iovecs aren't like that.
+ */
+static
+int
+lhd_iodirect(struct lhd_softc *lh, struct uio *uio)
+{
+	struct lhd_request *reqs;
+	struct iovec *iov;
+	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
+	size_t resid, n;
+	unsigned i, nreqs;
+	int result;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return EAGAIN;
+	}
+
+	nreqs = 0;
+	resid = uio->uio_resid;
+	for (i=0; i<uio->uio_iovcnt && resid > 0; i++) {
+		n = uio->uio_iov[i].iov_len < resid ?
+			uio->uio_iov[i].iov_len : resid;
+		if (n % LHD_SECTSIZE != 0) {
+			return EAGAIN;
+		}
+		if (n > 0) {
+			nreqs++;
+		}
+		resid -= n;
+	}
+	KASSERT(resid == 0);
+
+	reqs = kmalloc(nreqs * sizeof(struct lhd_request));
+	if (reqs == NULL) {
+		return EAGAIN;
+	}
+
+	nreqs = 0;
+	resid = uio->uio_resid;
+	for (i=0; i<uio->uio_iovcnt && resid > 0; i++) {
+		iov = &uio->uio_iov[i];
+		n = iov->iov_len < resid ? iov->iov_len : resid;
+		if (n == 0) {
+			continue;
+		}
+		reqs[nreqs].lr_sector = sector;
+		reqs[nreqs].lr_nsect = n / LHD_SECTSIZE;
+		reqs[nreqs].lr_data = iov->iov_kbase;
+		nreqs++;
+		sector += n / LHD_SECTSIZE;
+		resid -= n;
+	}
+
+	result = lhd_runreqs(lh, reqs, nreqs, uio->uio_rw);
+	kfree(reqs);
+	if (result) {
+		return result;
+	}
+
+	/* Account for the transfer as uiomove would */
+	resid = uio->uio_resid;
+	for (i=0; i<uio->uio_iovcnt && resid > 0; i++) {
+		iov = &uio->uio_iov[i];
+		n = iov->iov_len < resid ? iov->iov_len : resid;
+		iov->iov_kbase = (char *)iov->iov_kbase + n;
+		iov->iov_len -= n;
+		resid -= n;
+	}
+	uio->uio_offset += uio->uio_resid;
+	uio->uio_resid = 0;
+	return 0;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * Kernel buffers holding whole sectors are handed to the disk as they
+ * are, in one batch. Anything else is copied through a bounce buffer,
+ * LHD_MAXBOUNCE sectors at a time.
  */
 static
 int
@@ -192,9 +473,9 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
+	uint32_t i, n;
+	char *buf;
+	int result = 0;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -202,66 +483,44 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (sector > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	result = lhd_iodirect(lh, uio);
+	if (result != EAGAIN) {
+		return result;
+	}
+	result = 0;
+
+	n = len < LHD_MAXBOUNCE ? len : LHD_MAXBOUNCE;
+	buf = kmalloc(n * LHD_SECTSIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	for (i=0; i<len && result == 0; i += n) {
+		n = len - i < LHD_MAXBOUNCE ? len - i : LHD_MAXBOUNCE;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+			result = uiomove(buf, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		result = lhd_rw(lh, sector + i, n, buf, uio->uio_rw);
+		if (result == 0 && uio->uio_rw == UIO_READ) {
+			result = uiomove(buf, n * LHD_SECTSIZE, uio);
 		}
 	}
 
-	return 0;
+	kfree(buf);
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,17 +543,15 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
+	spinlock_init(&lh->lh_lock);
+	lh->lh_active = NULL;
+	lh->lh_pending = NULL;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -31,12 +31,42 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * A request for I/O on a run of sectors. Fill in the first part and
+ * pass it to lhd_submit, which returns at once; when the request is
+ * finished, successfully or not, LR_DONE is called with the result.
+ * That happens in the interrupt handler, so it must not sleep. It may
+ * submit another request.
+ *
+ * The data goes to or from LR_DATA, which is a kernel buffer of
+ * LR_NSECT sectors; the interrupt handler copies it sector by sector
+ * between there and the on-card buffer, starting the next sector
+ * itself, so a request costs one wakeup however long it is.
+ *
+ * Pending requests are kept in sector order and served in C-LOOK
+ * elevator order: the next one is the first at or past the sector
+ * last done, wrapping around to the lowest.
+ */
+struct lhd_request {
+	uint32_t lr_sector;		/* first sector */
+	uint32_t lr_nsect;		/* number of sectors */
+	void *lr_data;			/* the data */
+	bool lr_write;			/* write, not read */
+	void (*lr_done)(struct lhd_request *, int result);
+	void *lr_arg;			/* for LR_DONE's use */
+
+	/* Private to the driver */
+	uint32_t lr_cur;		/* sectors done so far */
+	struct lhd_request *lr_next;	/* on the pending list */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +81,11 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the following */
+	struct lhd_request *lh_active;	/* Request the disk is working on */
+	struct lhd_request *lh_pending;	/* Waiting requests, by sector */
+	uint32_t lh_headpos;		/* Sector last started */
+	struct wchan *lh_wchan;		/* For lhd_io to wait on */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +93,7 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Start an I/O request */
+int lhd_submit(struct lhd_softc *lh, struct lhd_request *req);
+
 #endif /* _LAMEBUS_LHD_H_ */
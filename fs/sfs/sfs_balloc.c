@@ -33,49 +33,251 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/* How far past the goal sfs_balloc_near looks */
+#define SFS_NEARSEARCH  64
+
+/* Blocks per region of the free space summary */
+#define SFS_REGIONBITS  256
+
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This doesn't go through the journal: a new
+ * block of metadata is journaled whole when it is filled in, and file
+ * data isn't journaled at all.
  */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), SFS_BLOCKSIZE);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Free space summary
+//
+// The freemap is divided into regions of SFS_REGIONBITS blocks, with
+// a count of the free blocks in each, so that allocation can pass
+// over full regions without looking at their bits. Allocation goes
+// on from the region it last allocated from (sfs_cursor), rather than
+// from block 0 every time, so the full part of the disk isn't scanned
+// over and over. All of it is under sfs_freemaplock.
+
 /*
- * Allocate a block.
+ * Count the free blocks in each region. Called at mount.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_freemap_summarize(struct sfs_fs *sfs)
 {
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	unsigned nregions;
+	daddr_t block;
+
+	nregions = DIVROUNDUP(nblocks, SFS_REGIONBITS);
+	sfs->sfs_regfree = kmalloc(nregions * sizeof(uint16_t));
+	if (sfs->sfs_regfree == NULL) {
+		return ENOMEM;
+	}
+	bzero(sfs->sfs_regfree, nregions * sizeof(uint16_t));
+	sfs->sfs_nregions = nregions;
+	sfs->sfs_cursor = 0;
+
+	for (block = 0; block < nblocks; block++) {
+		if (!bitmap_isset(sfs->sfs_freemap, block)) {
+			sfs->sfs_regfree[block / SFS_REGIONBITS]++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Mark BLOCK, which is free, in use.
+ */
+static
+void
+sfs_freemap_take(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(sfs->sfs_regfree[block / SFS_REGIONBITS] > 0);
+
+	bitmap_mark(sfs->sfs_freemap, block);
+	sfs->sfs_regfree[block / SFS_REGIONBITS]--;
+}
+
+/*
+ * Write the freemap block holding BLOCK's bit, so that the change
+ * goes in the running transaction. If that fails, sfs_sync writes the
+ * whole freemap instead.
+ */
+static
+void
+sfs_freemap_write(struct sfs_fs *sfs, daddr_t block)
+{
+	char *data = bitmap_getdata(sfs->sfs_freemap);
+	uint32_t j = block / SFS_BITSPERBLOCK;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sfs_writeblock(sfs, SFS_FREEMAP_START + j,
+			   data + j * SFS_BLOCKSIZE, SFS_BLOCKSIZE)) {
+		sfs->sfs_freemapdirty = true;
+	}
+}
+
+/*
+ * Find a free block in REGION, which the summary says has one.
+ */
+static
+daddr_t
+sfs_freemap_search(struct sfs_fs *sfs, unsigned region)
+{
+	const unsigned char *map = bitmap_getdata(sfs->sfs_freemap);
+	daddr_t block, end;
+
+	block = region * SFS_REGIONBITS;
+	end = block + SFS_REGIONBITS;
+	if (end > sfs->sfs_sb.sb_nblocks) {
+		end = sfs->sfs_sb.sb_nblocks;
+	}
+	while (block < end) {
+		/* skip whole bytes of the freemap that are full */
+		if (block % CHAR_BIT == 0 && map[block / CHAR_BIT] == 0xff) {
+			block += CHAR_BIT;
+			continue;
+		}
+		if (!bitmap_isset(sfs->sfs_freemap, block)) {
+			return block;
+		}
+		block++;
+	}
+	panic("sfs: %s: region %u has %u free blocks, but none found\n",
+	      sfs->sfs_sb.sb_volname, region, sfs->sfs_regfree[region]);
+}
+
+////////////////////////////////////////////////////////////
+// Allocation
+
+/*
+ * Allocate a block, preferably GOAL or one shortly after it, so that
+ * consecutive blocks of a file end up together on disk. If there is
+ * nothing free there, or GOAL is 0, take the first free block from
+ * the allocation cursor on.
+ *
+ * The block is zeroed (in the buffer cache) if ZERO is set. Callers
+ * that are about to overwrite all of it anyway can save that.
+ */
+int
+sfs_balloc_near(struct sfs_fs *sfs, daddr_t goal, bool zero,
+		daddr_t *diskblock)
+{
+	daddr_t block, limit;
+	unsigned i, region;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	limit = goal + SFS_NEARSEARCH;
+	if (limit > sfs->sfs_sb.sb_nblocks) {
+		limit = sfs->sfs_sb.sb_nblocks;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = ENOSPC;
+	for (block = goal; goal != 0 && block < limit; block++) {
+		if (!bitmap_isset(sfs->sfs_freemap, block)) {
+			result = 0;
+			break;
+		}
+	}
+	for (i=0; result && i<sfs->sfs_nregions; i++) {
+		region = (sfs->sfs_cursor + i) % sfs->sfs_nregions;
+		if (sfs->sfs_regfree[region] > 0) {
+			block = sfs_freemap_search(sfs, region);
+			sfs->sfs_cursor = region;
+			result = 0;
+		}
+	}
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
+	sfs_freemap_take(sfs, block);
+	sfs_freemap_write(sfs, block);
+	lock_release(sfs->sfs_freemaplock);
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
+	if (block >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
-		      sfs->sfs_sb.sb_volname, *diskblock);
+		      sfs->sfs_sb.sb_volname, block);
 	}
 
 	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
-	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+	if (zero) {
+		result = sfs_clearblock(sfs, block);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
 	}
-	return result;
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Allocate a block, anywhere, zeroed.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+{
+	return sfs_balloc_near(sfs, 0, true, diskblock);
+}
+
+/*
+ * Allocate N consecutive blocks, for the journal. This looks at every
+ * bit of the freemap, but is done once in the life of a volume.
+ */
+int
+sfs_balloc_run(struct sfs_fs *sfs, unsigned n, daddr_t *start)
+{
+	daddr_t block, first;
+	unsigned run = 0;
+
+	KASSERT(n > 0);
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (block = 0; block < sfs->sfs_sb.sb_nblocks; block++) {
+		if (bitmap_isset(sfs->sfs_freemap, block)) {
+			run = 0;
+			continue;
+		}
+		if (++run < n) {
+			continue;
+		}
+		first = block - (n - 1);
+		for (block = first; block < first + n; block++) {
+			sfs_freemap_take(sfs, block);
+		}
+		sfs_freemap_write(sfs, first);
+		sfs_freemap_write(sfs, first + n - 1);
+		lock_release(sfs->sfs_freemaplock);
+		*start = first;
+		return 0;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return ENOSPC;
 }
 
 /*
@@ -84,8 +286,13 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(bitmap_isset(sfs->sfs_freemap, diskblock));
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	sfs->sfs_regfree[diskblock / SFS_REGIONBITS]++;
+	sfs_freemap_write(sfs, diskblock);
+	sfs_jrevoke(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +301,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
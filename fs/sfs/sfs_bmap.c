@@ -35,39 +35,273 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+////////////////////////////////////////////////////////////
+// Extent map
+//
+// The block map of a vnode is also kept in memory as a sorted array
+// of extents, runs of file blocks that are consecutive on disk. It is
+// built from the inode and indirect block the first time it's needed,
+// kept up to date as blocks are appended, and thrown away (to be
+// built again) on any other change. Looking up a block is then a
+// binary search, with no indirect block to read, and tells how many
+// blocks after it can be moved in the same transfer.
+
+/*
+ * The disk block of FILEBLOCK according to the inode, with the
+ * indirect block, if there is one, in IDBUF.
+ */
+static
+daddr_t
+sfs_extmap_slot(struct sfs_vnode *sv, const uint32_t *idbuf,
+		uint32_t fileblock)
+{
+	if (fileblock < SFS_NDIRECT) {
+		return sv->sv_i.sfi_direct[fileblock];
+	}
+	return idbuf[fileblock - SFS_NDIRECT];
+}
+
+static
+int
+sfs_extmap_build(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf = NULL;
+	const uint32_t *idbuf = NULL;
+	struct sfs_extent *ext;
+	uint32_t nslots, i, n;
+	daddr_t block, prev;
+	int result;
+
+	KASSERT(sv->sv_extents == NULL);
+
+	nslots = SFS_NDIRECT;
+	if (sv->sv_i.sfi_indirect != 0) {
+		result = buffer_read(sfs->sfs_device, sv->sv_i.sfi_indirect,
+				     &buf);
+		if (result) {
+			return result;
+		}
+		idbuf = buffer_map(buf);
+		nslots += SFS_DBPERIDB;
+	}
+
+	/* Count the extents... */
+	n = 0;
+	prev = 0;
+	for (i=0; i<nslots; i++) {
+		block = sfs_extmap_slot(sv, idbuf, i);
+		if (block != 0 && (prev == 0 || block != prev + 1)) {
+			n++;
+		}
+		prev = block;
+	}
+
+	ext = kmalloc((n > 0 ? n : 1) * sizeof(struct sfs_extent));
+	if (ext == NULL) {
+		if (buf != NULL) {
+			buffer_release(buf);
+		}
+		return ENOMEM;
+	}
+
+	/* ...and fill them in */
+	n = 0;
+	prev = 0;
+	for (i=0; i<nslots; i++) {
+		block = sfs_extmap_slot(sv, idbuf, i);
+		if (block != 0 && prev != 0 && block == prev + 1) {
+			ext[n-1].se_len++;
+		}
+		else if (block != 0) {
+			ext[n].se_fileblock = i;
+			ext[n].se_diskblock = block;
+			ext[n].se_len = 1;
+			n++;
+		}
+		prev = block;
+	}
+
+	if (buf != NULL) {
+		buffer_release(buf);
+	}
+	sv->sv_extents = ext;
+	sv->sv_nextents = n;
+	return 0;
+}
+
+/*
+ * The extent holding FILEBLOCK, or NULL if it's a hole.
+ */
+static
+const struct sfs_extent *
+sfs_extmap_find(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	const struct sfs_extent *e;
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = sv->sv_nextents;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		e = &sv->sv_extents[mid];
+		if (fileblock < e->se_fileblock) {
+			hi = mid;
+		}
+		else if (fileblock >= e->se_fileblock + e->se_len) {
+			lo = mid + 1;
+		}
+		else {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Record that FILEBLOCK was just given disk block BLOCK.
+ */
+static
+void
+sfs_extmap_add(struct sfs_vnode *sv, uint32_t fileblock, daddr_t block)
+{
+	struct sfs_extent *e;
+
+	if (sv->sv_extents == NULL) {
+		return;
+	}
+	if (sv->sv_nextents > 0) {
+		e = &sv->sv_extents[sv->sv_nextents - 1];
+		if (e->se_fileblock + e->se_len == fileblock &&
+		    e->se_diskblock + e->se_len == block) {
+			/* appended to the last extent */
+			e->se_len++;
+			return;
+		}
+	}
+	sfs_extmap_invalidate(sv);
+}
+
+void
+sfs_extmap_invalidate(struct sfs_vnode *sv)
+{
+	kfree(sv->sv_extents);
+	sv->sv_extents = NULL;
+	sv->sv_nextents = 0;
+}
+
+/*
+ * Look up FILEBLOCK of SV without allocating anything, and also hand
+ * back in NBLOCKS how many blocks starting there are consecutive on
+ * disk; 0 (and a disk block of 0) for a hole.
+ */
+int
+sfs_bmaprun(struct sfs_vnode *sv, uint32_t fileblock,
+	    daddr_t *diskblock, uint32_t *nblocks)
+{
+	const struct sfs_extent *e;
+	uint32_t off;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_extents == NULL) {
+		result = sfs_extmap_build(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	e = sfs_extmap_find(sv, fileblock);
+	if (e == NULL) {
+		*diskblock = 0;
+		*nblocks = 0;
+		return 0;
+	}
+	off = fileblock - e->se_fileblock;
+	*diskblock = e->se_diskblock + off;
+	*nblocks = e->se_len - off;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Block map
+
+/*
+ * BLOCK was just allocated for SV. Directory blocks are journaled
+ * like the rest of the metadata; file data must reach the disk
+ * before the transaction that points the file at it.
+ */
+static
+void
+sfs_bmap_newdata(struct sfs_vnode *sv, daddr_t block)
+{
+	if (sv->sv_i.sfi_type == SFS_TYPE_FILE) {
+		sfs_jdata(sv->sv_absvn.vn_fs->fs_data, block);
+	}
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated, right after the file's previous block if possible, and
+ * zeroed if ZERO is set.
  */
+static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+sfs_bmap_common(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+		bool zero, daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	const struct sfs_extent *e;
+	struct buf *buf;
 	daddr_t block;
 	daddr_t idblock;
+	daddr_t goal = 0;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+
+	/* The block map is part of the inode */
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	if (fileblock >= SFS_NDIRECT + SFS_NINDIRECT * SFS_DBPERIDB) {
+		return EFBIG;
+	}
+
+	/*
+	 * Try the extent map first. If it can't be built, carry on
+	 * without it.
+	 */
+	if (sv->sv_extents == NULL) {
+		(void)sfs_extmap_build(sv);
+	}
+	if (sv->sv_extents != NULL) {
+		e = sfs_extmap_find(sv, fileblock);
+		if (e != NULL) {
+			block = e->se_diskblock + (fileblock - e->se_fileblock);
+			goto found;
+		}
+		if (!doalloc) {
+			*diskblock = 0;
+			return 0;
+		}
+		/* Aim to put the new block right after the one before */
+		if (fileblock > 0) {
+			e = sfs_extmap_find(sv, fileblock - 1);
+			if (e != NULL) {
+				goal = e->se_diskblock + e->se_len;
+			}
+		}
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +316,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_near(sfs, goal, zero, &block);
 			if (result) {
 				return result;
 			}
@@ -90,6 +324,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
 			sv->sv_dirty = true;
+			sfs_extmap_add(sv, fileblock, block);
+			sfs_bmap_newdata(sv, block);
 		}
 
 		/*
@@ -151,40 +387,39 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		/* Remember the block we just allocated */
 		sv->sv_i.sfi_indirect = idblock;
 
-		/* Mark the inode dirty */
+		/* Mark the inode dirty; sfs_balloc zeroed the block */
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Get the block out of the indirect block */
+	result = buffer_read(sfs->sfs_device, idblock, &buf);
+	if (result) {
+		return result;
+	}
+	block = ((uint32_t *)buffer_map(buf))[idoff];
+	buffer_release(buf);
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		/* (not holding the indirect block while allocating) */
+		result = sfs_balloc_near(sfs, goal, zero, &block);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
+		result = buffer_read(sfs->sfs_device, idblock, &buf);
 		if (result) {
+			sfs_bfree(sfs, block);
 			return result;
 		}
+		((uint32_t *)buffer_map(buf))[idoff] = block;
+
+		/* The indirect block is now dirty */
+		sfs_jdirty(sfs, idblock, buf);
+		buffer_release(buf);
+		sfs_extmap_add(sv, fileblock + SFS_NDIRECT, block);
+		sfs_bmap_newdata(sv, block);
 	}
 
 	/* Hand back the result and return. */
@@ -195,6 +430,34 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 	*diskblock = block;
 	return 0;
+
+ found:
+	if (!sfs_bused(sfs, block)) {
+		panic("sfs: %s: Data block %u (block %u of file %u) "
+		      "marked free\n", sfs->sfs_sb.sb_volname,
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	 daddr_t *diskblock)
+{
+	return sfs_bmap_common(sv, fileblock, doalloc, true, diskblock);
+}
+
+/*
+ * Like sfs_bmap with DOALLOC set, for a caller about to write the
+ * whole block: a newly allocated block is not zeroed first, since
+ * that would only be overwritten.
+ */
+int
+sfs_bmap_overwrite(struct sfs_vnode *sv, uint32_t fileblock,
+		   daddr_t *diskblock)
+{
+	return sfs_bmap_common(sv, fileblock, true, false, diskblock);
 }
 
 /*
@@ -203,16 +466,10 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	uint32_t *idbuf, *freed;
+	unsigned nfreed;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
@@ -221,11 +478,12 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	daddr_t block, idblock;
 	uint32_t baseblock, highblock;
 	int result;
-	int hasnonzero, iddirty;
+	int hasnonzero;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	vfs_biglock_acquire();
+	sfs_extmap_invalidate(sv);
+	sfs_tail_trunc(sv, len);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -252,21 +510,29 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	if (blocklen < highblock && idblock != 0) {
 		/* We're past the proposed EOF; may need to free stuff */
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		/*
+		 * Get the indirect block. Take the blocks to discard
+		 * out of it, but don't free them until it has been let
+		 * go, as freeing them may need other buffers.
+		 */
+		freed = kmalloc(SFS_DBPERIDB * sizeof(uint32_t));
+		if (freed == NULL) {
+			return ENOMEM;
+		}
+		result = buffer_read(sfs->sfs_device, idblock, &buf);
 		if (result) {
-			vfs_biglock_release();
+			kfree(freed);
 			return result;
 		}
+		idbuf = buffer_map(buf);
 
 		hasnonzero = 0;
-		iddirty = 0;
+		nfreed = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
 			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
+				freed[nfreed++] = idbuf[j];
 				idbuf[j] = 0;
-				iddirty = 1;
 			}
 			/* Remember if we see any nonzero blocks in here */
 			if (idbuf[j]!=0) {
@@ -276,19 +542,22 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
+			buffer_release(buf);
+			freed[nfreed++] = idblock;
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
+		else {
+			if (nfreed > 0) {
+				sfs_jdirty(sfs, idblock, buf);
 			}
+			buffer_release(buf);
+		}
+
+		for (j=0; j<nfreed; j++) {
+			sfs_bfree(sfs, freed[j]);
 		}
+		kfree(freed);
 	}
 
 	/* Set the file size */
@@ -297,7 +566,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -35,6 +35,8 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -95,6 +97,203 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+////////////////////////////////////////////////////////////
+// Name index
+//
+// The entries of a directory are also kept in a hash table, built
+// the first time the directory is searched and kept up to date by
+// sfs_dir_link and sfs_dir_unlink, so that looking up a name doesn't
+// mean reading the whole directory. A bitmap of the slots in use
+// gives link a free slot without a search either. All of it is
+// covered by the directory's sv_lock.
+//
+// Should memory for the index run out, it is dropped, and searches
+// fall back to reading the directory until it can be built again.
+
+#define SFS_DIRHASH_SIZE  127
+#define SFS_DIR_MAXSLOTS \
+	((SFS_NDIRECT + SFS_NINDIRECT * SFS_DBPERIDB) * SFS_BLOCKSIZE / \
+	 sizeof(struct sfs_direntry))
+
+struct sfs_dirname {
+	struct sfs_dirname *dn_next;	/* hash chain */
+	int dn_slot;
+	uint32_t dn_ino;
+	char dn_name[];
+};
+
+struct sfs_dirhash {
+	struct sfs_dirname *dh_table[SFS_DIRHASH_SIZE];
+	struct bitmap *dh_used;		/* slots holding an entry */
+	int dh_freehint;		/* no free slot below this one */
+};
+
+static
+unsigned
+sfs_dirhash_fn(const char *name)
+{
+	unsigned h = 0;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h % SFS_DIRHASH_SIZE;
+}
+
+static
+struct sfs_dirname *
+sfs_dirhash_find(struct sfs_dirhash *dh, const char *name)
+{
+	struct sfs_dirname *dn;
+
+	for (dn = dh->dh_table[sfs_dirhash_fn(name)]; dn != NULL;
+	     dn = dn->dn_next) {
+		if (!strcmp(dn->dn_name, name)) {
+			return dn;
+		}
+	}
+	return NULL;
+}
+
+static
+int
+sfs_dirhash_add(struct sfs_dirhash *dh, const char *name, int slot,
+		uint32_t ino)
+{
+	struct sfs_dirname *dn;
+	unsigned h;
+
+	KASSERT(slot >= 0 && (unsigned)slot < SFS_DIR_MAXSLOTS);
+
+	dn = kmalloc(sizeof(struct sfs_dirname) + strlen(name) + 1);
+	if (dn == NULL) {
+		return ENOMEM;
+	}
+	dn->dn_slot = slot;
+	dn->dn_ino = ino;
+	strcpy(dn->dn_name, name);
+
+	h = sfs_dirhash_fn(name);
+	dn->dn_next = dh->dh_table[h];
+	dh->dh_table[h] = dn;
+	bitmap_mark(dh->dh_used, slot);
+	return 0;
+}
+
+static
+void
+sfs_dirhash_remove(struct sfs_dirhash *dh, const char *name, int slot)
+{
+	struct sfs_dirname **dnp, *dn;
+
+	for (dnp = &dh->dh_table[sfs_dirhash_fn(name)]; *dnp != NULL;
+	     dnp = &(*dnp)->dn_next) {
+		if ((*dnp)->dn_slot == slot) {
+			dn = *dnp;
+			*dnp = dn->dn_next;
+			kfree(dn);
+			bitmap_unmark(dh->dh_used, slot);
+			if (slot < dh->dh_freehint) {
+				dh->dh_freehint = slot;
+			}
+			return;
+		}
+	}
+	panic("sfs: dirhash: %s (slot %d) not in the index\n", name, slot);
+}
+
+void
+sfs_dirhash_destroy(struct sfs_vnode *sv)
+{
+	struct sfs_dirhash *dh = sv->sv_dirhash;
+	struct sfs_dirname *dn;
+	unsigned i;
+
+	if (dh == NULL) {
+		return;
+	}
+	for (i=0; i<SFS_DIRHASH_SIZE; i++) {
+		while ((dn = dh->dh_table[i]) != NULL) {
+			dh->dh_table[i] = dn->dn_next;
+			kfree(dn);
+		}
+	}
+	bitmap_destroy(dh->dh_used);
+	kfree(dh);
+	sv->sv_dirhash = NULL;
+}
+
+/*
+ * Read the whole directory into a new index.
+ */
+static
+int
+sfs_dirhash_build(struct sfs_vnode *sv)
+{
+	struct sfs_dirhash *dh;
+	struct sfs_direntry tsd;
+	int nentries, i, result;
+
+	KASSERT(sv->sv_dirhash == NULL);
+
+	dh = kmalloc(sizeof(struct sfs_dirhash));
+	if (dh == NULL) {
+		return ENOMEM;
+	}
+	bzero(dh->dh_table, sizeof(dh->dh_table));
+	dh->dh_freehint = 0;
+	dh->dh_used = bitmap_create(SFS_DIR_MAXSLOTS);
+	if (dh->dh_used == NULL) {
+		kfree(dh);
+		return ENOMEM;
+	}
+	sv->sv_dirhash = dh;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_dirhash_destroy(sv);
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+
+		/* Each name may legally appear only once... */
+		KASSERT(sfs_dirhash_find(dh, tsd.sfd_name) == NULL);
+
+		result = sfs_dirhash_add(dh, tsd.sfd_name, i, tsd.sfd_ino);
+		if (result) {
+			sfs_dirhash_destroy(sv);
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The lowest free slot, or -1 if all NENTRIES slots are in use.
+ */
+static
+int
+sfs_dirhash_freeslot(struct sfs_dirhash *dh, int nentries)
+{
+	int i;
+
+	for (i = dh->dh_freehint; i < nentries; i++) {
+		if (!bitmap_isset(dh->dh_used, i)) {
+			break;
+		}
+	}
+	dh->dh_freehint = i;
+	return i < nentries ? i : -1;
+}
+
+////////////////////////////////////////////////////////////
+// Directory operations
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -105,10 +304,36 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
+	struct sfs_dirname *dn;
 	int found, nentries, i, result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	nentries = sfs_dir_nentries(sv);
 
+	if (sv->sv_dirhash == NULL) {
+		(void)sfs_dirhash_build(sv);
+	}
+	if (sv->sv_dirhash != NULL) {
+		if (emptyslot != NULL) {
+			i = sfs_dirhash_freeslot(sv->sv_dirhash, nentries);
+			if (i >= 0) {
+				*emptyslot = i;
+			}
+		}
+		dn = sfs_dirhash_find(sv->sv_dirhash, name);
+		if (dn == NULL) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = dn->dn_slot;
+		}
+		if (ino != NULL) {
+			*ino = dn->dn_ino;
+		}
+		return 0;
+	}
+
 	/* For each slot... */
 	found = 0;
 	for (i=0; i<nentries; i++) {
@@ -186,7 +411,17 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* and index it */
+	if (sv->sv_dirhash != NULL &&
+	    sfs_dirhash_add(sv->sv_dirhash, name, emptyslot, ino)) {
+		sfs_dirhash_destroy(sv);
+	}
+	return 0;
 }
 
 /*
@@ -195,14 +430,29 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
-	struct sfs_direntry sd;
+	struct sfs_direntry sd, old;
+	int result;
+
+	/* Get the name for the index */
+	if (sv->sv_dirhash != NULL && sfs_readdir(sv, slot, &old)) {
+		sfs_dirhash_destroy(sv);
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	if (sv->sv_dirhash != NULL) {
+		old.sfd_name[sizeof(old.sfd_name)-1] = 0;
+		sfs_dirhash_remove(sv->sv_dirhash, old.sfd_name, slot);
+	}
+	return 0;
 }
 
 /*
@@ -228,11 +478,13 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		return result;
 	}
 
+	lock_acquire((*ret)->sv_lock);
 	if ((*ret)->sv_i.sfi_linkcount == 0) {
 		panic("sfs: %s: name %s (inode %u) in dir %u has "
 		      "linkcount 0\n", sfs->sfs_sb.sb_volname,
 		      name, (*ret)->sv_ino, sv->sv_ino);
 	}
+	lock_release((*ret)->sv_lock);
 
 	return 0;
 }
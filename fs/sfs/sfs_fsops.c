@@ -38,9 +38,11 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -50,10 +52,14 @@
 #define SFS_FS_FREEMAPBITS(sfs)    SFS_FREEMAPBITS(SFS_FS_NBLOCKS(sfs))
 #define SFS_FS_FREEMAPBLOCKS(sfs)  SFS_FREEMAPBLOCKS(SFS_FS_NBLOCKS(sfs))
 
+/* Freemap blocks sfs_sync_freemap writes per handle; within SFS_JOPMAX */
+#define SFS_FREEMAPCHUNK  8
+
 /*
- * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Routine for doing I/O (reads or writes) on the free block bitmap,
+ * N blocks of it from block FIRST on. Mount reads the whole bitmap at
+ * once; writes go in pieces, since each block written is one more in
+ * the running journal transaction.
  *
  * The free block bitmap consists of SFS_FREEMAPBLOCKS 512-byte
  * sectors of bits, one bit for each sector on the filesystem. The
@@ -69,20 +75,20 @@
  */
 static
 int
-sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
+sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw, uint32_t first,
+	      uint32_t n)
 {
-	uint32_t j, freemapblocks;
+	uint32_t j;
 	char *freemapdata;
 	int result;
 
-	/* Number of blocks in the free block bitmap. */
-	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
+	KASSERT(first + n <= SFS_FS_FREEMAPBLOCKS(sfs));
 
 	/* Pointer to our freemap data in memory. */
 	freemapdata = bitmap_getdata(sfs->sfs_freemap);
 
-	/* For each block in the free block bitmap... */
-	for (j=0; j<freemapblocks; j++) {
+	/* For each of those blocks of the free block bitmap... */
+	for (j=first; j<first+n; j++) {
 
 		/* Get a pointer to its data */
 		void *ptr = freemapdata + j*SFS_BLOCKSIZE;
@@ -106,40 +112,109 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 }
 
 /*
- * Sync routine for the vnode table.
+ * Sync routine for the vnode table. This only puts each vnode's
+ * changes in the buffer cache; sfs_sync commits them all at once
+ * afterwards, rather than once per vnode as fsync would.
+ *
+ * sfs_flush_inode takes the vnode's lock, which for a directory comes
+ * before sfs_vnlock; so sync a referenced copy of the table rather
+ * than the table itself.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct vnodearray *copy;
+	struct sfs_vnode *sv;
+	struct vnode *v;
+	unsigned i, j, num;
+	int result;
+
+	copy = vnodearray_create();
+	if (copy == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	result = vnodearray_setsize(copy, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(copy);
+		return result;
+	}
+	j = 0;
+	for (i=0; i<sfs->sfs_vnbuckets; i++) {
+		for (sv = sfs->sfs_vntable[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			VOP_INCREF(&sv->sv_absvn);
+			vnodearray_set(copy, j++, &sv->sv_absvn);
+		}
+	}
+	KASSERT(j == num);
+	lock_release(sfs->sfs_vnlock);
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/* Go over the loaded vnodes, syncing as we go. */
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		v = vnodearray_get(copy, i);
+		sfs_flush_inode(v->vn_data);
+		VOP_DECREF(v);
 	}
+
+	vnodearray_setsize(copy, 0);
+	vnodearray_destroy(copy);
 	return 0;
 }
 
 /*
- * Sync routine for the freemap.
+ * Sync routine for the freemap. Changes to the freemap are written as
+ * they are made, so this only has anything to do if one of those
+ * writes failed. Then the whole freemap is written, SFS_FREEMAPCHUNK
+ * blocks per journal transaction; a large volume's freemap would not
+ * fit in one.
  */
 static
 int
 sfs_sync_freemap(struct sfs_fs *sfs)
 {
+	uint32_t j, n, freemapblocks;
+	bool dirty;
 	int result;
 
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_freemapio(sfs, UIO_WRITE);
+	lock_acquire(sfs->sfs_freemaplock);
+	dirty = sfs->sfs_freemapdirty;
+	sfs->sfs_freemapdirty = false;
+	lock_release(sfs->sfs_freemaplock);
+	if (!dirty) {
+		return 0;
+	}
+
+	freemapblocks = SFS_FS_FREEMAPBLOCKS(sfs);
+	for (j=0; j<freemapblocks; j+=n) {
+		n = freemapblocks - j;
+		if (n > SFS_FREEMAPCHUNK) {
+			n = SFS_FREEMAPCHUNK;
+		}
+
+		result = sfs_jbegin(sfs);
+		if (result) {
+			lock_acquire(sfs->sfs_freemaplock);
+			sfs->sfs_freemapdirty = true;
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		lock_acquire(sfs->sfs_freemaplock);
+		result = sfs_freemapio(sfs, UIO_WRITE, j, n);
+		if (result) {
+			/* try it all again next time */
+			sfs->sfs_freemapdirty = true;
+		}
+		lock_release(sfs->sfs_freemaplock);
+		sfs_jend(sfs);
 		if (result) {
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
-
 	return 0;
 }
 
@@ -174,8 +249,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -211,26 +284,32 @@ sfs_sync(struct fs *fs)
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* If the free block map needs to be written, write it. */
+	/*
+	 * If the free block map or the superblock needs to be written,
+	 * write it.
+	 */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
-
-	/* If the superblock needs to be written, write it. */
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
 	result = sfs_sync_superblock(sfs);
+	sfs_jend(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	/*
+	 * All of the above only dirtied buffers; now commit them to the
+	 * journal and write them out.
+	 */
+	return sfs_jcheckpoint(sfs);
 }
 
 /*
@@ -243,13 +322,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* (the superblock is read-only once mounted) */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,7 +337,11 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	kfree(sfs->sfs_regfree);
+	sfs_jdestroy(sfs);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
+	sfs_vntable_cleanup(sfs);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -277,19 +356,39 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
+	/* Drop the vnodes kept only as a cache */
+	result = sfs_icache_flush(sfs);
+	if (result) {
+		return result;
+	}
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/*
+	 * (but evicting the cached vnodes may have written inodes)
+	 * Leave the journal empty, so the next mount has nothing to
+	 * replay.
+	 */
+	result = sfs_jcheckpoint(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* Drop our blocks from the buffer cache */
+	buffer_invalidate(sfs->sfs_device);
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,7 +396,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -328,6 +426,7 @@ sfs_fs_create(void)
 	COMPILE_ASSERT(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	COMPILE_ASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	COMPILE_ASSERT(sizeof(struct sfs_jblock)==SFS_BLOCKSIZE);
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
@@ -351,23 +450,66 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	if (sfs_vntable_init(sfs)) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_vnodes;
+	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_regfree = NULL;
+	sfs->sfs_nregions = 0;
+	sfs->sfs_cursor = 0;
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vnlock;
+	}
+
+	/* journal; set up at mount */
+	sfs->sfs_journal = NULL;
 
 	return sfs;
 
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
+cleanup_vnodes:
+	sfs_vntable_cleanup(sfs);
 cleanup_object:
 	kfree(sfs);
 fail:
 	return NULL;
 }
 
+/*
+ * Back out of a mount that failed after the device was set: write
+ * back whatever recovery replayed, and drop the volume's blocks from
+ * the buffer cache, so that the next mount of the device (perhaps
+ * after mksfs has rewritten it) reads them afresh. Returns RESULT.
+ */
+static
+int
+sfs_domount_fail(struct sfs_fs *sfs, int result)
+{
+	if (buffer_sync(sfs->sfs_device)) {
+		/* dirty buffers can't be dropped; leave them all */
+		/* (the volume name may not be there to print) */
+		kprintf("sfs: could not write back after failed mount\n");
+	}
+	else {
+		buffer_invalidate(sfs->sfs_device);
+	}
+	sfs->sfs_device = NULL;
+	sfs_fs_destroy(sfs);
+	return result;
+}
+
+/* Mount option: give a volume without a journal one */
+static int sfs_opt_mkjournal;
+
 /*
  * Mount routine.
  *
@@ -388,10 +530,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
-	/* We don't pass any options through mount */
-	(void)options;
+	/* The only option is sfs_opt_mkjournal, from sfs_mount_journal */
+	KASSERT(options == NULL || options == &sfs_opt_mkjournal);
 
 	/*
 	 * We can't mount on devices with the wrong sector size.
@@ -402,7 +542,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
@@ -410,7 +549,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -421,10 +559,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
-		sfs->sfs_device = NULL;
-		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
-		return result;
+		return sfs_domount_fail(sfs, result);
 	}
 
 	/* Make some simple sanity checks */
@@ -434,10 +569,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
-		sfs->sfs_device = NULL;
-		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
-		return EINVAL;
+		return sfs_domount_fail(sfs, EINVAL);
 	}
 
 	if (sfs->sfs_sb.sb_nblocks > dev->d_blocks) {
@@ -448,26 +580,36 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/*
+	 * Replay the journal, if there is one, before reading any
+	 * other metadata. (The superblock itself is never in it; it is
+	 * read-only once mounted.)
+	 */
+	result = sfs_jrecover(sfs);
+	if (result) {
+		return sfs_domount_fail(sfs, result);
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		sfs->sfs_device = NULL;
-		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+		return sfs_domount_fail(sfs, ENOMEM);
+	}
+	result = sfs_freemapio(sfs, UIO_READ, 0, SFS_FS_FREEMAPBLOCKS(sfs));
+	if (result == 0) {
+		result = sfs_freemap_summarize(sfs);
+	}
+	if (result == 0) {
+		/* (sfs_mount_journal makes the journal if there isn't one) */
+		result = sfs_jstart(sfs, options == &sfs_opt_mkjournal);
 	}
-	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
-		sfs->sfs_device = NULL;
-		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
-		return result;
+		return sfs_domount_fail(sfs, result);
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -479,3 +621,12 @@ sfs_mount(const char *device)
 {
 	return vfs_mount(device, NULL, sfs_domount);
 }
+
+/*
+ * The same, making a journal first if the volume has none.
+ */
+int
+sfs_mount_journal(const char *device)
+{
+	return vfs_mount(device, &sfs_opt_mkjournal, sfs_domount);
+}
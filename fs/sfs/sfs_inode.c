@@ -35,10 +35,337 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
+#include "opt-sfsdebug.h"
 
+/* Initial hash chains in the vnode table; it doubles as it fills */
+#define SFS_VNBUCKETS  64
+
+/* Most unreferenced vnodes kept in memory, per volume */
+#define SFS_ICACHE_MAX 256
+
+static struct spinlock sfs_icstats_lock = SPINLOCK_INITIALIZER;
+static struct {
+	unsigned long hits;		/* found unreferenced in memory */
+	unsigned long misses;		/* read from disk */
+	unsigned long evicted;
+} sfs_icstats;
+
+
+////////////////////////////////////////////////////////////
+// Vnode table
+//
+// The vnodes in memory are hashed by inode number, chained through
+// sv_hashnext, under sfs_vnlock. The table is doubled whenever the
+// chains get longer than two on average; if there is no memory for
+// that, it just stays as it is.
+
+int
+sfs_vntable_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vntable = kmalloc(SFS_VNBUCKETS * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vntable == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNBUCKETS; i++) {
+		sfs->sfs_vntable[i] = NULL;
+	}
+	sfs->sfs_vnbuckets = SFS_VNBUCKETS;
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_lruhead = sfs->sfs_lrutail = NULL;
+	sfs->sfs_ncached = 0;
+	return 0;
+}
+
+void
+sfs_vntable_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vntable);
+	sfs->sfs_vntable = NULL;
+}
+
+static
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vntable[ino % sfs->sfs_vnbuckets]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_vntable_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **table, *sv;
+	unsigned nbuckets, i, h;
+
+	nbuckets = sfs->sfs_vnbuckets * 2;
+	table = kmalloc(nbuckets * sizeof(struct sfs_vnode *));
+	if (table == NULL) {
+		return;
+	}
+	for (i=0; i<nbuckets; i++) {
+		table[i] = NULL;
+	}
+	for (i=0; i<sfs->sfs_vnbuckets; i++) {
+		while ((sv = sfs->sfs_vntable[i]) != NULL) {
+			sfs->sfs_vntable[i] = sv->sv_hashnext;
+			h = sv->sv_ino % nbuckets;
+			sv->sv_hashnext = table[h];
+			table[h] = sv;
+		}
+	}
+	kfree(sfs->sfs_vntable);
+	sfs->sfs_vntable = table;
+	sfs->sfs_vnbuckets = nbuckets;
+}
+
+static
+void
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_nvnodes >= 2 * sfs->sfs_vnbuckets) {
+		sfs_vntable_grow(sfs);
+	}
+	h = sv->sv_ino % sfs->sfs_vnbuckets;
+	sv->sv_hashnext = sfs->sfs_vntable[h];
+	sfs->sfs_vntable[h] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (svp = &sfs->sfs_vntable[sv->sv_ino % sfs->sfs_vnbuckets];
+	     *svp != NULL; svp = &(*svp)->sv_hashnext) {
+		if (*svp == sv) {
+			*svp = sv->sv_hashnext;
+			sfs->sfs_nvnodes--;
+			return;
+		}
+	}
+	panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+	      sfs->sfs_sb.sb_volname, sv->sv_ino);
+}
+
+/*
+ * Release the memory of SV, which has been taken out of the table.
+ */
+static
+void
+sfs_vnode_free(struct sfs_vnode *sv)
+{
+	sfs_extmap_invalidate(sv);
+	sfs_dirhash_destroy(sv);
+	kfree(sv->sv_tail);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+}
+
+////////////////////////////////////////////////////////////
+// Inode cache
+//
+// When the last reference to a vnode goes away, the vnode is not
+// destroyed (unless the file is deleted) but stays in the table, with
+// a refcount of zero, on an LRU list, so that opening the file again
+// finds it with its inode, extent map and directory index intact.
+// Changes to its inode are not written out then either; sfs_sync
+// writes out those of all the vnodes in memory, cached or not.
+//
+// Cached vnodes are evicted oldest first, when there are more than
+// SFS_ICACHE_MAX of them, when memory for a new vnode can't be had,
+// and at unmount. The list is covered by sfs_vnlock; while that is
+// held nobody can pick up a reference to a cached vnode.
+
+static
+void
+sfs_icache_unlink(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_cached);
+
+	if (sv->sv_lruprev != NULL) {
+		sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+	}
+	else {
+		sfs->sfs_lruhead = sv->sv_lrunext;
+	}
+	if (sv->sv_lrunext != NULL) {
+		sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+	}
+	else {
+		sfs->sfs_lrutail = sv->sv_lruprev;
+	}
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_cached = false;
+	sfs->sfs_ncached--;
+}
+
+static
+void
+sfs_icache_append(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(!sv->sv_cached);
+
+	sv->sv_lrunext = NULL;
+	sv->sv_lruprev = sfs->sfs_lrutail;
+	if (sfs->sfs_lrutail != NULL) {
+		sfs->sfs_lrutail->sv_lrunext = sv;
+	}
+	else {
+		sfs->sfs_lruhead = sv;
+	}
+	sfs->sfs_lrutail = sv;
+	sv->sv_cached = true;
+	sfs->sfs_ncached++;
+}
+
+/*
+ * Evict cached vnodes, oldest first, until only KEEP are left. Any
+ * that have been picked up again meanwhile (by sfs_sync, which
+ * doesn't go through sfs_loadvnode) are just taken off the list.
+ * Writing out what is pending for the vnodes goes in the running
+ * journal transaction; if that fills up, the rest wait for next time.
+ */
+static
+int
+sfs_icache_evict(struct sfs_fs *sfs, unsigned keep)
+{
+	struct sfs_vnode *sv;
+	struct vnode *v;
+	bool inuse;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	sfs_jjoin(sfs);
+	while (sfs->sfs_ncached > keep && sfs_jroom(sfs)) {
+		sv = sfs->sfs_lruhead;
+		v = &sv->sv_absvn;
+
+		spinlock_acquire(&v->vn_countlock);
+		inuse = v->vn_refcount > 0;
+		spinlock_release(&v->vn_countlock);
+		if (inuse) {
+			sfs_icache_unlink(sfs, sv);
+			continue;
+		}
+
+		/* Unreferenced, so this can't block */
+		lock_acquire(sv->sv_lock);
+		result = sfs_tail_flush(sv);
+		if (result == 0) {
+			result = sfs_sync_inode(sv);
+		}
+		lock_release(sv->sv_lock);
+		if (result) {
+			sfs_jend(sfs);
+			return result;
+		}
+
+		sfs_icache_unlink(sfs, sv);
+		sfs_vntable_remove(sfs, sv);
+		v->vn_refcount = 1;
+		vnode_cleanup(v);
+		sfs_vnode_free(sv);
+
+		spinlock_acquire(&sfs_icstats_lock);
+		sfs_icstats.evicted++;
+		spinlock_release(&sfs_icstats_lock);
+	}
+	sfs_jend(sfs);
+	return 0;
+}
+
+/*
+ * Evict all the cached vnodes; for unmount. No handle is open here,
+ * so each pass's sfs_jjoin commits what the last one left, if need
+ * be; stop if a pass gets nowhere.
+ */
+int
+sfs_icache_flush(struct sfs_fs *sfs)
+{
+	unsigned before;
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	do {
+		before = sfs->sfs_ncached;
+		result = sfs_icache_evict(sfs, 0);
+	} while (result == 0 && sfs->sfs_ncached > 0 &&
+		 sfs->sfs_ncached < before);
+	lock_release(sfs->sfs_vnlock);
+	return result;
+}
+
+void
+sfs_icache_printstats(void)
+{
+	unsigned long hits, misses, evicted, lookups;
+
+	spinlock_acquire(&sfs_icstats_lock);
+	hits = sfs_icstats.hits;
+	misses = sfs_icstats.misses;
+	evicted = sfs_icstats.evicted;
+	spinlock_release(&sfs_icstats_lock);
+
+	lookups = hits + misses;
+	kprintf("SFS inode cache: up to %u per volume\n", SFS_ICACHE_MAX);
+	kprintf("  %lu hits, %lu misses, hit rate %lu%%, %lu evicted\n",
+		hits, misses, lookups ? hits * 100 / lookups : 0, evicted);
+}
+
+#if OPT_SFSDEBUG
+/*
+ * Every inode in memory must be in an allocated block.
+ */
+static
+void
+sfs_vntable_check(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned i;
+
+	for (i=0; i<sfs->sfs_vnbuckets; i++) {
+		for (sv = sfs->sfs_vntable[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: %s: Found inode %u in "
+				      "unallocated block\n",
+				      sfs->sfs_sb.sb_volname, sv->sv_ino);
+			}
+		}
+	}
+}
+#endif
+
+////////////////////////////////////////////////////////////
+// Inodes
 
 /*
  * Write an on-disk inode structure back out to disk.
@@ -49,6 +376,8 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
 					sizeof(sv->sv_i));
@@ -60,6 +389,31 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+/*
+ * Put SV's pending block and inode in the buffer cache, so that the
+ * next commit takes them along; for sync and fsync.
+ */
+int
+sfs_flush_inode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
+	result = sfs_tail_flush(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,16 +424,19 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. sfs_loadvnode only hands
+	 * out references with sfs_vnlock held, so hold it until the
+	 * vnode is out of the table.
+	 *
+	 * Erasing a deleted file goes in the journal; we may or may not
+	 * be inside some operation's handle already.
 	 */
+	sfs_jjoin(sfs);
+	lock_acquire(sfs->sfs_vnlock);
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
@@ -88,105 +445,119 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount == 0) {
-		result = sfs_itrunc(sv, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+	/* Nobody else has a reference, so this can't block */
+	lock_acquire(sv->sv_lock);
+
+	/*
+	 * If the file is still there, keep the vnode in the inode
+	 * cache, at the end of the LRU list unless it is on it already
+	 * (sfs_sync's reference doesn't make it any more recent).
+	 */
+	if (sv->sv_i.sfi_linkcount > 0) {
+		lock_release(sv->sv_lock);
+
+		spinlock_acquire(&v->vn_countlock);
+		KASSERT(v->vn_refcount == 1);
+		v->vn_refcount = 0;
+		spinlock_release(&v->vn_countlock);
+
+		if (!sv->sv_cached) {
+			sfs_icache_append(sfs, sv);
+		}
+		if (sfs->sfs_ncached > SFS_ICACHE_MAX) {
+			/* on failure, the vnode stays; try again later */
+			(void)sfs_icache_evict(sfs, SFS_ICACHE_MAX);
 		}
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
+		return 0;
+	}
+	if (sv->sv_cached) {
+		sfs_icache_unlink(sfs, sv);
 	}
 
-	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
+	/* There are no on-disk references to the file either; erase it. */
+	result = sfs_itrunc(sv, 0);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
 		return result;
 	}
+	lock_release(sv->sv_lock);
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
-	}
+	/* Discard the inode */
+	sfs_bfree(sfs, sv->sv_ino);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vntable_remove(sfs, sv);
 
 	vnode_cleanup(&sv->sv_absvn);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+	sfs_jend(sfs);
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	sfs_vnode_free(sv);
 
 	/* Done */
 	return 0;
 }
 
 /*
- * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * sfs_loadvnode with sfs_vnlock held.
  */
+static
 int
-sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
-		 struct sfs_vnode **ret)
+sfs_loadvnode_locked(struct sfs_fs *sfs, uint32_t ino, int forcetype,
+		     struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
 
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+#if OPT_SFSDEBUG
+	sfs_vntable_check(sfs);
+#endif
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
-		}
-
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_absvn);
-			*ret = sv;
-			return 0;
+	/* Look in the vnodes table */
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+
+		if (sv->sv_cached) {
+			sfs_icache_unlink(sfs, sv);
+			spinlock_acquire(&sfs_icstats_lock);
+			sfs_icstats.hits++;
+			spinlock_release(&sfs_icstats_lock);
 		}
+		VOP_INCREF(&sv->sv_absvn);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
-		return ENOMEM;
+		/* Short of memory: drop the inode cache and try again */
+		(void)sfs_icache_evict(sfs, 0);
+		sv = kmalloc(sizeof(struct sfs_vnode));
+		if (sv==NULL) {
+			return ENOMEM;
+		}
 	}
 
 	/* Must be in an allocated block */
@@ -195,9 +566,16 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      "unallocated block\n", sfs->sfs_sb.sb_volname, ino);
 	}
 
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		return ENOMEM;
+	}
+
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
@@ -205,6 +583,19 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No reads yet */
+	sv->sv_ranext = sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+
+	/* The extent map is built when first needed */
+	sv->sv_extents = NULL;
+	sv->sv_nextents = 0;
+	sv->sv_dirhash = NULL;
+	sv->sv_tail = NULL;
+	sv->sv_tailblock = 0;
+	sv->sv_lruprev = sv->sv_lrunext = NULL;
+	sv->sv_cached = false;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
@@ -235,6 +626,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
@@ -243,18 +635,36 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	sfs_vntable_add(sfs, sv);
+
+	spinlock_acquire(&sfs_icstats_lock);
+	sfs_icstats.misses++;
+	spinlock_release(&sfs_icstats_lock);
 
 	/* Hand it back */
 	*ret = sv;
 	return 0;
 }
 
+/*
+ * Function to load a inode into memory as a vnode, or dig up one
+ * that's already resident.
+ *
+ * The whole thing runs under sfs_vnlock, so that two threads after
+ * the same inode cannot both load it.
+ */
+int
+sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
+		 struct sfs_vnode **ret)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	result = sfs_loadvnode_locked(sfs, ino, forcetype, ret);
+	lock_release(sfs->sfs_vnlock);
+	return result;
+}
+
 /*
  * Create a new filesystem object and hand back its vnode.
  */
@@ -296,25 +706,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
@@ -36,8 +36,12 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <vm.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -53,82 +57,325 @@
  */
 
 /*
- * Read or write a block, retrying I/O errors.
+ * Read a block. Blocks go through the buffer cache, which also does
+ * the retrying of I/O errors.
  */
-static
 int
-sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
+	struct buf *buf;
 	int result;
-	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(len == SFS_BLOCKSIZE);
 
-	DEBUG(DB_SFS, "sfs: %s %llu\n",
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	DEBUG(DB_SFS, "sfs: read %u\n", (unsigned)block);
 
- retry:
-	result = DEVOP_IO(sfs->sfs_device, uio);
-	if (result == EINVAL) {
-		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
-		 */
-		panic("sfs: %s: DEVOP_IO returned EINVAL\n",
-		      sfs->sfs_sb.sb_volname);
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: %s: block %llu I/O error, retrying\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
+	result = buffer_read(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(buf), len);
+	buffer_release(buf);
+	return 0;
+}
+
+/*
+ * Write a block of metadata. This only updates the cached copy, as
+ * part of the running journal transaction; it reaches the disk once
+ * the transaction is committed, when the buffer is recycled or on
+ * sync.
+ */
+int
+sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct buf *buf;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	DEBUG(DB_SFS, "sfs: write %u\n", (unsigned)block);
+
+	result = buffer_get(sfs->sfs_device, block, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), data, len);
+	sfs_jdirty(sfs, block, buf);
+	buffer_release(buf);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+#define SFS_RA_MIN   4		/* first window of a sequential read */
+#define SFS_RA_MAX   32		/* largest window, in blocks */
+
+/*
+ * Called after reading FILEBLOCK of SV, with HIT true if it was
+ * already in the buffer cache. When reads go through the file in
+ * order, ask the cache to fetch the next sv_rawindow blocks in the
+ * background; any other access pattern switches read-ahead off for
+ * the vnode until the reads are sequential again.
+ *
+ * The window adapts to how well read-ahead is doing: it doubles each
+ * time a block we asked for was waiting in the cache, and halves when
+ * it wasn't (it got evicted before use, or the disk can't keep up),
+ * since asking for even more would then only make matters worse.
+ *
+ * Detection is per vnode rather than per open file, as the file
+ * system never sees the open file.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t fileblock, bool hit)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t start, end, nblocks, i;
+	daddr_t diskblock;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (fileblock + 1 == sv->sv_ranext) {
+		/* another piece of the block we just read */
+		return;
+	}
+	if (fileblock != sv->sv_ranext) {
+		/* not sequential */
+		sv->sv_rawindow = 0;
+		sv->sv_ranext = sv->sv_raend = fileblock + 1;
+		return;
+	}
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RA_MIN;
+	}
+	else if (fileblock < sv->sv_raend) {
+		if (hit) {
+			if (sv->sv_rawindow < SFS_RA_MAX) {
+				sv->sv_rawindow *= 2;
+			}
 		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
+		else if (sv->sv_rawindow > SFS_RA_MIN) {
+			sv->sv_rawindow /= 2;
 		}
-		else {
-			kprintf("sfs: %s: block %llu I/O error, giving up "
-				"after %d retries\n",
-				sfs->sfs_sb.sb_volname,
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
+	}
+	sv->sv_ranext = fileblock + 1;
+
+	start = sv->sv_raend > fileblock + 1 ? sv->sv_raend : fileblock + 1;
+	end = fileblock + 1 + sv->sv_rawindow;
+	nblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (end > nblocks) {
+		end = nblocks;
+	}
+	for (i=start; i<end; i++) {
+		if (sfs_bmap(sv, i, false, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_prefetch(sfs->sfs_device, diskblock);
 		}
 	}
-	return result;
+	if (end > sv->sv_raend) {
+		sv->sv_raend = end;
+	}
 }
 
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation
+//
+// A partial write to a block of a file that has no disk block yet
+// (typically an append past the end) doesn't allocate one; the data
+// is kept with the vnode in sv_tail instead, the rest of the block
+// being zeros. Further small appends go on filling it in memory, and
+// only once it is written to its end, or the vnode is synced (by
+// fsync, sync, the vfs syncer, or reclaim), does it get a disk block,
+// allocated next to the file's previous block, which is then written
+// whole without being read or zeroed.
+//
+// There is at most one such block per vnode, under sv_lock.
+
 /*
- * Read a block.
+ * Give the pending block of SV, if any, its disk block.
  */
 int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_tail_flush(struct sfs_vnode *sv)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
+	daddr_t diskblock;
+	int result;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	if (sv->sv_tail == NULL) {
+		return 0;
+	}
+	result = sfs_bmap_overwrite(sv, sv->sv_tailblock, &diskblock);
+	if (result) {
+		return result;
+	}
+	result = buffer_get(sfs->sfs_device, diskblock, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(buf), sv->sv_tail, SFS_BLOCKSIZE);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+
+	kfree(sv->sv_tail);
+	sv->sv_tail = NULL;
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write back whatever of SV's blocks is dirty in the buffer cache, a
+ * run of blocks consecutive on disk at a time; for fsync, ahead of
+ * the commit that makes the file's metadata point at them.
  */
 int
-sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_data_flush(struct sfs_vnode *sv)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock, nblocks, n;
+	daddr_t diskblock;
+	int result;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	lock_acquire(sv->sv_lock);
+	nblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	lock_release(sv->sv_lock);
+
+	fileblock = 0;
+	while (fileblock < nblocks) {
+		lock_acquire(sv->sv_lock);
+		result = sfs_bmaprun(sv, fileblock, &diskblock, &n);
+		lock_release(sv->sv_lock);
+		if (result) {
+			return result;
+		}
+		if (n == 0) {
+			/* a hole */
+			fileblock++;
+			continue;
+		}
+		if (n > nblocks - fileblock) {
+			n = nblocks - fileblock;
+		}
+		result = buffer_flush(sfs->sfs_device, diskblock, n);
+		if (result) {
+			return result;
+		}
+		fileblock += n;
+	}
+	return 0;
+}
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+/*
+ * The file is being truncated to LEN: drop the pending block if it is
+ * past the end now, or clear the part of it that is.
+ */
+void
+sfs_tail_trunc(struct sfs_vnode *sv, off_t len)
+{
+	off_t start;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_tail == NULL) {
+		return;
+	}
+	start = (off_t)sv->sv_tailblock * SFS_BLOCKSIZE;
+	if (len <= start) {
+		kfree(sv->sv_tail);
+		sv->sv_tail = NULL;
+	}
+	else if (len < start + SFS_BLOCKSIZE) {
+		bzero(sv->sv_tail + (len - start),
+		      SFS_BLOCKSIZE - (len - start));
+	}
+}
+
+/*
+ * Move LEN bytes from UIO to SKIPSTART of FILEBLOCK of SV without
+ * allocating it, if it is the pending block or can become it.
+ * Returns false if the write has to go to disk as usual.
+ */
+static
+bool
+sfs_tail_write(struct sfs_vnode *sv, struct uio *uio, uint32_t fileblock,
+	       uint32_t skipstart, uint32_t len, int *result)
+{
+	daddr_t diskblock;
+	char *tail;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	*result = 0;
+	if (sv->sv_tail == NULL || sv->sv_tailblock != fileblock) {
+		if (len == SFS_BLOCKSIZE) {
+			/* nothing to gain */
+			return false;
+		}
+		*result = sfs_bmap(sv, fileblock, false, &diskblock);
+		if (*result || diskblock != 0) {
+			return *result != 0;
+		}
+		/* (before sv_tail is flushed, so failing changes nothing) */
+		tail = kmalloc(SFS_BLOCKSIZE);
+		if (tail == NULL) {
+			return false;
+		}
+		*result = sfs_tail_flush(sv);
+		if (*result) {
+			kfree(tail);
+			return true;
+		}
+		bzero(tail, SFS_BLOCKSIZE);
+		sv->sv_tail = tail;
+		sv->sv_tailblock = fileblock;
+	}
+
+	*result = uiomove(sv->sv_tail + skipstart, len, uio);
+	if (*result == 0 && skipstart + len == SFS_BLOCKSIZE) {
+		/* written up to the end; it won't be added to again */
+		*result = sfs_tail_flush(sv);
+	}
+	return true;
+}
+
+/*
+ * Touch the user pages the next LEN bytes of UIO come from, without
+ * moving anything. Once in memory a user page is only ever paged back
+ * in from swap, so a uiomove from them later, with the vnode lock
+ * held, cannot need to read a file (which might be this one). Errors
+ * are left for that uiomove to report.
+ */
+static
+void
+sfs_prefault(struct uio *uio, size_t len)
+{
+	struct iovec *iov;
+	vaddr_t va, end;
+	unsigned i;
+	size_t n;
+	char c;
+
+	if (uio->uio_segflg != UIO_USERSPACE) {
+		return;
+	}
+	for (i=0; i<uio->uio_iovcnt && len > 0; i++) {
+		iov = &uio->uio_iov[i];
+		n = iov->iov_len < len ? iov->iov_len : len;
+		va = (vaddr_t)iov->iov_ubase;
+		end = va + n;
+		while (va < end) {
+			(void)copyin((const_userptr_t)va, &c, 1);
+			va = (va & PAGE_FRAME) + PAGE_SIZE;
+		}
+		len -= n;
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -144,157 +391,196 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
  * UIO is the area to do the I/O into.
+ *
+ * The data is staged in IOBUF, a block-sized buffer belonging to the
+ * caller. The uiomove to or from it may page fault, and the fault
+ * may read this very file, so no buffer is held across it. A read
+ * moves the data out after dropping the vnode lock. A write moves it
+ * in only once the block is mapped, so that a failure to get the
+ * block leaves UIO untouched; it faults the user pages in first,
+ * before taking the lock.
  */
 static
 int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
-	      uint32_t skipstart, uint32_t len)
+	      uint32_t skipstart, uint32_t len, char *iobuf)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct buf *buf;
 	daddr_t diskblock;
-	uint32_t fileblock;
-	int result;
+	uint32_t fileblock, moved;
+	bool fresh = false;
+	int result, moveresult;
 
 	/* Allocate missing blocks if and only if we're writing */
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	if (uio->uio_rw == UIO_WRITE) {
+		sfs_prefault(uio, len);
+	}
+
+	lock_acquire(sv->sv_lock);
+
+	if (doalloc &&
+	    sfs_tail_write(sv, uio, fileblock, skipstart, len, &result)) {
+		lock_release(sv->sv_lock);
+		return result;
+	}
+	if (!doalloc && sv->sv_tail != NULL && sv->sv_tailblock == fileblock) {
+		memcpy(iobuf, sv->sv_tail, SFS_BLOCKSIZE);
+		lock_release(sv->sv_lock);
+		return uiomove(iobuf+skipstart, len, uio);
+	}
+
+	/*
+	 * Get the disk block number. A new block that is about to be
+	 * overwritten entirely needn't be zeroed first.
+	 */
+	if (doalloc && len == SFS_BLOCKSIZE) {
+		result = sfs_bmap(sv, fileblock, false, &diskblock);
+		if (result == 0 && diskblock == 0) {
+			fresh = true;
+			result = sfs_bmap_overwrite(sv, fileblock, &diskblock);
+		}
+	}
+	else {
+		result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	}
 	if (result) {
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
+	if (uio->uio_rw == UIO_WRITE) {
+		/* The block is there; now get the new data */
+		moved = uio->uio_resid;
+		moveresult = uiomove(iobuf+skipstart, len, uio);
+		moved -= uio->uio_resid;
+		if (fresh) {
+			/* sfs_bmap_overwrite did not zero it */
+			bzero(iobuf + moved, SFS_BLOCKSIZE - moved);
+			moved = SFS_BLOCKSIZE;
+		}
+		if (moved == 0) {
+			lock_release(sv->sv_lock);
+			return moveresult;
+		}
+
+		/*
+		 * Merge what came into the block, which we need not
+		 * read if all of it is being overwritten.
+		 */
+		if (moved == SFS_BLOCKSIZE) {
+			result = buffer_get(sfs->sfs_device, diskblock, &buf);
+		}
+		else {
+			result = buffer_read(sfs->sfs_device, diskblock, &buf);
+		}
+		if (result) {
+			lock_release(sv->sv_lock);
+			return result;
+		}
+		memcpy((char *)buffer_map(buf) + skipstart, iobuf + skipstart,
+		       moved);
+		buffer_mark_dirty(buf);
+		buffer_release(buf);
+		lock_release(sv->sv_lock);
+		return moveresult;
+	}
+
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
 		 * Zero the buffer.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		bzero(iobuf, SFS_BLOCKSIZE);
+		sfs_readahead(sv, fileblock, true);
 	}
 	else {
 		/*
-		 * Read the block.
+		 * Read the block, and then maybe the ones after it.
 		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
+		bool hit = buffer_incore(sfs->sfs_device, diskblock);
+
+		result = sfs_readblock(sfs, diskblock, iobuf, SFS_BLOCKSIZE);
 		if (result) {
+			lock_release(sv->sv_lock);
 			return result;
 		}
+		sfs_readahead(sv, fileblock, hit);
 	}
+	lock_release(sv->sv_lock);
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Now copy out the requested part of the buffer.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
-	if (result) {
-		return result;
-	}
-
-	/*
-	 * If it was a write, write back the modified block.
-	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
-	}
-
-	return 0;
+	return uiomove(iobuf+skipstart, len, uio);
 }
 
+/* Most blocks sfs_io reads in one transfer */
+#define SFS_MAXRUN   16
+
 /*
- * Do I/O (either read or write) of a single whole block.
+ * About to read whole blocks of SV from FILEBLOCK on, MAX of them, one
+ * at a time: first bring as many of them as are consecutive on disk
+ * into the buffer cache in one transfer. Returns how many blocks that
+ * covered, at least 1.
  */
 static
-int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+uint32_t
+sfs_readrun(struct sfs_vnode *sv, uint32_t fileblock, uint32_t max)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	daddr_t diskblock;
-	uint32_t fileblock;
+	uint32_t n;
 	int result;
-	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
-
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
-	if (result) {
-		return result;
+	lock_acquire(sv->sv_lock);
+	result = sfs_bmaprun(sv, fileblock, &diskblock, &n);
+	lock_release(sv->sv_lock);
+	if (result || n < 2 || max < 2) {
+		return 1;
 	}
-
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+	if (n > max) {
+		n = max;
+	}
+	if (n > SFS_MAXRUN) {
+		n = SFS_MAXRUN;
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	/* Failure only means the blocks get read one by one */
+	(void)buffer_readrun(sfs->sfs_device, diskblock, n);
+	return n;
+}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
+/*
+ * Do I/O (either read or write) of a single whole block.
+ */
+static
+int
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, char *iobuf)
+{
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
-
-	return result;
+	return sfs_partialio(sv, uio, 0, SFS_BLOCKSIZE, iobuf);
 }
 
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * The vnode lock is taken block by block, not across the whole call.
  */
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks, i, runend;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	char *iobuf;
 
 	origresid = uio->uio_resid;
 
@@ -304,9 +590,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 * add it back to uio_resid at the end.
 	 */
 	if (uio->uio_rw == UIO_READ) {
-		off_t size = sv->sv_i.sfi_size;
+		off_t size;
 		off_t endpos = uio->uio_offset + uio->uio_resid;
 
+		lock_acquire(sv->sv_lock);
+		size = sv->sv_i.sfi_size;
+		lock_release(sv->sv_lock);
+
 		if (uio->uio_offset >= size) {
 			/* At or past EOF - just return */
 			return 0;
@@ -319,6 +609,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/* Staging area for the data of one block */
+	iobuf = kmalloc(SFS_BLOCKSIZE);
+	if (iobuf == NULL) {
+		uio->uio_resid += extraresid;
+		return ENOMEM;
+	}
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -336,7 +633,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 
 		/* Call sfs_partialio() to do it. */
-		result = sfs_partialio(sv, uio, skip, len);
+		result = sfs_partialio(sv, uio, skip, len, iobuf);
 		if (result) {
 			goto out;
 		}
@@ -352,8 +649,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	runend = 0;
 	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+		if (uio->uio_rw == UIO_READ && i >= runend) {
+			runend = i + sfs_readrun(sv,
+				uio->uio_offset / SFS_BLOCKSIZE, nblocks - i);
+		}
+		result = sfs_blockio(sv, uio, iobuf);
 		if (result) {
 			goto out;
 		}
@@ -365,20 +667,24 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
 
 	if (uio->uio_resid > 0) {
-		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
+		result = sfs_partialio(sv, uio, 0, uio->uio_resid,
+				       iobuf);
 		if (result) {
 			goto out;
 		}
 	}
 
  out:
+	kfree(iobuf);
 
 	/* If writing and we did anything, adjust file length */
-	if (uio->uio_resid != origresid &&
-	    uio->uio_rw == UIO_WRITE &&
-	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
-		sv->sv_i.sfi_size = uio->uio_offset;
-		sv->sv_dirty = true;
+	if (uio->uio_resid != origresid && uio->uio_rw == UIO_WRITE) {
+		lock_acquire(sv->sv_lock);
+		if (uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
+			sv->sv_i.sfi_size = uio->uio_offset;
+			sv->sv_dirty = true;
+		}
+		lock_release(sv->sv_lock);
 	}
 
 	/* Add in any extra amount we couldn't read because of EOF */
@@ -395,7 +701,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
  * This is much the same as sfs_partialio, but intended for use with
  * metadata (e.g. directory entries). It assumes the objects being
  * handled are smaller than whole blocks, do not cross block
- * boundaries, and originate in the kernel.
+ * boundaries, and originate in the kernel. The caller holds the
+ * vnode's lock.
  *
  * It is separate from sfs_partialio because, although there is no
  * such code in this version of SFS, it is often desirable when doing
@@ -411,21 +718,11 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	uint32_t vnblock;
 	uint32_t blockoffset;
 	daddr_t diskblock;
+	struct buf *buf;
+	char *ioptr;
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
@@ -446,26 +743,23 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = buffer_read(sfs->sfs_device, diskblock, &buf);
 	if (result) {
 		return result;
 	}
+	ioptr = buffer_map(buf);
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, ioptr + blockoffset, len);
+		buffer_release(buf);
 	}
 	else {
-		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* Update the selected region; it is written back later */
+		memcpy(ioptr + blockoffset, data, len);
+		sfs_jdirty(sfs, diskblock, buf);
+		buffer_release(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
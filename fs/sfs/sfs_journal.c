@@ -0,0 +1,1184 @@
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * Changes to metadata blocks (inodes, directories, indirect blocks,
+ * the freemap) are grouped into transactions. A transaction is
+ * written to the journal area of the volume with one sequential
+ * write, followed by a commit block, and only after that may the
+ * blocks be written to their own places on disk, which the buffer
+ * cache then does whenever it gets to it. After a crash, the
+ * committed transactions are replayed at mount.
+ *
+ * Each vnode operation that changes anything runs as a handle on the
+ * running transaction, from sfs_jbegin to sfs_jend. The blocks it
+ * changes go through sfs_jdirty, which adds them to the transaction
+ * and holds their buffers in the cache. A transaction is committed
+ * when there is no open handle and it is too full to admit another
+ * one, or on sync. sfs_jbegin is called before any sfs lock is taken;
+ * it may wait for the transaction to be committed. Vnode reclaim may
+ * happen inside another handle or not, so it uses sfs_jjoin instead,
+ * which waits only when no handle at all is open. Admitting handles
+ * below SFS_JLIMIT leaves room for joined ones on top.
+ *
+ * The journal is emptied (checkpointed) only when it fills up and on
+ * sync and unmount: once the buffer cache has written back every
+ * committed block, the header is moved on past the transactions in
+ * it.
+ *
+ * File data is not journaled, but it is ordered: the data blocks
+ * newly allocated in a transaction are written back before it is
+ * committed, so that after a crash no file points at a block that
+ * still holds whatever was there before. (New blocks are not zeroed
+ * on disk.) sfs_jdata notes them, in runs of consecutive blocks; if
+ * there are too many runs to keep, the commit writes back every
+ * dirty buffer that isn't held instead.
+ *
+ * A freed block with copies in the journal is revoked, so that a
+ * replay doesn't write an old copy over whatever the block is used
+ * for next.
+ *
+ * fsync needs the transaction holding its changes committed. One
+ * fsync at a time leads a group commit: while operations are still
+ * in progress, and so may be about to fsync too, it waits for them
+ * until the number of fsyncs in the group stops growing. Then it
+ * commits once for all of them, and they are all woken together.
+ * fsyncs arriving during the commit wait for the next group, which is
+ * led by one of them.
+ *
+ * If the journal can't be written, or a transaction overflows, the
+ * journal is aborted: the running transaction's changes are dropped
+ * from the cache, fsync and sync fail, and so does sfs_jbegin from
+ * then on, which leaves the volume read-only. What was committed
+ * before stays in the journal and is replayed at the next mount.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <uio.h>
+#include <device.h>
+#include <buf.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+#define SFS_JOPMAX        12	/* blocks one operation may change */
+#define SFS_JLIMIT        36	/* admit handles up to this many blocks */
+#define SFS_JMAXENTRIES   64	/* and never go past this many */
+#define SFS_JGROUPQUIET   2	/* wakeups with no new fsync end a group */
+#define SFS_JGROUPMAX     16	/* and a group waits for no more than this */
+#define SFS_JMAXDATA      32	/* runs of new data blocks kept */
+
+struct sfs_jentry {
+	daddr_t je_block;
+	bool je_held;			/* we hold its buffer */
+	bool je_revoked;		/* freed, not to be replayed */
+};
+
+static struct spinlock sfs_jstats_lock = SPINLOCK_INITIALIZER;
+static unsigned long sfs_jstats_commits;
+
+struct sfs_jdata {
+	daddr_t jd_block;
+	unsigned jd_len;
+};
+
+struct sfs_journal {
+	struct lock *j_lock;		/* protects everything below */
+	struct cv *j_cv;		/* a handle ended, or a commit */
+	unsigned j_nhandles;		/* open handles */
+	unsigned j_reserved;		/* SFS_JOPMAX for each of them */
+	bool j_quiesce;			/* new handles held off */
+	bool j_leading;			/* an fsync is leading a group */
+	unsigned j_nfsyncs;		/* fsyncs waiting on this transaction */
+	struct sfs_jentry j_entries[SFS_JMAXENTRIES];
+	unsigned j_nentries;		/* running transaction */
+	struct sfs_jdata j_data[SFS_JMAXDATA];
+	unsigned j_ndata;		/* its new data blocks */
+	bool j_dataoverflow;		/* more of them than that */
+	daddr_t j_start;		/* the header block */
+	daddr_t j_end;			/* just past the journal area */
+	daddr_t j_head;			/* where the next transaction goes */
+	uint32_t j_seq;			/* and its sequence number */
+	struct bitmap *j_logged;	/* blocks with copies in the log */
+	char *j_iobuf;			/* SFS_JMAXENTRIES + 1 blocks */
+	int j_error;			/* nonzero once aborted */
+};
+
+/*
+ * Read or write N blocks of the journal area from BLOCK on. These
+ * don't go through the buffer cache, which never sees the journal.
+ */
+static
+int
+sfs_jio(struct sfs_fs *sfs, daddr_t block, void *data, unsigned n,
+	enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, data, n * SFS_BLOCKSIZE,
+		  (off_t)block * SFS_BLOCKSIZE, rw);
+	return DEVOP_IO(sfs->sfs_device, &ku);
+}
+
+/*
+ * Write the journal header, saying the journal starts at SEQ.
+ */
+static
+int
+sfs_jwriteheader(struct sfs_fs *sfs, daddr_t start, uint32_t seq,
+		 struct sfs_jblock *jb)
+{
+	bzero(jb, sizeof(*jb));
+	jb->jb_magic = SFS_JMAGIC;
+	jb->jb_type = SFS_JTYPE_HEADER;
+	jb->jb_seq = seq;
+	return sfs_jio(sfs, start, jb, 1, UIO_WRITE);
+}
+
+////////////////////////////////////////////////////////////
+// Recovery
+
+/*
+ * Check that JB is a journal block of type TYPE for transaction SEQ.
+ */
+static
+bool
+sfs_jcheck(const struct sfs_jblock *jb, uint32_t type, uint32_t seq)
+{
+	return jb->jb_magic == SFS_JMAGIC && jb->jb_type == type &&
+		jb->jb_seq == seq &&
+		(type != SFS_JTYPE_DESC || jb->jb_count <= SFS_JDESCMAX);
+}
+
+/*
+ * Number of blocks whose contents follow descriptor JB.
+ */
+static
+unsigned
+sfs_jnimages(const struct sfs_jblock *jb)
+{
+	unsigned i, n = 0;
+
+	for (i=0; i<jb->jb_count; i++) {
+		if ((jb->jb_blocks[i] & SFS_JREVOKE) == 0) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Replay the transactions from the descriptors at POS[0..N-1], newest
+ * first, writing each block only from the newest transaction that has
+ * it, and not at all if it was revoked since.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs, const daddr_t *pos, unsigned n,
+	    struct sfs_jblock *jb, char *data)
+{
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	struct bitmap *done;
+	struct buf *buf;
+	daddr_t block, image, k;
+	unsigned i, t;
+	bool revoked;
+	int result = 0;
+
+	done = bitmap_create(nblocks);
+	if (done == NULL) {
+		return ENOMEM;
+	}
+
+	for (t = n; t-- > 0 && result == 0; ) {
+		result = sfs_jio(sfs, pos[t], jb, 1, UIO_READ);
+		image = pos[t] + 1;
+		for (i=0; i<jb->jb_count && result == 0; i++) {
+			block = jb->jb_blocks[i] & ~SFS_JREVOKE;
+			revoked = (jb->jb_blocks[i] & SFS_JREVOKE) != 0;
+			k = revoked ? 0 : image++;
+			if (block >= nblocks) {
+				kprintf("sfs: %s: journal: bad block %u\n",
+					sfs->sfs_sb.sb_volname,
+					(unsigned)block);
+				result = EINVAL;
+				break;
+			}
+			if (bitmap_isset(done, block)) {
+				/* newer copy, or revoked since */
+				continue;
+			}
+			bitmap_mark(done, block);
+			if (revoked) {
+				continue;
+			}
+
+			result = sfs_jio(sfs, k, data, 1, UIO_READ);
+			if (result) {
+				break;
+			}
+			result = buffer_get(sfs->sfs_device, block, &buf);
+			if (result) {
+				break;
+			}
+			memcpy(buffer_map(buf), data, SFS_BLOCKSIZE);
+			buffer_mark_dirty(buf);
+			buffer_release(buf);
+		}
+	}
+
+	bitmap_destroy(done);
+	if (result) {
+		return result;
+	}
+	return buffer_sync(sfs->sfs_device);
+}
+
+/*
+ * Find a sequence number past that of every transaction whose blocks
+ * may still be in the journal area from START to END, for when the
+ * header is lost. Starting over from 1 could make an old transaction
+ * left there look like the next one, and get it replayed.
+ */
+static
+int
+sfs_jnextseq(struct sfs_fs *sfs, daddr_t start, daddr_t end,
+	     struct sfs_jblock *jb, uint32_t *ret)
+{
+	uint32_t seq = 0;
+	daddr_t p;
+	int result;
+
+	for (p = start + 1; p < end; p++) {
+		result = sfs_jio(sfs, p, jb, 1, UIO_READ);
+		if (result) {
+			return result;
+		}
+		if (jb->jb_magic == SFS_JMAGIC &&
+		    (jb->jb_type == SFS_JTYPE_DESC ||
+		     jb->jb_type == SFS_JTYPE_COMMIT) &&
+		    jb->jb_seq > seq) {
+			seq = jb->jb_seq;
+		}
+	}
+	*ret = seq + 1;
+	return 0;
+}
+
+/*
+ * Replay the journal, if the volume has one. Called at mount, before
+ * anything but the superblock has been read.
+ */
+int
+sfs_jrecover(struct sfs_fs *sfs)
+{
+	daddr_t start = sfs->sfs_sb.sb_journal;
+	daddr_t end = start + sfs->sfs_sb.sb_journalblocks;
+	struct sfs_jblock *jb;
+	char *data;
+	daddr_t *pos, p;
+	uint32_t seq;
+	unsigned n, max;
+	int result;
+
+	if (sfs->sfs_sb.sb_journalblocks == 0) {
+		return 0;
+	}
+	if (end > sfs->sfs_sb.sb_nblocks || start <= SFS_FREEMAP_START) {
+		kprintf("sfs: %s: bad journal location\n",
+			sfs->sfs_sb.sb_volname);
+		return EINVAL;
+	}
+
+	/* A transaction takes at least two blocks */
+	max = (end - start) / 2;
+	jb = kmalloc(sizeof(*jb));
+	data = kmalloc(SFS_BLOCKSIZE);
+	pos = kmalloc(max * sizeof(daddr_t));
+	if (jb == NULL || data == NULL || pos == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	result = sfs_jio(sfs, start, jb, 1, UIO_READ);
+	if (result) {
+		goto out;
+	}
+	if (!sfs_jcheck(jb, SFS_JTYPE_HEADER, jb->jb_seq)) {
+		/* never written, or lost; there's nothing to go on */
+		kprintf("sfs: %s: journal header bad; not replayed\n",
+			sfs->sfs_sb.sb_volname);
+		result = sfs_jnextseq(sfs, start, end, jb, &seq);
+		if (result == 0) {
+			result = sfs_jwriteheader(sfs, start, seq, jb);
+		}
+		goto out;
+	}
+
+	/* Find the committed transactions */
+	seq = jb->jb_seq;
+	n = 0;
+	for (p = start + 1; p + 1 < end; ) {
+		result = sfs_jio(sfs, p, jb, 1, UIO_READ);
+		if (result) {
+			goto out;
+		}
+		if (!sfs_jcheck(jb, SFS_JTYPE_DESC, seq) ||
+		    p + 1 + sfs_jnimages(jb) >= end) {
+			break;
+		}
+		result = sfs_jio(sfs, p + 1 + sfs_jnimages(jb), data, 1,
+				 UIO_READ);
+		if (result) {
+			goto out;
+		}
+		if (!sfs_jcheck((struct sfs_jblock *)data,
+				SFS_JTYPE_COMMIT, seq)) {
+			break;
+		}
+		KASSERT(n < max);
+		pos[n++] = p;
+		p += sfs_jnimages(jb) + 2;
+		seq++;
+	}
+
+	if (n > 0) {
+		kprintf("sfs: %s: replaying %u journal transactions\n",
+			sfs->sfs_sb.sb_volname, n);
+		result = sfs_jreplay(sfs, pos, n, jb, data);
+		if (result) {
+			goto out;
+		}
+	}
+
+	/* Everything replayed is on disk now; empty the journal */
+	result = sfs_jwriteheader(sfs, start, seq, jb);
+
+ out:
+	kfree(pos);
+	kfree(data);
+	kfree(jb);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Setup and teardown
+
+/*
+ * Give a volume without a journal one: a run of free blocks, marked
+ * in use in the freemap and pointed to by the superblock. If there's
+ * no room for it, the volume is used without. On failure the run is
+ * freed again and the superblock left as it was.
+ */
+static
+int
+sfs_jcreate(struct sfs_fs *sfs)
+{
+	struct sfs_jblock *jb;
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	daddr_t start;
+	unsigned size, i;
+	int result;
+
+	size = SFS_JOURNALBLOCKS;
+	if (size > nblocks / 16) {
+		size = nblocks / 16;
+	}
+	if (size < SFS_JMAXENTRIES + 3 ||
+	    sfs_balloc_run(sfs, size, &start)) {
+		kprintf("sfs: %s: no room for a journal\n",
+			sfs->sfs_sb.sb_volname);
+		return 0;
+	}
+
+	/* The header first, then the superblock pointing to it */
+	jb = kmalloc(sizeof(*jb));
+	if (jb == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	result = sfs_jwriteheader(sfs, start, 1, jb);
+	kfree(jb);
+	if (result) {
+		goto fail;
+	}
+	sfs->sfs_sb.sb_journal = start;
+	sfs->sfs_sb.sb_journalblocks = size;
+	result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+				sizeof(sfs->sfs_sb));
+	if (result == 0) {
+		result = buffer_sync(sfs->sfs_device);
+	}
+	if (result) {
+		/* put back the old superblock, if it's still cached */
+		sfs->sfs_sb.sb_journal = 0;
+		sfs->sfs_sb.sb_journalblocks = 0;
+		(void)sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+				     sizeof(sfs->sfs_sb));
+		goto fail;
+	}
+	kprintf("sfs: %s: made a %u-block journal\n",
+		sfs->sfs_sb.sb_volname, size);
+	return 0;
+
+ fail:
+	for (i=0; i<size; i++) {
+		sfs_bfree(sfs, start + i);
+	}
+	return result;
+}
+
+/*
+ * Start journaling. Called at mount, after recovery and once the
+ * freemap is loaded. A volume without a journal is used without one,
+ * unless CREATE asks for one to be made.
+ */
+int
+sfs_jstart(struct sfs_fs *sfs, bool create)
+{
+	struct sfs_journal *j;
+	struct sfs_jblock *jb;
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	int result;
+
+	COMPILE_ASSERT(sizeof(struct sfs_jblock) == SFS_BLOCKSIZE);
+	COMPILE_ASSERT(SFS_JMAXENTRIES <= SFS_JDESCMAX);
+	COMPILE_ASSERT(SFS_JLIMIT + SFS_JOPMAX <= SFS_JMAXENTRIES);
+	COMPILE_ASSERT(SFS_JMAXENTRIES <= BUFFER_MAXHELD);
+
+	if (sfs->sfs_sb.sb_journalblocks == 0) {
+		if (!create) {
+			return 0;
+		}
+		result = sfs_jcreate(sfs);
+		if (result || sfs->sfs_sb.sb_journalblocks == 0) {
+			return result;
+		}
+	}
+
+	j = kmalloc(sizeof(struct sfs_journal));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	j->j_lock = lock_create("sfs journal");
+	j->j_cv = cv_create("sfs journal");
+	j->j_logged = bitmap_create(nblocks);
+	j->j_iobuf = kmalloc((SFS_JMAXENTRIES + 1) * SFS_BLOCKSIZE);
+	if (j->j_lock == NULL || j->j_cv == NULL || j->j_logged == NULL ||
+	    j->j_iobuf == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	j->j_nhandles = 0;
+	j->j_reserved = 0;
+	j->j_quiesce = false;
+	j->j_leading = false;
+	j->j_nfsyncs = 0;
+	j->j_ndata = 0;
+	j->j_dataoverflow = false;
+	j->j_error = 0;
+	j->j_nentries = 0;
+	j->j_start = sfs->sfs_sb.sb_journal;
+	j->j_end = j->j_start + sfs->sfs_sb.sb_journalblocks;
+	j->j_head = j->j_start + 1;
+
+	/* sfs_jrecover left the journal empty; pick up its number */
+	jb = (struct sfs_jblock *)j->j_iobuf;
+	result = sfs_jio(sfs, j->j_start, jb, 1, UIO_READ);
+	if (result) {
+		goto fail;
+	}
+	KASSERT(sfs_jcheck(jb, SFS_JTYPE_HEADER, jb->jb_seq));
+	j->j_seq = jb->jb_seq;
+
+	sfs->sfs_journal = j;
+	return 0;
+
+ fail:
+	kfree(j->j_iobuf);
+	if (j->j_logged != NULL) {
+		bitmap_destroy(j->j_logged);
+	}
+	if (j->j_cv != NULL) {
+		cv_destroy(j->j_cv);
+	}
+	if (j->j_lock != NULL) {
+		lock_destroy(j->j_lock);
+	}
+	kfree(j);
+	return result;
+}
+
+/*
+ * Free the journal structure. The journal must have been emptied by
+ * sfs_jcheckpoint.
+ */
+void
+sfs_jdestroy(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_nhandles == 0);
+	KASSERT(j->j_nentries == 0);
+	kfree(j->j_iobuf);
+	bitmap_destroy(j->j_logged);
+	cv_destroy(j->j_cv);
+	lock_destroy(j->j_lock);
+	kfree(j);
+	sfs->sfs_journal = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Commit and checkpoint
+
+/*
+ * Empty the journal: write back everything committed to it, then
+ * move the header on. Blocks of the running transaction stay held.
+ */
+static
+int
+sfs_jreset(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t nblocks = sfs->sfs_sb.sb_nblocks;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	result = buffer_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+	result = sfs_jwriteheader(sfs, j->j_start, j->j_seq,
+				  (struct sfs_jblock *)j->j_iobuf);
+	if (result) {
+		return result;
+	}
+	j->j_head = j->j_start + 1;
+	bzero(bitmap_getdata(j->j_logged), DIVROUNDUP(nblocks, CHAR_BIT));
+	return 0;
+}
+
+/*
+ * Abort the journal because of ERROR while doing WHAT. Only the first
+ * error counts.
+ */
+static
+void
+sfs_jabort(struct sfs_fs *sfs, int error, const char *what)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(error != 0);
+
+	if (j->j_error) {
+		return;
+	}
+	kprintf("sfs: %s: journal %s: %s; volume now read-only\n",
+		sfs->sfs_sb.sb_volname, what, strerror(error));
+	j->j_error = error;
+}
+
+/*
+ * Drop the running transaction of an aborted journal: its changes
+ * leave the cache without ever being written. There must be no open
+ * handles.
+ */
+static
+void
+sfs_jdiscard(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jentry *e;
+	struct buf *buf;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(j->j_nhandles == 0);
+	KASSERT(j->j_error != 0);
+
+	for (i=0; i<j->j_nentries; i++) {
+		e = &j->j_entries[i];
+		if (!e->je_held) {
+			continue;
+		}
+		/* (held, so this finds it in the cache) */
+		if (buffer_read(sfs->sfs_device, e->je_block, &buf) == 0) {
+			buffer_discard(buf);
+			buffer_release(buf);
+		}
+	}
+	j->j_nentries = 0;
+	j->j_ndata = 0;
+	j->j_dataoverflow = false;
+	j->j_nfsyncs = 0;
+	cv_broadcast(j->j_cv, j->j_lock);
+}
+
+/*
+ * Write back the data blocks newly allocated in the running
+ * transaction, ahead of committing it.
+ */
+static
+int
+sfs_jflushdata(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	if (j->j_dataoverflow) {
+		return buffer_sync(sfs->sfs_device);
+	}
+	for (i=0; i<j->j_ndata; i++) {
+		result = buffer_flush(sfs->sfs_device, j->j_data[i].jd_block,
+				      j->j_data[i].jd_len);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Commit the running transaction. There must be no open handles. If
+ * the journal can't be written, it is aborted and the error returned.
+ */
+static
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jentry *e;
+	struct sfs_jblock *jb;
+	struct buf *buf;
+	unsigned i, k;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(j->j_nhandles == 0);
+
+	if (j->j_error) {
+		sfs_jdiscard(sfs);
+		return j->j_error;
+	}
+	if (j->j_nentries == 0) {
+		return 0;
+	}
+
+	k = 0;
+	for (i=0; i<j->j_nentries; i++) {
+		if (!j->j_entries[i].je_revoked) {
+			k++;
+		}
+	}
+	if (j->j_head + k + 2 > j->j_end) {
+		result = sfs_jreset(sfs);
+		if (result) {
+			sfs_jabort(sfs, result, "checkpoint");
+			sfs_jdiscard(sfs);
+			return result;
+		}
+	}
+
+	/* The new data first, for ordered mode */
+	result = sfs_jflushdata(sfs);
+	if (result) {
+		sfs_jabort(sfs, result, "data write");
+		sfs_jdiscard(sfs);
+		return result;
+	}
+
+	/* Descriptor, then the blocks, in one write */
+	jb = (struct sfs_jblock *)j->j_iobuf;
+	bzero(jb, sizeof(*jb));
+	jb->jb_magic = SFS_JMAGIC;
+	jb->jb_type = SFS_JTYPE_DESC;
+	jb->jb_seq = j->j_seq;
+	jb->jb_count = j->j_nentries;
+	k = 1;
+	for (i=0; i<j->j_nentries; i++) {
+		e = &j->j_entries[i];
+		if (e->je_revoked) {
+			jb->jb_blocks[i] = e->je_block | SFS_JREVOKE;
+			continue;
+		}
+		jb->jb_blocks[i] = e->je_block;
+
+		/* (held, so this finds it in the cache) */
+		result = buffer_read(sfs->sfs_device, e->je_block, &buf);
+		if (result) {
+			sfs_jabort(sfs, result, "block read");
+			sfs_jdiscard(sfs);
+			return result;
+		}
+		memcpy(j->j_iobuf + k * SFS_BLOCKSIZE, buffer_map(buf),
+		       SFS_BLOCKSIZE);
+		buffer_release(buf);
+		k++;
+	}
+	result = sfs_jio(sfs, j->j_head, j->j_iobuf, k, UIO_WRITE);
+
+	/* The commit block goes last, in a write of its own */
+	if (result == 0) {
+		bzero(jb, sizeof(*jb));
+		jb->jb_magic = SFS_JMAGIC;
+		jb->jb_type = SFS_JTYPE_COMMIT;
+		jb->jb_seq = j->j_seq;
+		result = sfs_jio(sfs, j->j_head + k, jb, 1, UIO_WRITE);
+	}
+	if (result) {
+		sfs_jabort(sfs, result, "write");
+		sfs_jdiscard(sfs);
+		return result;
+	}
+
+	/* Now the blocks may go home */
+	for (i=0; i<j->j_nentries; i++) {
+		e = &j->j_entries[i];
+		if (e->je_held) {
+			result = buffer_read(sfs->sfs_device, e->je_block,
+					     &buf);
+			KASSERT(result == 0);
+			buffer_unhold(buf);
+			buffer_release(buf);
+		}
+		if (e->je_revoked) {
+			bitmap_unmark(j->j_logged, e->je_block);
+		}
+		else {
+			bitmap_mark(j->j_logged, e->je_block);
+		}
+	}
+
+	spinlock_acquire(&sfs_jstats_lock);
+	sfs_jstats_commits++;
+	spinlock_release(&sfs_jstats_lock);
+
+	DEBUG(DB_SFS, "sfs: %s: committed transaction %u, %u blocks\n",
+	      sfs->sfs_sb.sb_volname, j->j_seq, k - 1);
+
+	j->j_head += k + 1;
+	j->j_seq++;
+	j->j_nentries = 0;
+	j->j_ndata = 0;
+	j->j_dataoverflow = false;
+	j->j_nfsyncs = 0;
+	cv_broadcast(j->j_cv, j->j_lock);
+	return 0;
+}
+
+/*
+ * Hold off new handles and wait for the open ones to end, so that the
+ * running transaction can be committed. If someone else is doing so
+ * already, wait for them first.
+ */
+static
+void
+sfs_jquiesce(struct sfs_journal *j)
+{
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	while (j->j_quiesce) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_quiesce = true;
+	while (j->j_nhandles > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+}
+
+static
+void
+sfs_jresume(struct sfs_journal *j)
+{
+	KASSERT(lock_do_i_hold(j->j_lock));
+	KASSERT(j->j_quiesce);
+
+	j->j_quiesce = false;
+	cv_broadcast(j->j_cv, j->j_lock);
+}
+
+/*
+ * Commit the running transaction and empty the journal, for sync and
+ * unmount. Without a journal, this just writes back the buffer cache.
+ */
+int
+sfs_jcheckpoint(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return buffer_sync(sfs->sfs_device);
+	}
+
+	lock_acquire(j->j_lock);
+	sfs_jquiesce(j);
+	result = sfs_jcommit(sfs);
+	if (result == 0) {
+		result = sfs_jreset(sfs);
+	}
+	sfs_jresume(j);
+	lock_release(j->j_lock);
+	return result;
+}
+
+/*
+ * Wait until everything done in handles that have ended is committed,
+ * for fsync. Concurrent callers are committed as a group. Without a
+ * journal, this writes back the buffer cache.
+ */
+int
+sfs_jfsync(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t seq;
+	unsigned n, quiet, i;
+	int result;
+
+	if (j == NULL) {
+		return buffer_sync(sfs->sfs_device);
+	}
+
+	lock_acquire(j->j_lock);
+	if (j->j_error) {
+		result = j->j_error;
+		lock_release(j->j_lock);
+		return result;
+	}
+	if (j->j_nentries == 0) {
+		/* nothing uncommitted */
+		lock_release(j->j_lock);
+		return 0;
+	}
+
+	/* Our changes are in this transaction, or an earlier one */
+	seq = j->j_seq;
+	j->j_nfsyncs++;
+	cv_broadcast(j->j_cv, j->j_lock);
+	while (j->j_seq == seq && j->j_error == 0) {
+		if (j->j_leading) {
+			cv_wait(j->j_cv, j->j_lock);
+			continue;
+		}
+
+		/*
+		 * Lead the group. Every fsync arriving and every handle
+		 * ending wakes us; stop once SFS_JGROUPQUIET wakeups in
+		 * a row bring no one new, or nothing is in progress
+		 * that could.
+		 */
+		j->j_leading = true;
+		quiet = 0;
+		for (i=0; i<SFS_JGROUPMAX && quiet<SFS_JGROUPQUIET &&
+			     j->j_nhandles > 0; i++) {
+			n = j->j_nfsyncs;
+			cv_wait(j->j_cv, j->j_lock);
+			if (j->j_seq != seq) {
+				/* committed to make room meanwhile */
+				break;
+			}
+			quiet = (j->j_nfsyncs == n) ? quiet + 1 : 0;
+		}
+
+		sfs_jquiesce(j);
+		if (j->j_seq == seq) {
+			(void)sfs_jcommit(sfs);
+		}
+		sfs_jresume(j);
+		j->j_leading = false;
+	}
+	/* if our transaction never made it, it was lost to an abort */
+	result = (j->j_seq == seq) ? j->j_error : 0;
+	lock_release(j->j_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Handles
+
+/*
+ * Wait until a new handle can be admitted, committing the running
+ * transaction to make room if there are no handles open. Fails if
+ * the journal is aborted, meanwhile or before.
+ */
+static
+int
+sfs_jadmit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	while (j->j_error == 0 && (j->j_quiesce ||
+	       j->j_nentries + j->j_reserved + SFS_JOPMAX > SFS_JLIMIT)) {
+		if (!j->j_quiesce && j->j_nhandles == 0) {
+			(void)sfs_jcommit(sfs);
+		}
+		else {
+			cv_wait(j->j_cv, j->j_lock);
+		}
+	}
+	return j->j_error;
+}
+
+/*
+ * Open a handle on the running transaction. Waits while a checkpoint
+ * is under way, or while admitting this operation could overfill the
+ * transaction; in the latter case, once there are no handles open,
+ * the transaction is committed to make room. Once the journal is
+ * aborted, this fails with the error that aborted it.
+ */
+int
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_lock);
+	result = sfs_jadmit(sfs);
+	if (result) {
+		lock_release(j->j_lock);
+		return result;
+	}
+	j->j_nhandles++;
+	j->j_reserved += SFS_JOPMAX;
+	lock_release(j->j_lock);
+	return 0;
+}
+
+/*
+ * Open a handle, perhaps inside another. If no handle is open, the
+ * caller can't be inside one, so this waits like sfs_jbegin; that
+ * way only joins nested in an admitted handle go past SFS_JLIMIT.
+ * Otherwise it must not wait, since the handle may be the caller's.
+ * This never fails: in an aborted journal, the changes made in the
+ * handle are just dropped.
+ */
+void
+sfs_jjoin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	if (j->j_nhandles == 0) {
+		(void)sfs_jadmit(sfs);
+	}
+	j->j_nhandles++;
+	j->j_reserved += SFS_JOPMAX;
+	lock_release(j->j_lock);
+}
+
+/*
+ * Close a handle from sfs_jbegin or sfs_jjoin.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_nhandles > 0);
+	KASSERT(j->j_reserved >= SFS_JOPMAX);
+	j->j_nhandles--;
+	j->j_reserved -= SFS_JOPMAX;
+	if (j->j_error && j->j_nhandles == 0) {
+		/* no one left to make changes; drop them */
+		sfs_jdiscard(sfs);
+	}
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+}
+
+/*
+ * Whether the running transaction can take another SFS_JOPMAX blocks
+ * past what it already has and what the open handles (the caller's
+ * included) have been promised; for callers that change an
+ * open-ended number of things inside one handle.
+ */
+bool
+sfs_jroom(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	bool ret;
+
+	if (j == NULL) {
+		return true;
+	}
+
+	lock_acquire(j->j_lock);
+	ret = j->j_nentries + j->j_reserved + SFS_JOPMAX <= SFS_JMAXENTRIES;
+	lock_release(j->j_lock);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// Changes
+
+/*
+ * Find BLOCK in the running transaction, adding it if it isn't there.
+ * Returns NULL if the transaction is full.
+ */
+static
+struct sfs_jentry *
+sfs_jentry(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jentry *e;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+
+	for (i=0; i<j->j_nentries; i++) {
+		if (j->j_entries[i].je_block == block) {
+			return &j->j_entries[i];
+		}
+	}
+	if (j->j_nentries == SFS_JMAXENTRIES) {
+		return NULL;
+	}
+	e = &j->j_entries[j->j_nentries++];
+	e->je_block = block;
+	e->je_held = false;
+	e->je_revoked = false;
+	return e;
+}
+
+/*
+ * Mark BUF, which holds metadata block BLOCK and was just changed,
+ * dirty, as part of the running transaction. The caller must have a
+ * handle open. If the journal is aborted, or this would overflow the
+ * transaction and so aborts it, the change is dropped instead.
+ */
+void
+sfs_jdirty(struct sfs_fs *sfs, daddr_t block, struct buf *buf)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jentry *e;
+
+	if (j == NULL) {
+		buffer_mark_dirty(buf);
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_nhandles > 0);
+	e = (j->j_error == 0) ? sfs_jentry(sfs, block) : NULL;
+	if (e == NULL) {
+		sfs_jabort(sfs, EIO, "transaction overflow");
+		buffer_discard(buf);
+		lock_release(j->j_lock);
+		return;
+	}
+	buffer_mark_dirty(buf);
+	e->je_revoked = false;
+	if (!e->je_held) {
+		buffer_hold(buf);
+		e->je_held = true;
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Note that BLOCK has been freed, in case the journal has copies of
+ * it. The caller must have a handle open.
+ */
+void
+sfs_jrevoke(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jentry *e;
+	unsigned i;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_nhandles > 0);
+	if (j->j_error) {
+		lock_release(j->j_lock);
+		return;
+	}
+	for (i=0; i<j->j_nentries; i++) {
+		if (j->j_entries[i].je_block == block) {
+			break;
+		}
+	}
+	if (i < j->j_nentries || bitmap_isset(j->j_logged, block)) {
+		e = sfs_jentry(sfs, block);
+		if (e == NULL) {
+			sfs_jabort(sfs, EIO, "transaction overflow");
+		}
+		else {
+			e->je_revoked = true;
+		}
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Note that BLOCK was just allocated for file data, so that it is
+ * written back before the running transaction is committed. The
+ * caller must have a handle open.
+ */
+void
+sfs_jdata(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jdata *d;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_nhandles > 0);
+	d = (j->j_ndata > 0) ? &j->j_data[j->j_ndata - 1] : NULL;
+	if (d != NULL && d->jd_block + d->jd_len == block) {
+		d->jd_len++;
+	}
+	else if (j->j_ndata < SFS_JMAXDATA) {
+		d = &j->j_data[j->j_ndata++];
+		d->jd_block = block;
+		d->jd_len = 1;
+	}
+	else {
+		j->j_dataoverflow = true;
+	}
+	lock_release(j->j_lock);
+}
+
+unsigned long
+sfs_journal_commits(void)
+{
+	unsigned long ret;
+
+	spinlock_acquire(&sfs_jstats_lock);
+	ret = sfs_jstats_commits;
+	spinlock_release(&sfs_jstats_lock);
+	return ret;
+}
@@ -38,6 +38,7 @@
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -91,39 +92,54 @@ sfs_eachopendir(struct vnode *v, int openflags)
 }
 
 /*
- * Called for read(). sfs_io() does the work.
+ * Called for read(). sfs_io() does the work, and the locking.
  */
 static
 int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	return sfs_io(sv, uio);
+}
 
-	return result;
+/*
+ * Write SV's inode, which the caller has changed, into the running
+ * journal transaction along with the rest of the operation. If that
+ * fails, the inode stays dirty and goes in a later one.
+ */
+static
+void
+sfs_jinode(struct sfs_vnode *sv)
+{
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	(void)sfs_sync_inode(sv);
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Called for write(). sfs_io() does the work, and the locking.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_acquire(sv->sv_lock);
+	sfs_jinode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	return result;
 }
@@ -164,8 +180,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	lock_release(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -185,16 +203,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -214,21 +228,27 @@ sfs_isseekable(struct vnode *v)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Called for fsync(). The file's data goes to disk first, then the
+ * journal commits its metadata, together with that of any other
+ * fsyncs going on at the same time.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
-
-	return result;
+	result = sfs_flush_inode(sv);
+	if (result) {
+		return result;
+	}
+	result = sfs_data_flush(sv);
+	if (result) {
+		return result;
+	}
+	return sfs_jfsync(sfs);
 }
 
 /*
@@ -249,9 +269,21 @@ static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
 
-	return sfs_itrunc(sv, len);
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	sfs_jinode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
 }
 
 /*
@@ -289,18 +321,24 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EEXIST;
 	}
 
@@ -308,18 +346,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -330,19 +371,25 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
+	sfs_jinode(sv);
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	sfs_jinode(newguy);
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_absvn;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -355,32 +402,44 @@ static
 int
 sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
 
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EINVAL;
 	}
 
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
+	sfs_jinode(sv);
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	sfs_jinode(f);
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -391,17 +450,23 @@ static
 int
 sfs_remove(struct vnode *dir, const char *name)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -409,44 +474,86 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		sfs_jinode(victim);
+		lock_release(victim->sv_lock);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return result;
 }
 
+/*
+ * Lock two directories for rename. To keep two renames going in
+ * opposite directions from deadlocking, the one with the lower inode
+ * number is always locked first.
+ */
+static
+void
+sfs_lock2dirs(struct sfs_vnode *a, struct sfs_vnode *b)
+{
+	if (a == b) {
+		lock_acquire(a->sv_lock);
+		return;
+	}
+	if (a->sv_ino > b->sv_ino) {
+		struct sfs_vnode *t = a;
+		a = b;
+		b = t;
+	}
+	lock_acquire(a->sv_lock);
+	lock_acquire(b->sv_lock);
+}
+
+static
+void
+sfs_unlock2dirs(struct sfs_vnode *a, struct sfs_vnode *b)
+{
+	lock_release(a->sv_lock);
+	if (a != b) {
+		lock_release(b->sv_lock);
+	}
+}
+
 /*
  * Rename a file.
  *
- * Since we don't support subdirectories, assumes that the two
- * directories passed are the same.
+ * Since we don't support subdirectories, the two directories passed
+ * are in practice always the same (the root); but lock them as if
+ * they might not be.
  */
 static
 int
 sfs_rename(struct vnode *d1, const char *n1,
 	   struct vnode *d2, const char *n2)
 {
-	struct sfs_vnode *sv = d1->vn_data;
-	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_vnode *sv1 = d1->vn_data;
+	struct sfs_vnode *sv2 = d2->vn_data;
+	struct sfs_fs *sfs = sv1->sv_absvn.vn_fs->fs_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
+	KASSERT(d1->vn_fs == d2->vn_fs);
 
-	KASSERT(d1==d2);
-	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
+	result = sfs_jbegin(sfs);
+	if (result) {
+		return result;
+	}
+	sfs_lock2dirs(sv1, sv2);
 
 	/* Look up the old name of the file and get its inode and slot number*/
-	result = sfs_lookonce(sv, n1, &g1, &slot1);
+	result = sfs_lookonce(sv1, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		sfs_unlock2dirs(sv1, sv2);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -461,17 +568,19 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * the new name doesn't already exist; might as well use the
 	 * existing link routine.
 	 */
-	result = sfs_dir_link(sv, n2, g1->sv_ino, &slot2);
+	result = sfs_dir_link(sv2, n2, g1->sv_ino, &slot2);
 	if (result) {
 		goto puke;
 	}
 
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	result = sfs_dir_unlink(sv1, slot1);
 	if (result) {
 		goto puke_harder;
 	}
@@ -480,21 +589,29 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	sfs_jinode(g1);
+	lock_release(g1->sv_lock);
+	sfs_jinode(sv2);
+	if (sv1 != sv2) {
+		sfs_jinode(sv1);
+	}
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
+	sfs_unlock2dirs(sv1, sv2);
+	sfs_jend(sfs);
 	return 0;
 
  puke_harder:
 	/*
 	 * Error recovery: try to undo what we already did
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_unlink(sv2, slot2);
 	if (result2) {
 		kprintf("sfs: %s: rename: %s\n",
 			sfs->sfs_sb.sb_volname, strerror(result));
@@ -503,11 +620,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 		panic("sfs: %s: rename: Cannot recover\n",
 		      sfs->sfs_sb.sb_volname);
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	sfs_jinode(g1);
+	lock_release(g1->sv_lock);
  puke:
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
+	sfs_unlock2dirs(sv1, sv2);
+	sfs_jend(sfs);
 	return result;
 }
 
@@ -525,15 +646,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +658,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -559,22 +675,22 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return ENOTDIR;
 	}
 
 	result = sfs_lookonce(sv, path, &final, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -32,6 +32,8 @@
 
 #include <uio.h> /* for uio_rw */
 
+struct buf;	/* from buf.h */
+
 
 /* ops tables (in sfs_vnops.c) */
 extern const struct vnode_ops sfs_fileops;
@@ -43,13 +45,22 @@ extern const struct vnode_ops sfs_dirops;
 
 
 /* Functions in sfs_balloc.c */
+int sfs_freemap_summarize(struct sfs_fs *sfs);
 int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc_near(struct sfs_fs *sfs, daddr_t goal, bool zero,
+		daddr_t *diskblock);
+int sfs_balloc_run(struct sfs_fs *sfs, unsigned n, daddr_t *start);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
+int sfs_bmap_overwrite(struct sfs_vnode *sv, uint32_t fileblock,
+		daddr_t *diskblock);
+int sfs_bmaprun(struct sfs_vnode *sv, uint32_t fileblock,
+		daddr_t *diskblock, uint32_t *nblocks);
+void sfs_extmap_invalidate(struct sfs_vnode *sv);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -58,12 +69,17 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dirhash_destroy(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
 /* Functions in sfs_inode.c */
+int sfs_vntable_init(struct sfs_fs *sfs);
+void sfs_vntable_cleanup(struct sfs_fs *sfs);
+int sfs_icache_flush(struct sfs_fs *sfs);
 int sfs_sync_inode(struct sfs_vnode *sv);
+int sfs_flush_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
 int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		struct sfs_vnode **ret);
@@ -74,8 +90,25 @@ int sfs_getroot(struct fs *fs, struct vnode **ret);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+int sfs_tail_flush(struct sfs_vnode *sv);
+int sfs_data_flush(struct sfs_vnode *sv);
+void sfs_tail_trunc(struct sfs_vnode *sv, off_t len);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
+/* Functions in sfs_journal.c */
+int sfs_jrecover(struct sfs_fs *sfs);
+int sfs_jstart(struct sfs_fs *sfs, bool create);
+void sfs_jdestroy(struct sfs_fs *sfs);
+int sfs_jcheckpoint(struct sfs_fs *sfs);
+int sfs_jfsync(struct sfs_fs *sfs);
+int sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jjoin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+bool sfs_jroom(struct sfs_fs *sfs);
+void sfs_jdirty(struct sfs_fs *sfs, daddr_t block, struct buf *buf);
+void sfs_jrevoke(struct sfs_fs *sfs, daddr_t block);
+void sfs_jdata(struct sfs_fs *sfs, daddr_t block);
+
 
 #endif /* _SFSPRIVATE_H_ */
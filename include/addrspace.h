@@ -37,6 +37,7 @@
 
 #include <vm.h>
 #include "opt-dumbvm.h"
+#include "opt-shell.h"
 
 struct vnode;
 
@@ -48,8 +49,62 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_DUMBVM && OPT_SHELL
+/*
+ * Demand-paged dumbvm. An address space is a list of regions (the ELF
+ * segments and the stack) plus a two-level page table; frames are only
+ * allocated when a page is first touched. Pages of a region backed by
+ * the executable are read from AS_FILE at that point.
+ */
+#define AS_MAXREGIONS   6
+#define PT_PAGEBITS     12      /* log2(PAGE_SIZE) */
+#define PT_DIRBITS      9       /* top 9 bits of a user address */
+#define PT_TABBITS      10      /* next 10 bits */
+#define PT_DIRSIZE      (1 << PT_DIRBITS)
+#define PT_TABSIZE      (1 << PT_TABBITS)
+#define PT_DIRINDEX(va) (((va) >> (PT_PAGEBITS + PT_TABBITS)) & (PT_DIRSIZE-1))
+#define PT_TABINDEX(va) (((va) >> PT_PAGEBITS) & (PT_TABSIZE-1))
+
+/* page table entry: frame address plus flag bits */
+#define PTE_VALID       0x00000001
+#define PTE_FRAME       PAGE_FRAME
+#define PTE_SWAPPED     0x00000002      /* frame field holds a swap slot */
+#define PTE_BUSY        0x00000004      /* page-in or page-out under way */
+#define PTE_SLOT(pte)   ((pte) >> PT_PAGEBITS)
+#define PTE_MKSLOT(s)   ((uint32_t)(s) << PT_PAGEBITS)
+
+/*
+ * TLB PID (address space ID) of this address space on each cpu, valid
+ * while tp_gen matches that cpu's c_tlb_pidgen. Cpus numbered
+ * AS_MAXCPUS and up flush the TLB on every switch instead.
+ */
+#define AS_MAXCPUS      32
+
+struct as_tlbpid {
+        unsigned tp_gen;        /* 0: none */
+        unsigned tp_pid;
+};
+
+struct as_region {
+        vaddr_t ar_vbase;       /* page aligned */
+        size_t ar_npages;
+        int ar_writeable;
+        /* part of the region initialized from the executable */
+        vaddr_t ar_filevaddr;
+        size_t ar_filesize;
+        off_t ar_fileoffset;
+};
+#endif
+
 struct addrspace {
-#if OPT_DUMBVM
+#if OPT_DUMBVM && OPT_SHELL
+        struct as_region as_regions[AS_MAXREGIONS];
+        unsigned as_nregions;
+        uint32_t *as_ptdir[PT_DIRSIZE]; /* second level tables or NULL */
+        struct vnode *as_file;          /* executable, or NULL */
+        unsigned as_resident;           /* pages that have a frame */
+        struct as_tlbpid as_tlbpid[AS_MAXCPUS];
+#elif OPT_DUMBVM
         vaddr_t as_vbase1;
         paddr_t as_pbase1;
         size_t as_npages1;
@@ -118,6 +173,21 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if OPT_DUMBVM && OPT_SHELL
+/*
+ *    as_define_file - record that FILESIZE bytes at VADDR come from
+ *                offset OFFSET of V. They are read in when first
+ *                touched instead of by load_elf.
+ *
+ *    as_getsize - report the virtual and resident size, in pages.
+ */
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t filesize);
+void              as_getsize(struct addrspace *as,
+                             unsigned *virtpages, unsigned *respages);
+#endif
+
 
 /*
  * Functions in loadelf.c
@@ -0,0 +1,83 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache for block devices.
+ *
+ * Blocks are cached by (device, block number) and shared by everyone
+ * doing I/O on the device, file data and metadata alike. Writes only
+ * dirty the buffer; it goes to disk when it is recycled or on
+ * buffer_sync.
+ *
+ *    buffer_bootstrap  - set up the cache. Called from vfs_bootstrap.
+ *    buffer_read       - get the buffer for BLOCK of DEV, reading it
+ *                        from the device unless it is cached.
+ *    buffer_get        - the same without reading, for callers about
+ *                        to overwrite the whole block. The contents
+ *                        are undefined unless the block was cached.
+ *    buffer_map        - the buffer's data (one device block).
+ *    buffer_mark_dirty - note that the data was changed.
+ *    buffer_release    - give the buffer back.
+ *    buffer_hold       - keep the buffer, which must be dirty, from
+ *                        being written back or recycled until
+ *                        buffer_unhold; for a journal, whose changes
+ *                        may not reach their place on disk before
+ *                        the journal itself.
+ *    buffer_unhold     - let it go again.
+ *    buffer_discard    - drop the buffer's changes, held or not; the
+ *                        block is read from disk again next time.
+ *    buffer_sync       - write back the dirty buffers of DEV.
+ *    buffer_flush      - write back the dirty buffers for N blocks of
+ *                        DEV from BLOCK on.
+ *    buffer_invalidate - forget the buffers of DEV, which must all be
+ *                        clean and released; for unmount.
+ *    buffer_readrun    - bring N consecutive blocks of DEV from BLOCK
+ *                        on into the cache, reading those not cached
+ *                        in as few transfers as possible. May stop
+ *                        short rather than wait for buffers.
+ *    buffer_incore     - whether BLOCK of DEV is cached (or being read).
+ *    buffer_prefetch   - start reading BLOCK of DEV into the cache in
+ *                        the background, unless it is there already.
+ *    buffer_readahead  - turn buffer_prefetch on or off; returns the
+ *                        old setting.
+ *    buffer_readahead_hits - how many blocks read ahead were then
+ *                        read by someone, so far.
+ *    buffer_printstats - print hit/miss and write-back counts.
+ *
+ * A buffer belongs to its caller until buffer_release, and anyone
+ * else after the same block waits. So don't hold one across anything
+ * that may need another buffer or sleep for long, such as a uiomove
+ * to user space (which can page fault).
+ *
+ * buffer_hold and buffer_unhold are called on a buffer the caller
+ * has from buffer_read or buffer_get. A held buffer stays in the
+ * cache, so there must never be many of them: no more than
+ * BUFFER_MAXHELD for any one device. The cache is sized to leave
+ * plenty over.
+ */
+
+#define BUFFER_MAXHELD  64
+
+struct buf;
+struct device;
+
+void buffer_bootstrap(void);
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+void *buffer_map(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_release(struct buf *b);
+void buffer_hold(struct buf *b);
+void buffer_unhold(struct buf *b);
+void buffer_discard(struct buf *b);
+int buffer_sync(struct device *dev);
+int buffer_flush(struct device *dev, daddr_t block, unsigned n);
+void buffer_invalidate(struct device *dev);
+int buffer_readrun(struct device *dev, daddr_t block, unsigned n);
+bool buffer_incore(struct device *dev, daddr_t block);
+void buffer_prefetch(struct device *dev, daddr_t block);
+bool buffer_readahead(bool on);
+unsigned long buffer_readahead_hits(void);
+void buffer_printstats(void);
+
+#endif /* _BUF_H_ */
@@ -35,6 +35,8 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct addrspace;
+
 
 /*
  * Per-cpu structure
@@ -62,6 +64,18 @@ struct cpu {
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * TLB counters kept by the VM system. Written only by this
+	 * cpu with interrupts off; read by the statistics code.
+	 */
+	unsigned c_tlb_victim;		/* Next round-robin TLB victim */
+	unsigned c_tlb_pidgen;		/* Current TLB PID generation */
+	unsigned c_tlb_nextpid;		/* Next TLB PID to hand out */
+	unsigned long c_tlb_faults;	/* TLB entries loaded */
+	unsigned long c_tlb_replacements; /* ... that evicted a valid one */
+	unsigned long c_tlb_invalidations; /* Whole-TLB flushes */
+	struct addrspace *c_curas;	/* Last address space activated */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -107,6 +121,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Number of CPUs, and the CPU numbered N (as in c_number), for code
+ * reporting per-cpu statistics.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned n);
+
 /*
  * Produce a string describing the CPU type.
  */
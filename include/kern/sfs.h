@@ -74,7 +74,9 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_journal;			/* First block of journal */
+	uint32_t sb_journalblocks;		/* Its size; 0 if none */
+	uint32_t reserved[116];			/* unused, set to 0 */
 };
 
 /*
@@ -97,5 +99,37 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Metadata journal, in the sb_journalblocks consecutive blocks from
+ * sb_journal; a volume with sb_journalblocks 0 has none. Like the
+ * superblock and the freemap, the journal's blocks are marked in use
+ * in the freemap but belong to no file, and tools that check the
+ * freemap must count them as in use. mksfs may make a journal of
+ * SFS_JOURNALBLOCKS blocks; the kernel makes one only when asked to
+ * at mount.
+ *
+ * The journal's first block is a header holding the sequence
+ * number of the first transaction to replay. Transactions follow it
+ * back to back, each a descriptor block listing the blocks changed,
+ * the new contents of those blocks, and a commit block. A descriptor
+ * entry with SFS_JREVOKE set has no contents: it says the block was
+ * freed, and older copies of it in the journal must not be replayed.
+ */
+#define SFS_JOURNALBLOCKS 256           /* size of a new journal */
+#define SFS_JMAGIC        0x6a726e6c    /* journal block magic */
+#define SFS_JTYPE_HEADER  1
+#define SFS_JTYPE_DESC    2
+#define SFS_JTYPE_COMMIT  3
+#define SFS_JREVOKE       0x80000000    /* descriptor entry flag */
+#define SFS_JDESCMAX      124           /* entries per descriptor */
+
+struct sfs_jblock {
+	uint32_t jb_magic;			/* SFS_JMAGIC */
+	uint32_t jb_type;			/* One of SFS_JTYPE_* */
+	uint32_t jb_seq;			/* Transaction sequence number */
+	uint32_t jb_count;			/* Descriptor: # of entries */
+	uint32_t jb_blocks[SFS_JDESCMAX];	/* Descriptor: the entries */
+};
+
 
 #endif /* _KERN_SFS_H_ */
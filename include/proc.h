@@ -64,7 +64,6 @@ struct vnode;
 struct fileTableEntry
 { 
   struct openfile* of;
-  off_t offset;
   int flags;
   int fd;
 
@@ -121,6 +120,7 @@ struct addrspace *proc_setas(struct addrspace *);
 int proc_wait(struct proc *proc);
 struct proc *proc_search_pid(pid_t pid);
 void proc_file_table_copy(struct proc *psrc, struct proc *pdest);
+void proc_printmem(void);
 
 #endif
 
@@ -48,14 +48,48 @@
  */
 #include <kern/sfs.h>
 
+struct sfs_dirhash;	/* Opaque; see sfs_dir.c */
+struct sfs_journal;	/* Opaque; see sfs_journal.c */
+
+/*
+ * A run of file blocks stored in consecutive disk blocks.
+ */
+struct sfs_extent {
+	uint32_t se_fileblock;		/* first block in the file */
+	daddr_t se_diskblock;		/* where it is on disk */
+	uint32_t se_len;		/* number of blocks */
+};
+
 /*
  * In-memory inode
+ *
+ * sv_lock protects sv_i and sv_dirty, and with them the block map of
+ * the file; for a directory it also covers the directory entries.
+ * sfi_type never changes once the vnode is loaded.
+ *
+ * Lock order: a directory's sv_lock, then sfs_vnlock, then the
+ * sv_lock of a file, then sfs_freemaplock, then the buffer cache.
+ * Where two directories must be locked (rename), the one with the
+ * lower inode number goes first.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t sv_ranext;             /* next block of a sequential read */
+	uint32_t sv_raend;              /* read ahead up to here */
+	unsigned sv_rawindow;           /* read-ahead size, in blocks */
+	struct sfs_extent *sv_extents;  /* block map as extents, or NULL */
+	unsigned sv_nextents;
+	struct sfs_dirhash *sv_dirhash; /* directory name index, or NULL */
+	char *sv_tail;                  /* unallocated block's data, or NULL */
+	uint32_t sv_tailblock;          /* which block of the file it is */
+	struct sfs_vnode *sv_hashnext;  /* vnode table chain */
+	struct sfs_vnode *sv_lruprev;   /* inode cache LRU list */
+	struct sfs_vnode *sv_lrunext;
+	bool sv_cached;                 /* unreferenced, on the LRU list */
+	struct lock *sv_lock;           /* protects the above */
 };
 
 /*
@@ -66,9 +100,20 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode **sfs_vntable; /* vnodes loaded into memory */
+	unsigned sfs_vnbuckets;         /* hash chains in sfs_vntable */
+	unsigned sfs_nvnodes;           /* vnodes in sfs_vntable */
+	struct sfs_vnode *sfs_lruhead;  /* unreferenced vnodes, oldest first */
+	struct sfs_vnode *sfs_lrutail;
+	unsigned sfs_ncached;           /* vnodes on the LRU list */
+	struct lock *sfs_vnlock;        /* protects sfs_vntable and LRU */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	bool sfs_freemapdirty;          /* true if a freemap write failed */
+	uint16_t *sfs_regfree;          /* free blocks in each region */
+	unsigned sfs_nregions;
+	unsigned sfs_cursor;            /* region allocated from last */
+	struct lock *sfs_freemaplock;   /* protects the freemap */
+	struct sfs_journal *sfs_journal; /* metadata journal, or NULL */
 };
 
 /*
@@ -76,5 +121,20 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * The same, first giving the volume a journal if it has none.
+ */
+int sfs_mount_journal(const char *device);
+
+/*
+ * Print the inode cache counts (of all sfs volumes).
+ */
+void sfs_icache_printstats(void);
+
+/*
+ * Transactions committed so far (by all journaled sfs volumes).
+ */
+unsigned long sfs_journal_commits(void);
+
 
 #endif /* _SFS_H_ */
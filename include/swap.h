@@ -0,0 +1,35 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space on a raw disk device.
+ *
+ * The device attached with swap_attach is divided into page-sized
+ * slots. A slot can be shared by several address spaces after a fork,
+ * so slots are reference counted like frames.
+ *
+ *    swap_attach    - take DEVNAME (e.g. "lhd1:") for swap, through
+ *                     vfs_swapon. Only one swap device is supported.
+ *    swap_enabled   - true once a device is attached.
+ *    swap_alloc     - get a free slot. Returns ENOSPC when swap is full.
+ *    swap_share     - add a reference to a slot.
+ *    swap_free      - drop a reference; the slot is free at zero.
+ *    swap_out       - write the frame at PADDR to SLOT.
+ *    swap_in        - read SLOT into the frame at PADDR.
+ *    swap_getstats  - the page-in and page-out counts so far.
+ *    swap_printstats - print slot usage and page-in/page-out counts.
+ *
+ * swap_out and swap_in sleep; call them without spinlocks held.
+ */
+
+int swap_attach(const char *devname);
+bool swap_enabled(void);
+int swap_alloc(unsigned *slot);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+int swap_out(paddr_t paddr, unsigned slot);
+int swap_in(paddr_t paddr, unsigned slot);
+void swap_getstats(unsigned long *pageins, unsigned long *pageouts);
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
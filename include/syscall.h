@@ -39,20 +39,38 @@
 
 #define SYSTEM_OPEN_MAX (10 * OPEN_MAX)
 
+/*
+ * One entry of the system open file table. Each open() gets its own
+ * entry; dup2() and fork share it, and with it the file offset.
+ *
+ * TabFile.lk protects slot allocation and countRef only. The offset
+ * and the I/O done through the entry are serialized by the entry's
+ * own lock, so reads and writes on unrelated files never wait for
+ * each other.
+ */
 struct openfile
 {
   struct vnode *vn;
   off_t offset;
+  int openflags;
   unsigned int countRef;
+  struct lock *lk;
+  struct openfile *nextFree;  /* free list link, valid while vn == NULL */
 };
 
+/*
+ * Free entries are chained through nextFree, so taking and returning
+ * a slot is constant time instead of a scan of the whole table.
+ */
 struct tableOpenFile
 {
   struct lock *lk;
+  struct openfile *freeList;
   struct openfile systemFileTable[SYSTEM_OPEN_MAX];
 };
 
 struct trapframe; /* from <machine/trapframe.h> */
+struct uio;
 
 /*
  * The system call dispatcher.
@@ -80,19 +98,32 @@ int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 #if OPT_SHELL
 struct openfile;
+void openfile_bootstrap(void);
 void openfileIncrRefCount(struct openfile *of);
 void openfileDecrRefCount(struct openfile *of);
+int openfile_io(struct openfile *of, struct uio *u);
+int openfile_pio(struct openfile *of, struct uio *u, off_t pos);
 int sys_open(userptr_t path, int openflags, mode_t mode, int *errp);
 int sys_close(int fd);
-int sys_write(int fd, userptr_t buf_ptr, size_t size);
-int sys_read(int fd, userptr_t buf_ptr, size_t size);
+int sys_write(int fd, userptr_t buf_ptr, size_t size, int32_t *retval);
+int sys_read(int fd, userptr_t buf_ptr, size_t size, int32_t *retval);
+int sys_pread(int fd, userptr_t buf_ptr, size_t size, off_t pos,
+              int32_t *retval);
+int sys_pwrite(int fd, userptr_t buf_ptr, size_t size, off_t pos,
+               int32_t *retval);
+int sys_readv(int fd, userptr_t iov_ptr, int iovcnt, int32_t *retval);
+int sys_writev(int fd, userptr_t iov_ptr, int iovcnt, int32_t *retval);
+int sys_preadv(int fd, userptr_t iov_ptr, int iovcnt, off_t pos,
+               int32_t *retval);
+int sys_pwritev(int fd, userptr_t iov_ptr, int iovcnt, off_t pos,
+                int32_t *retval);
 void sys__exit(int status);
 int sys_waitpid(pid_t pid, userptr_t statusp, int options);
 pid_t sys_getpid(void);
 pid_t sys_fork(struct trapframe *ctf);
 int sys__getcwd(char* buf, size_t buflen);
 int sys_execv(char *progname, char *args[]);
-int sys_lseek(int fd ,off_t offset, int start);
+int sys_lseek(int fd, off_t offset, int whence, off_t *retval);
 int sys_dup2(int oldfd,int newfd);
 int sys_remove(userptr_t pathname, int32_t *retval);
 
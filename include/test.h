@@ -87,12 +87,27 @@ int writestress2(int, char **);
 int longstress(int, char **);
 int createstress(int, char **);
 int printfile(int, char **);
+int disktest(int, char **);
+#if OPT_SHELL
+int fileiotest(int, char **);
+int fileiotest2(int, char **);
+int fileiotest3(int, char **);
+int fileiotest4(int, char **);
+int fileiotest5(int, char **);
+int fileiotest6(int, char **);
+int fileiotest7(int, char **);
+#endif
 
 /* other tests */
 int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+#if OPT_SHELL
+int forktest(int, char **);
+int swaptest(int, char **);
+int ctxswtest(int, char **);
+#endif
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -81,6 +81,21 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Lookup cache.
+ *
+ * vfs_lookup remembers what recent lookups found, failures with
+ * ENOENT included, by starting directory and path. The operations
+ * that change names must tell it:
+ *
+ *    vfs_lookcache_forget - forget the lookups of paths ending in
+ *                           NAME; only the failed ones if NEGONLY.
+ *    vfs_lookcache_purge  - forget everything.
+ */
+
+void vfs_lookcache_forget(const char *name, bool negonly);
+void vfs_lookcache_purge(void);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
@@ -58,5 +58,14 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Print physical memory allocator statistics (dumbvm, shell option) */
+void vm_printstats(void);
+
+/* Print (and optionally zero) the per-cpu TLB counters (dumbvm, shell) */
+void vm_printtlbstats(bool reset);
+
+/* Turn TLB address space IDs on or off; returns the old setting */
+bool vm_setasids(bool on);
+
 
 #endif /* _VM_H_ */
@@ -38,6 +38,9 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <buf.h>
+#include <vm.h>
+#include <swap.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -292,6 +295,7 @@ static const struct {
 } mounttable[] = {
 #if OPT_SFS
 	{ "sfs", sfs_mount },
+	{ "sfsj", sfs_mount_journal },	/* add a journal if need be */
 #endif
 };
 
@@ -346,6 +350,23 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+#if OPT_SHELL
+/*
+ * Command to start paging to a raw disk device.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: swapon device:\n");
+		return EINVAL;
+	}
+
+	return swap_attach(args[1]);
+}
+#endif
+
 /*
  * Command to set the "boot fs".
  *
@@ -387,6 +408,75 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_icstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_icache_printstats();
+
+	return 0;
+}
+#endif
+
+#if OPT_SHELL
+static
+int
+cmd_procmem(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printmem();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vm_printtlbstats(true);
+	}
+	else if (nargs == 1) {
+		vm_printtlbstats(false);
+	}
+	else {
+		kprintf("Usage: tlb [reset]\n");
+	}
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -450,6 +540,9 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+#if OPT_SHELL
+	"[swapon]  Swap to a disk device     ",
+#endif
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
@@ -497,6 +590,19 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[dk] Disk throughput test           ",
+#if OPT_SHELL
+	"[fork] Fork+exec test [prog [args]] ",
+	"[sw] Swap page-out/page-in test     ",
+	"[fio] File I/O scaling test         ",
+	"[fio2] Bounce vs. direct file I/O   ",
+	"[fio3] Small-write scaling test     ",
+	"[fio4] Sequential read-ahead test   ",
+	"[fio5] Directory create/lookup test ",
+	"[fio6] Open loaded files test       ",
+	"[fio7] Concurrent fsync test        ",
+	"[ctx] Context switch TLB test       ",
+#endif
 	NULL
 };
 
@@ -521,6 +627,15 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[bc] Buffer cache stats             ",
+#if OPT_SFS
+	"[ic] SFS inode cache stats          ",
+#endif
+#if OPT_SHELL
+	"[ps] Process memory usage           ",
+	"[vm] Physical frame allocator stats ",
+	"[tlb] TLB stats [reset]             ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -556,6 +671,9 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
+#if OPT_SHELL
+	{ "swapon",	cmd_swapon },
+#endif
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
@@ -570,6 +688,15 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "bc",         cmd_bufstats },
+#if OPT_SFS
+	{ "ic",         cmd_icstats },
+#endif
+#if OPT_SHELL
+	{ "ps",         cmd_procmem },
+	{ "vm",         cmd_vmstats },
+	{ "tlb",        cmd_tlbstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -624,6 +751,19 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "dk",		disktest },
+#if OPT_SHELL
+	{ "fork",	forktest },
+	{ "sw",		swaptest },
+	{ "fio",	fileiotest },
+	{ "fio2",	fileiotest2 },
+	{ "fio3",	fileiotest3 },
+	{ "fio4",	fileiotest4 },
+	{ "fio5",	fileiotest5 },
+	{ "fio6",	fileiotest6 },
+	{ "fio7",	fileiotest7 },
+	{ "ctx",	ctxswtest },
+#endif
 
 	{ NULL, NULL }
 };
@@ -50,6 +50,7 @@
 #include <vnode.h>
 #include <syscall.h>
 #include <opt-shell.h>
+#include <opt-dumbvm.h>
 
 
 
@@ -57,8 +58,6 @@
 #include <synch.h>
 #define MAX_PROC 100
 
-extern struct tableOpenFile TabFile;
-
 static struct _processTable {
   int active;           /* initial value 0 */
   struct proc *proc[MAX_PROC+1]; /* [0] not used. pids are >= 1 */
@@ -261,17 +260,21 @@ proc_destroy(struct proc *proc)
 			as_deactivate();
 		}
 		else {
+			/* p_lock keeps proc_printmem off it */
+			spinlock_acquire(&proc->p_lock);
 			as = proc->p_addrspace;
 			proc->p_addrspace = NULL;
+			spinlock_release(&proc->p_lock);
 		}
 		as_destroy(as);
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
 	#if OPT_SHELL
+	/* first out of the table, so nobody can find it and take p_lock */
 	proc_end_waitpid(proc);
 	#endif
+	spinlock_cleanup(&proc->p_lock);
 	kfree(proc->p_name);
 	kfree(proc);
 }
@@ -287,7 +290,7 @@ proc_bootstrap(void)
 		panic("proc_create for kproc failed\n");
 	}
 	#if OPT_SHELL
-	TabFile.lk = lock_create("Tab");
+	openfile_bootstrap();
 	spinlock_init(&processTable.lk);
 	/* kernel process is not registered in the table */
 	processTable.active = 1;
@@ -459,7 +462,7 @@ proc_file_table_copy(struct proc *psrc, struct proc *pdest) {
   int fd;
   for (fd=0; fd<OPEN_MAX; fd++) {
     struct openfile *of = psrc->fileTable[fd].of;
-    pdest->fileTable[fd].of = of;
+    pdest->fileTable[fd] = psrc->fileTable[fd];
     if (of != NULL) {
       /* incr reference count */
       openfileIncrRefCount(of);
@@ -467,3 +470,42 @@ proc_file_table_copy(struct proc *psrc, struct proc *pdest) {
   }
 }
 #endif
+
+#if OPT_SHELL
+/*
+ * Print the virtual and the resident size of each user process.
+ */
+void
+proc_printmem(void)
+{
+  struct proc *p;
+  struct addrspace *as;
+  char name[32];
+  unsigned virtpages, respages;
+  int i;
+
+  kprintf("  PID     VSZ     RSS  NAME\n");
+  for (i=1; i<=MAX_PROC; i++) {
+    virtpages = respages = 0;
+    spinlock_acquire(&processTable.lk);
+    p = processTable.proc[i];
+    if (p != NULL) {
+      spinlock_acquire(&p->p_lock);
+      as = p->p_addrspace;
+#if OPT_DUMBVM
+      if (as != NULL) {
+        as_getsize(as, &virtpages, &respages);
+      }
+#else
+      (void)as;
+#endif
+      spinlock_release(&p->p_lock);
+      snprintf(name, sizeof(name), "%s", p->p_name);
+    }
+    spinlock_release(&processTable.lk);
+    if (p == NULL) continue;
+    kprintf("%5d %6uK %6uK  %s\n", i, virtpages * PAGE_SIZE / 1024,
+	    respages * PAGE_SIZE / 1024, name);
+  }
+}
+#endif
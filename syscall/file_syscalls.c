@@ -33,116 +33,305 @@
 
 struct tableOpenFile TabFile;
 
-void openfileIncrRefCount(struct openfile *of)
+void openfile_bootstrap(void)
 {
   int i;
-  lock_acquire(TabFile.lk);
-  if (of != NULL)
+
+  TabFile.lk = lock_create("Tab");
+  if (TabFile.lk == NULL)
+    panic("openfile_bootstrap: lock_create failed\n");
+  TabFile.freeList = NULL;
+  for (i = SYSTEM_OPEN_MAX - 1; i >= 0; i--)
   {
-    for (i = 0; i < SYSTEM_OPEN_MAX; i++)
-    {
-      if (TabFile.systemFileTable[i].vn != NULL && TabFile.systemFileTable[i].vn == of->vn)
-      {
-        TabFile.systemFileTable[i].countRef++;
-      }
-    }
+    TabFile.systemFileTable[i].vn = NULL;
+    TabFile.systemFileTable[i].nextFree = TabFile.freeList;
+    TabFile.freeList = &TabFile.systemFileTable[i];
   }
+}
+
+void openfileIncrRefCount(struct openfile *of)
+{
+  if (of == NULL)
+    return;
+  lock_acquire(TabFile.lk);
+  KASSERT(of->countRef > 0);
+  of->countRef++;
   lock_release(TabFile.lk);
 }
 
+/*
+ * Drop a reference. The last one frees the slot; the vnode is closed
+ * and the lock destroyed after TabFile.lk is released, so a slow
+ * vfs_close does not hold up other opens.
+ */
 void openfileDecrRefCount(struct openfile *of)
 {
-  int i;
-  if (of != NULL)
+  struct vnode *vn = NULL;
+  struct lock *lk = NULL;
+
+  if (of == NULL)
+    return;
+  lock_acquire(TabFile.lk);
+  KASSERT(of->countRef > 0);
+  of->countRef--;
+  if (of->countRef == 0)
+  {
+    vn = of->vn;
+    lk = of->lk;
+    of->vn = NULL;
+    of->lk = NULL;
+    of->nextFree = TabFile.freeList;
+    TabFile.freeList = of;
+  }
+  lock_release(TabFile.lk);
+
+  if (vn != NULL)
   {
-    for (i = 0; i < SYSTEM_OPEN_MAX; i++)
+    vfs_close(vn);
+    lock_destroy(lk);
+  }
+}
+
+static struct openfile *
+fd_to_openfile(int fd)
+{
+  if (fd < 0 || fd >= OPEN_MAX)
+    return NULL;
+  if (curproc->fileTable[fd].fd == -1)
+    return NULL;
+  return curproc->fileTable[fd].of;
+}
+
+/*
+ * Do the I/O described by u at the openfile's current offset and
+ * advance the offset by the amount transferred. Only of->lk is held
+ * across VOP_READ/VOP_WRITE.
+ */
+int
+openfile_io(struct openfile *of, struct uio *u)
+{
+  struct stat st;
+  int result;
+
+  KASSERT(of != NULL && of->vn != NULL);
+
+  lock_acquire(of->lk);
+  if (u->uio_rw == UIO_WRITE && (of->openflags & O_APPEND))
+  {
+    result = VOP_STAT(of->vn, &st);
+    if (result)
     {
-      if (TabFile.systemFileTable[i].vn != NULL && TabFile.systemFileTable[i].vn == of->vn)
-      {
-        TabFile.systemFileTable[i].countRef--;
-      }
+      lock_release(of->lk);
+      return result;
     }
+    of->offset = st.st_size;
   }
+  u->uio_offset = of->offset;
+  if (u->uio_rw == UIO_READ)
+    result = VOP_READ(of->vn, u);
+  else
+    result = VOP_WRITE(of->vn, u);
+  if (result == 0)
+    of->offset = u->uio_offset;
+  lock_release(of->lk);
+  return result;
+}
+
+/*
+ * Set up a uio that moves data straight between the file and the
+ * user buffer, as load_elf does for program segments, instead of
+ * bouncing it through a kmalloc'd kernel copy.
+ */
+static void
+file_uinit(struct iovec *iov, struct uio *u, userptr_t buf_ptr,
+           size_t size, enum uio_rw rw)
+{
+  iov->iov_ubase = buf_ptr;
+  iov->iov_len = size;
+  u->uio_iov = iov;
+  u->uio_iovcnt = 1;
+  u->uio_resid = size;
+  u->uio_offset = 0;  /* set from the openfile by openfile_io */
+  u->uio_segflg = UIO_USERSPACE;
+  u->uio_rw = rw;
+  u->uio_space = proc_getas();
+}
+
+/*
+ * Positional I/O: transfer at POS without looking at or moving the
+ * shared offset, so of->lk is not needed.
+ */
+int
+openfile_pio(struct openfile *of, struct uio *u, off_t pos)
+{
+  KASSERT(of != NULL && of->vn != NULL);
+
+  if (!VOP_ISSEEKABLE(of->vn))
+    return ESPIPE;
+  if (pos < 0)
+    return EINVAL;
+  u->uio_offset = pos;
+  if (u->uio_rw == UIO_READ)
+    return VOP_READ(of->vn, u);
+  return VOP_WRITE(of->vn, u);
 }
 
+/*
+ * read/write on a file: 0 and the count moved in *retval, or the
+ * error (EBADF, EFAULT for a bad buffer, ENOSPC, ...).
+ */
 static int
-file_read(int fd, userptr_t buf_ptr, size_t size)
+file_rw(int fd, userptr_t buf_ptr, size_t size, enum uio_rw rw,
+        int32_t *retval)
 {
-  lock_acquire(TabFile.lk);
   struct iovec iov;
-  struct uio ku;
-  int offset;
-  int result, nread;
-  struct vnode *vn;
+  struct uio u;
+  int result;
   struct openfile *of;
-  void *kbuf;
 
-  if (fd < 0 || fd > OPEN_MAX)
-    return -1;
-  {
-    of = curproc->fileTable[fd].of;
-    offset = curproc->fileTable[fd].offset;
-  }
+  of = fd_to_openfile(fd);
   if (of == NULL)
-    return -1;
-  vn = of->vn;
-  if (vn == NULL)
-    return -1;
+    return EBADF;
+
+  file_uinit(&iov, &u, buf_ptr, size, rw);
+  result = openfile_io(of, &u);
+  if (result)
+    return result;
+  *retval = size - u.uio_resid;
+  return 0;
+}
 
-  kbuf = kmalloc(size);
-  uio_kinit(&iov, &ku, kbuf, size, offset, UIO_READ);
-  result = VOP_READ(vn, &ku);
+/*
+ * Copy in a user iovec array and set up a uio that gathers from (or
+ * scatters to) all of its buffers in a single VOP call. The caller
+ * frees *kiovp on success.
+ */
+static int
+file_uinitv(struct iovec **kiovp, struct uio *u, userptr_t iov_ptr,
+            int iovcnt, enum uio_rw rw)
+{
+  struct iovec *kiov;
+  size_t total = 0;
+  int i, result;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX)
+    return EINVAL;
+  kiov = kmalloc(iovcnt * sizeof(struct iovec));
+  if (kiov == NULL)
+    return ENOMEM;
+  result = copyin(iov_ptr, kiov, iovcnt * sizeof(struct iovec));
   if (result)
   {
+    kfree(kiov);
     return result;
   }
-  curproc->fileTable[fd].offset = ku.uio_offset;
-  nread = size - ku.uio_resid;
-  copyout(kbuf, buf_ptr, nread);
-  kfree(kbuf);
-  lock_release(TabFile.lk);
-  return (nread);
+  for (i = 0; i < iovcnt; i++)
+  {
+    if (total + kiov[i].iov_len < total)
+    {
+      kfree(kiov);
+      return EINVAL;
+    }
+    total += kiov[i].iov_len;
+  }
+
+  u->uio_iov = kiov;
+  u->uio_iovcnt = iovcnt;
+  u->uio_resid = total;
+  u->uio_offset = 0;
+  u->uio_segflg = UIO_USERSPACE;
+  u->uio_rw = rw;
+  u->uio_space = proc_getas();
+  *kiovp = kiov;
+  return 0;
 }
 
+/*
+ * Common code for readv/writev/preadv/pwritev. POS is NULL for the
+ * variants that use and advance the shared offset.
+ */
 static int
-file_write(int fd, userptr_t buf_ptr, size_t size)
+file_rwv(int fd, userptr_t iov_ptr, int iovcnt, enum uio_rw rw,
+         const off_t *pos, int32_t *retval)
 {
-  lock_acquire(TabFile.lk);
+  struct iovec *kiov;
+  struct uio u;
+  struct openfile *of;
+  size_t total;
+  int result;
 
+  of = fd_to_openfile(fd);
+  if (of == NULL)
+    return EBADF;
+
+  result = file_uinitv(&kiov, &u, iov_ptr, iovcnt, rw);
+  if (result)
+    return result;
+  total = u.uio_resid;
+  if (pos == NULL)
+    result = openfile_io(of, &u);
+  else
+    result = openfile_pio(of, &u, *pos);
+  kfree(kiov);
+  if (result)
+    return result;
+  *retval = total - u.uio_resid;
+  return 0;
+}
+
+static int
+file_prw(int fd, userptr_t buf_ptr, size_t size, off_t pos,
+         enum uio_rw rw, int32_t *retval)
+{
   struct iovec iov;
-  struct uio ku;
-  int offset;
-  int result, nwrite;
-  struct vnode *vn;
+  struct uio u;
   struct openfile *of;
-  void *kbuf;
+  int result;
 
-  if (fd < 0 || fd > OPEN_MAX)
-    return -1;
-  {
-    of = curproc->fileTable[fd].of;
-    offset = curproc->fileTable[fd].offset;
-  }
+  of = fd_to_openfile(fd);
   if (of == NULL)
-    return -1;
-  vn = of->vn;
-  if (vn == NULL)
-    return -1;
+    return EBADF;
 
-  kbuf = kmalloc(size);
-  copyin(buf_ptr, kbuf, size);
-  uio_kinit(&iov, &ku, kbuf, size, offset, UIO_WRITE);
-  result = VOP_WRITE(vn, &ku);
+  file_uinit(&iov, &u, buf_ptr, size, rw);
+  result = openfile_pio(of, &u, pos);
   if (result)
-  {
-    lock_release(TabFile.lk);
     return result;
-  }
-  kfree(kbuf);
-  curproc->fileTable[fd].offset = ku.uio_offset;
-  nwrite = size - ku.uio_resid;
-  lock_release(TabFile.lk);
-  return (nwrite);
+  *retval = size - u.uio_resid;
+  return 0;
+}
+
+int sys_pread(int fd, userptr_t buf_ptr, size_t size, off_t pos,
+              int32_t *retval)
+{
+  return file_prw(fd, buf_ptr, size, pos, UIO_READ, retval);
+}
+
+int sys_pwrite(int fd, userptr_t buf_ptr, size_t size, off_t pos,
+               int32_t *retval)
+{
+  return file_prw(fd, buf_ptr, size, pos, UIO_WRITE, retval);
+}
+
+int sys_readv(int fd, userptr_t iov_ptr, int iovcnt, int32_t *retval)
+{
+  return file_rwv(fd, iov_ptr, iovcnt, UIO_READ, NULL, retval);
+}
+
+int sys_writev(int fd, userptr_t iov_ptr, int iovcnt, int32_t *retval)
+{
+  return file_rwv(fd, iov_ptr, iovcnt, UIO_WRITE, NULL, retval);
+}
+
+int sys_preadv(int fd, userptr_t iov_ptr, int iovcnt, off_t pos,
+               int32_t *retval)
+{
+  return file_rwv(fd, iov_ptr, iovcnt, UIO_READ, &pos, retval);
+}
+
+int sys_pwritev(int fd, userptr_t iov_ptr, int iovcnt, off_t pos,
+                int32_t *retval)
+{
+  return file_rwv(fd, iov_ptr, iovcnt, UIO_WRITE, &pos, retval);
 }
 
 int sys__getcwd(char *buf, size_t buflen)
@@ -158,94 +347,82 @@ int sys__getcwd(char *buf, size_t buflen)
 
 int sys_open(userptr_t path, int openflags, mode_t mode, int *errp)
 {
-  lock_acquire(TabFile.lk);
-
-  int fd, i, offset;
+  int fd;
   struct vnode *v;
   struct openfile *of = NULL;
+  struct lock *lk;
   int result;
 
   result = vfs_open((char *)path, openflags, mode, &v);
   if (result)
   {
     *errp = ENOENT;
-    lock_release(TabFile.lk);
     return -1;
   }
-  /* search system open file table */
-  for (i = 0; i < SYSTEM_OPEN_MAX; i++)
+  /* created here, outside TabFile.lk: lock_create may sleep */
+  lk = lock_create("openfile");
+  if (lk == NULL)
   {
-
-    if (TabFile.systemFileTable[i].vn != NULL && TabFile.systemFileTable[i].vn == v)
-    {
-      of = &TabFile.systemFileTable[i];
-      TabFile.systemFileTable[i].countRef++;
-      if (openflags & O_APPEND)
-      {
-        for (fd = STDERR_FILENO + 1; fd < OPEN_MAX; fd++)
-        {
-          if (curproc->fileTable[fd].of == of)
-          {
-            offset = curproc->fileTable[fd].offset;
-          }
-        }
-      }
-      else
-      {
-        offset = 0;
-      }
-      break;
-    }
+    vfs_close(v);
+    *errp = ENOMEM;
+    return -1;
   }
-  if (of == NULL)
+
+  /* every open gets its own entry, and so its own offset */
+  lock_acquire(TabFile.lk);
+  of = TabFile.freeList;
+  if (of != NULL)
   {
-    for (i = 0; i < SYSTEM_OPEN_MAX; i++)
-    {
-      if (TabFile.systemFileTable[i].vn == NULL)
-      {
-        of = &TabFile.systemFileTable[i];
-        of->vn = v;
-        of->countRef = 1; // ref;
-        break;
-      }
-    }
+    KASSERT(of->vn == NULL);
+    TabFile.freeList = of->nextFree;
+    of->nextFree = NULL;
+    of->vn = v;
+    of->offset = 0;
+    of->openflags = openflags;
+    of->countRef = 1;
+    of->lk = lk;
   }
+  lock_release(TabFile.lk);
 
   if (of == NULL)
   {
     // no free slot in system open file table
     *errp = ENFILE;
+    lock_destroy(lk);
+    vfs_close(v);
+    return -1;
   }
-  else
+
+  for (fd = STDERR_FILENO + 1; fd < OPEN_MAX; fd++)
   {
-    for (fd = STDERR_FILENO + 1; fd < OPEN_MAX; fd++)
+    if (curproc->fileTable[fd].fd == -1)
     {
-      if (curproc->fileTable[fd].fd == -1)
-      {
-
-        curproc->fileTable[fd].of = of;
-        curproc->fileTable[fd].offset = offset; //offset;// caso append
-        curproc->fileTable[fd].flags = openflags;
-        curproc->fileTable[fd].fd = fd;
-        lock_release(TabFile.lk);
-        return fd;
-      }
+      curproc->fileTable[fd].of = of;
+      curproc->fileTable[fd].flags = openflags;
+      curproc->fileTable[fd].fd = fd;
+      return fd;
     }
-    // no free slot in process open file table
-    *errp = EMFILE;
   }
-
-  vfs_close(v);
-  lock_release(TabFile.lk);
+  // no free slot in process open file table
+  *errp = EMFILE;
+  openfileDecrRefCount(of);
   return -1;
 }
 
 int 
 sys_dup2(int oldfd, int newfd)
 {
+  struct openfile *of;
+
+  of = fd_to_openfile(oldfd);
+  if (of == NULL || newfd < 0 || newfd >= OPEN_MAX)
+    return EBADF;
+  if (oldfd == newfd)
+    return 0;
   sys_close(newfd);
-  openfileIncrRefCount(curproc->fileTable[oldfd].of);
+  openfileIncrRefCount(of);
   curproc->fileTable[newfd] = curproc->fileTable[oldfd];
+  curproc->fileTable[newfd].fd = newfd;
   /*cosa ritora questa funzione?*/
   return 0;
 }
@@ -253,68 +430,81 @@ sys_dup2(int oldfd, int newfd)
 int 
 sys_close(int fd)
 {
-  lock_acquire(TabFile.lk);
-
-  struct openfile *of = NULL;
-  struct vnode *vn;
+  struct openfile *of;
 
-  if (fd < 0 || fd > OPEN_MAX)
-    return -1;
-  of = curproc->fileTable[fd].of;
-  /*curproc->fileTable.fd?*/
-  if (of == NULL || curproc->fileTable[fd].fd == -1)
+  of = fd_to_openfile(fd);
+  if (of == NULL)
     return -1;
   curproc->fileTable[fd].of = NULL;
   curproc->fileTable[fd].fd = -1;
 
   openfileDecrRefCount(of);
-  if (of->countRef > 0)
-    return 0; // just decrement ref cnt
-
-  vn = of->vn;
-  of->vn = NULL;
-  if (vn == NULL)
-    return -1;
-
-  vfs_close(vn);
-  lock_release(TabFile.lk);
   return 0;
 }
 
+/*
+ * Move the offset of FD and hand back the new one in *RETVAL. The
+ * console descriptors have no openfile and can't seek.
+ */
 int 
-sys_lseek(int fd, off_t offset, int start)
+sys_lseek(int fd, off_t offset, int whence, off_t *retval)
 {
-  struct stat *stats = NULL;
-  if (start & SEEK_SET)
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int result = 0;
+
+  of = fd_to_openfile(fd);
+  if (of == NULL)
   {
-    curproc->fileTable[fd].offset = offset;
-    return 0;
+    if (fd == STDIN_FILENO || fd == STDOUT_FILENO || fd == STDERR_FILENO)
+      return ESPIPE;
+    return EBADF;
   }
-  if (start & SEEK_CUR)
+  if (!VOP_ISSEEKABLE(of->vn))
+    return ESPIPE;
+
+  /* the offset is shared with dup'ed and forked descriptors */
+  lock_acquire(of->lk);
+  switch (whence)
   {
-    curproc->fileTable[fd].offset += offset;
-    return 0;
+  case SEEK_SET:
+    newpos = offset;
+    break;
+  case SEEK_CUR:
+    newpos = of->offset + offset;
+    break;
+  case SEEK_END:
+    result = VOP_STAT(of->vn, &st);
+    newpos = st.st_size + offset;
+    break;
+  default:
+    newpos = 0;
+    result = EINVAL;
+    break;
   }
-  if (start & SEEK_END)
+  if (result == 0 && newpos < 0)
+    result = EINVAL;
+  if (result == 0)
   {
-    VOP_STAT(curproc->fileTable[fd].of->vn, stats);
-    curproc->fileTable[fd].offset = stats->st_size + offset;
-    return 0;
+    of->offset = newpos;
+    *retval = newpos;
   }
-  return -1;
+  lock_release(of->lk);
+  return result;
 }
 
 /*
  * simple file system calls for write/read
  */
-int sys_write(int fd, userptr_t buf_ptr, size_t size)
+int sys_write(int fd, userptr_t buf_ptr, size_t size, int32_t *retval)
 {
   int i;
   char *p = (char *)buf_ptr;
 
   if (fd != STDOUT_FILENO && fd != STDERR_FILENO)
   {
-    return file_write(fd, buf_ptr, size);
+    return file_rw(fd, buf_ptr, size, UIO_WRITE, retval);
   }
 
   for (i = 0; i < (int)size; i++)
@@ -322,27 +512,29 @@ int sys_write(int fd, userptr_t buf_ptr, size_t size)
     putch(p[i]);
   }
 
-  return (int)size;
+  *retval = size;
+  return 0;
 }
 
-int sys_read(int fd, userptr_t buf_ptr, size_t size)
+int sys_read(int fd, userptr_t buf_ptr, size_t size, int32_t *retval)
 {
   int i;
   char *p = (char *)buf_ptr;
 
   if (fd != STDIN_FILENO)
   {
-    return file_read(fd, buf_ptr, size);
+    return file_rw(fd, buf_ptr, size, UIO_READ, retval);
   }
 
   for (i = 0; i < (int)size; i++)
   {
     p[i] = getch();
     if (p[i] < 0)
-      return i;
+      break;
   }
 
-  return (int)size;
+  *retval = i;
+  return 0;
 }
 
 int sys_remove(userptr_t pathname, int32_t *retval)
@@ -59,6 +59,9 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <kern/stat.h>
+#include "opt-dumbvm.h"
+#include "opt-shell.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -90,6 +93,32 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
+#if OPT_DUMBVM && OPT_SHELL
+	/*
+	 * Demand paging: just tell the VM where the segment lives in
+	 * the file. Check now that it is all there, since a truncated
+	 * executable would otherwise only be noticed at the first
+	 * fault on the missing part.
+	 */
+	{
+		struct stat st;
+
+		(void)is_executable;
+		result = VOP_STAT(v, &st);
+		if (result) {
+			return result;
+		}
+		if (offset < 0 || offset + (off_t)filesize > st.st_size) {
+			kprintf("ELF: segment past end of file - "
+				"file truncated?\n");
+			return ENOEXEC;
+		}
+		DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+		      (unsigned long) filesize, (unsigned long) vaddr);
+		return as_define_file(as, v, offset, vaddr, filesize);
+	}
+#endif
+
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -0,0 +1,159 @@
+/*
+ * ctxswtest - TLB cost of context switches
+ *
+ * Runs NPROCS processes that each touch NPAGES pages of their own
+ * address space and then yield, over and over, and reports how many
+ * TLB faults each context switch costs. This is done once with TLB
+ * address space IDs turned off, so that as_activate flushes the TLB on
+ * every switch, and once with them on, where a small set of processes
+ * should keep their translations across switches.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <thread.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <syscall.h>
+#include <test.h>
+
+#define CTX_DATA      0x10000000
+#define CTX_ROUNDS    200
+#define CTX_MAXPROCS  16
+#define CTX_MAXPAGES  64
+
+static
+unsigned long
+ctx_tlbfaults(void)
+{
+	unsigned long faults = 0;
+	unsigned i;
+
+	for (i=0; i<cpu_count(); i++) {
+		faults += cpu_get(i)->c_tlb_faults;
+	}
+	return faults;
+}
+
+/*
+ * Body of one test process: build a small address space, then touch
+ * every page and yield, CTX_ROUNDS times.
+ */
+static
+void
+ctx_thread(void *junk, unsigned long npages)
+{
+	struct addrspace *as;
+	vaddr_t stackptr;
+	unsigned i, r;
+	char c = 0;
+	int err;
+
+	(void)junk;
+
+	as = as_create();
+	if (as == NULL) {
+		sys__exit(1);
+	}
+	proc_setas(as);
+	as_activate();
+	err = as_define_region(as, CTX_DATA, npages * PAGE_SIZE, 1, 1, 0);
+	if (!err) {
+		err = as_define_stack(as, &stackptr);
+	}
+
+	for (r=0; r<CTX_ROUNDS && !err; r++) {
+		for (i=0; i<npages && !err; i++) {
+			err = copyout(&c,
+				      (userptr_t)(CTX_DATA + i * PAGE_SIZE), 1);
+		}
+		thread_yield();
+	}
+	if (err) {
+		kprintf("ctx: %s\n", strerror(err));
+	}
+	sys__exit(err ? 1 : 0);
+}
+
+/*
+ * Run one round and print the TLB faults per switch; returns nonzero
+ * if a process failed.
+ */
+static
+int
+ctx_round(int nprocs, unsigned long npages, bool asids)
+{
+	struct proc *procs[CTX_MAXPROCS];
+	unsigned long before, faults, switches;
+	bool old;
+	int i, err, failed = 0;
+
+	old = vm_setasids(asids);
+	before = ctx_tlbfaults();
+
+	for (i=0; i<nprocs; i++) {
+		procs[i] = proc_create_runprogram("ctxswtest");
+		if (procs[i] == NULL) {
+			panic("ctx: proc_create_runprogram failed\n");
+		}
+		err = thread_fork("ctxswtest", procs[i], ctx_thread,
+				  NULL, npages);
+		if (err) {
+			panic("ctx: thread_fork failed: %s\n", strerror(err));
+		}
+	}
+	for (i=0; i<nprocs; i++) {
+		if (proc_wait(procs[i])) {
+			failed = 1;
+		}
+	}
+
+	faults = ctx_tlbfaults() - before;
+	vm_setasids(old);
+
+	switches = (unsigned long)nprocs * CTX_ROUNDS;
+	kprintf("ctx: ASIDs %-3s: %lu TLB faults, %lu.%02lu per switch\n",
+		asids ? "on" : "off", faults, faults / switches,
+		(faults * 100 / switches) % 100);
+	return failed;
+}
+
+int
+ctxswtest(int nargs, char **args)
+{
+	int nprocs = 4;
+	unsigned long npages = 8;
+
+	if (nargs > 3) {
+		kprintf("Usage: ctx [nprocs] [npages]\n");
+		return EINVAL;
+	}
+	if (nargs > 1) {
+		nprocs = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		npages = atoi(args[2]);
+	}
+	if (nprocs < 1 || nprocs > CTX_MAXPROCS ||
+	    npages < 1 || npages > CTX_MAXPAGES) {
+		kprintf("ctx: 1-%d processes of 1-%d pages\n",
+			CTX_MAXPROCS, CTX_MAXPAGES);
+		return EINVAL;
+	}
+
+	kprintf("*** Starting context switch TLB test: "
+		"%d processes, %lu pages each\n", nprocs, npages);
+
+	if (ctx_round(nprocs, npages, false) ||
+	    ctx_round(nprocs, npages, true)) {
+		kprintf("*** Test failed\n");
+		return EIO;
+	}
+
+	kprintf("*** Context switch TLB test done\n");
+	return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * disktest - raw disk throughput
+ *
+ * Reads sectors straight from a disk device (its "raw" name, so that
+ * nothing is written and a mounted file system isn't disturbed) and
+ * prints sectors per second for:
+ *
+ *    - sequential reads of one sector at a time;
+ *    - sequential reads of DT_RUN sectors, in one buffer;
+ *    - sequential reads of DT_RUN sectors, one iovec per sector, as
+ *      the buffer cache does its clustered transfers;
+ *    - reads of one sector at random places;
+ *    - reads of DT_RUN sectors at random places.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define DT_SECTSIZE  512
+#define DT_RUN       8		/* sectors per multi-sector read */
+#define DT_DEFSECT   2048	/* sectors read in each pattern */
+
+/*
+ * Read NSECT sectors from SECTOR on into BUF, as NIOV equal pieces.
+ */
+static
+int
+dt_read(struct vnode *vn, uint32_t sector, unsigned nsect, unsigned niov,
+	char *buf)
+{
+	struct iovec iov[DT_RUN];
+	struct uio ku;
+	unsigned i;
+	int err;
+
+	KASSERT(niov >= 1 && niov <= DT_RUN && nsect % niov == 0);
+
+	for (i=0; i<niov; i++) {
+		iov[i].iov_kbase = buf + i * (nsect / niov) * DT_SECTSIZE;
+		iov[i].iov_len = (nsect / niov) * DT_SECTSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = niov;
+	ku.uio_offset = (off_t)sector * DT_SECTSIZE;
+	ku.uio_resid = nsect * DT_SECTSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+
+	err = VOP_READ(vn, &ku);
+	if (err) {
+		return err;
+	}
+	return ku.uio_resid > 0 ? EIO : 0;
+}
+
+/*
+ * Read TOTAL sectors, RUN at a time in NIOV pieces, either in order
+ * from the start of the disk or at random places on it. Prints and
+ * returns the sectors per second.
+ */
+static
+unsigned long
+dt_pass(struct vnode *vn, uint32_t disksect, unsigned total, unsigned run,
+	unsigned niov, bool rand, char *buf, const char *what)
+{
+	struct timespec before, after, duration;
+	uint64_t ns;
+	uint32_t sector;
+	unsigned done;
+	unsigned long rate;
+	int err = 0;
+
+	gettime(&before);
+	for (done = 0; done < total && !err; done += run) {
+		if (rand) {
+			sector = random() % (disksect - run + 1);
+		}
+		else {
+			sector = done % (disksect - run + 1);
+		}
+		err = dt_read(vn, sector, run, niov, buf);
+	}
+	gettime(&after);
+	if (err) {
+		kprintf("dk: %s: %s\n", what, strerror(err));
+		return 0;
+	}
+
+	timespec_sub(&after, &before, &duration);
+	ns = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	rate = ns ? (unsigned long)((uint64_t)total * 1000000000 / ns) : 0;
+	kprintf("dk: %-28s %8lu sectors/sec\n", what, rate);
+	return rate;
+}
+
+int
+disktest(int nargs, char **args)
+{
+	char name[32];
+	struct vnode *vn;
+	struct stat st;
+	uint32_t disksect;
+	unsigned total = DT_DEFSECT;
+	char *buf;
+	int err;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: dk disk [nsectors]\n");
+		return EINVAL;
+	}
+	if (nargs == 3) {
+		total = atoi(args[2]);
+	}
+	total -= total % DT_RUN;
+	if (total == 0) {
+		kprintf("dk: nsectors must be at least %d\n", DT_RUN);
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colon after device name */
+	snprintf(name, sizeof(name), "%s", args[1]);
+	if (name[strlen(name)-1] == ':') {
+		name[strlen(name)-1] = 0;
+	}
+	if (strlen(name) + 5 > sizeof(name)) {
+		return ENAMETOOLONG;
+	}
+	strcat(name, "raw:");
+
+	err = vfs_open(name, O_RDONLY, 0, &vn);
+	if (err) {
+		kprintf("dk: %s: %s\n", name, strerror(err));
+		return err;
+	}
+	err = VOP_STAT(vn, &st);
+	if (err || st.st_blksize != DT_SECTSIZE || st.st_blocks < DT_RUN) {
+		kprintf("dk: %s: not a disk with %d-byte sectors\n",
+			name, DT_SECTSIZE);
+		vfs_close(vn);
+		return err ? err : EINVAL;
+	}
+	disksect = st.st_blocks;
+
+	buf = kmalloc(DT_RUN * DT_SECTSIZE);
+	if (buf == NULL) {
+		vfs_close(vn);
+		return ENOMEM;
+	}
+
+	kprintf("*** Starting disk throughput test on %s (%u sectors)\n",
+		name, total);
+
+	if (dt_pass(vn, disksect, total, 1, 1, false, buf,
+		    "sequential, 1 sector") == 0 ||
+	    dt_pass(vn, disksect, total, DT_RUN, 1, false, buf,
+		    "sequential, 8 sectors") == 0 ||
+	    dt_pass(vn, disksect, total, DT_RUN, DT_RUN, false, buf,
+		    "sequential, 8 sectors/8 iov") == 0 ||
+	    dt_pass(vn, disksect, total, 1, 1, true, buf,
+		    "random, 1 sector") == 0 ||
+	    dt_pass(vn, disksect, total, DT_RUN, 1, true, buf,
+		    "random, 8 sectors") == 0) {
+		err = EIO;
+	}
+
+	kfree(buf);
+	vfs_close(vn);
+
+	if (err) {
+		kprintf("*** Test failed\n");
+		return err;
+	}
+	kprintf("*** Disk throughput test done\n");
+	return 0;
+}
@@ -0,0 +1,1217 @@
+/*
+ * fileiotest - throughput of the file syscall layer under concurrency
+ *
+ * Runs 1, 2, 4, ... processes at once, each writing and then reading
+ * back its own file through the system open file table (sys_open,
+ * openfile_io, sys_close), and prints the aggregate throughput of each
+ * round against the single-process one. With the I/O serialized only
+ * by the per-openfile locks, the rounds should scale with the number
+ * of CPUs until the file system underneath becomes the bottleneck;
+ * a round that gets less than half of that fails.
+ *
+ * fileiotest2 compares, for 4 KB, 64 KB and 1 MB transfers, the read
+ * and write bandwidth of a bounce-buffered transfer (copyin/copyout
+ * through a kmalloc'd copy, as file_read/file_write used to) with
+ * sys_read/sys_write, which move the data straight between the file
+ * and the user buffer. It runs in a process of its own whose buffer
+ * is in a user address space. At the end, the file is read back both
+ * ways and checked.
+ *
+ * fileiotest3 is fileiotest with small writes that never cover a
+ * whole block, so every one of them is a read-modify-write of a
+ * partial block in the file system. Each process reads its file back
+ * and checks it.
+ *
+ * fileiotest4 reads a file of a few megabytes, much bigger than the
+ * buffer cache, from start to end with the buffer cache's read-ahead
+ * off and then on, and prints the bandwidth of each. The data read
+ * is checked, and read-ahead must have been hit.
+ *
+ * fileiotest5 creates a few thousand empty files in one directory,
+ * looks each of them up, and removes them, timing each phase; all of
+ * these are name searches of an ever larger directory. Each lookup
+ * must find the inode created under that name, and names that don't
+ * exist must not be found.
+ *
+ * fileiotest6 creates some files and keeps them all open, so that
+ * their vnodes stay loaded, then opens and closes each of them by
+ * name a number of times over; every open looks the inode up in the
+ * file system's table of loaded vnodes, and must find the vnode that
+ * is already open.
+ *
+ * fileiotest7 runs 1, 8 and 32 processes at once, each appending a
+ * few bytes to its own file and fsyncing it, over and over, and
+ * prints the fsyncs per second of each round. fsyncs that arrive
+ * together are committed together, so the rate should go up with the
+ * number of processes rather than stay flat. On a journaled volume,
+ * rounds of more than one process must take fewer commits than they
+ * do fsyncs.
+ *
+ * fio_args checks the arguments of all of them, and fio_rounds runs
+ * the rounds of fileiotest, fileiotest3 and fileiotest7.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <buf.h>
+#include <sfs.h>
+#include <syscall.h>
+#include <test.h>
+#include "opt-sfs.h"
+
+#define FIO_FILENAME  "fiotest.tmp"
+#define FIO_CHUNK     512
+#define FIO_NCHUNKS   128
+#define FIO_MAXPROCS  32
+
+static const int fio_nprocs[] = { 1, 2, 4, 8, 16, 32 };
+
+/*
+ * Check the arguments of a test command: a filesystem and, if ARGNAME
+ * isn't NULL, optionally a number from MIN to MAX, which goes in *NUM
+ * (holding the default otherwise). The filesystem name is handed back
+ * in *DEVICE.
+ */
+static
+int
+fio_args(int nargs, char **args, const char *argname, int min, int max,
+	 int *num, char **device)
+{
+	char *dev;
+	size_t len;
+
+	if (nargs != 2 && (nargs != 3 || argname == NULL)) {
+		if (argname == NULL) {
+			kprintf("Usage: %s filesystem:\n", args[0]);
+		}
+		else {
+			kprintf("Usage: %s filesystem: [%s]\n",
+				args[0], argname);
+		}
+		return EINVAL;
+	}
+	if (nargs == 3) {
+		*num = atoi(args[2]);
+		if (*num < min || *num > max) {
+			kprintf("%s: %s must be between %d and %d\n",
+				args[0], argname, min, max);
+			return EINVAL;
+		}
+	}
+
+	dev = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	len = strlen(dev);
+	if (len > 0 && dev[len-1]==':') {
+		dev[len-1] = 0;
+	}
+
+	*device = dev;
+	return 0;
+}
+
+static
+void
+fio_makename(char *buf, size_t buflen, const char *fs, unsigned long num)
+{
+	snprintf(buf, buflen, "%s:%s%lu", fs, FIO_FILENAME, num);
+	KASSERT(strlen(buf) < buflen);
+}
+
+/*
+ * Whether all LEN bytes of BUF are C.
+ */
+static
+bool
+fio_filled(const char *buf, size_t len, char c)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (buf[i] != c) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Move SIZE bytes between the kernel buffer BUF and the file open as
+ * OF, at its current offset.
+ */
+static
+int
+fio_chunk(struct openfile *of, char *buf, size_t size, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int err;
+
+	uio_kinit(&iov, &ku, buf, size, 0, rw);
+	err = openfile_io(of, &ku);
+	if (err) {
+		return err;
+	}
+	return ku.uio_resid > 0 ? EIO : 0;
+}
+
+/*
+ * Body of one test process. Exits through sys__exit so the menu
+ * thread can collect it with proc_wait.
+ */
+static
+void
+fio_thread(void *fs, unsigned long num)
+{
+	char name[32];
+	char buf[FIO_CHUNK];
+	struct openfile *of;
+	off_t pos;
+	int fd, err, i;
+
+	fio_makename(name, sizeof(name), fs, num);
+	fd = sys_open((userptr_t)name, O_RDWR|O_CREAT|O_TRUNC, 0664, &err);
+	if (fd < 0) {
+		kprintf("fio: process %lu: open: %s\n", num, strerror(err));
+		sys__exit(1);
+	}
+	of = curproc->fileTable[fd].of;
+
+	err = 0;
+	for (i=0; i<FIO_NCHUNKS && !err; i++) {
+		memset(buf, 'a' + (num + i) % 26, sizeof(buf));
+		err = fio_chunk(of, buf, FIO_CHUNK, UIO_WRITE);
+	}
+	if (!err) {
+		err = sys_lseek(fd, 0, SEEK_SET, &pos);
+	}
+	for (i=0; i<FIO_NCHUNKS && !err; i++) {
+		err = fio_chunk(of, buf, FIO_CHUNK, UIO_READ);
+		if (!err &&
+		    !fio_filled(buf, FIO_CHUNK, 'a' + (num + i) % 26)) {
+			kprintf("fio: process %lu: chunk %d mismatched\n",
+				num, i);
+			err = EIO;
+		}
+	}
+	if (err) {
+		kprintf("fio: process %lu: %s\n", num, strerror(err));
+	}
+
+	sys_close(fd);
+	sys__exit(err ? 1 : 0);
+}
+
+/*
+ * Run one round with NPROCS processes running FUNC, each doing COUNT
+ * of something (bytes, say); returns how many UNITs of it all of them
+ * did per second, or 0 on failure.
+ */
+static
+unsigned long
+fio_round(const char *fs, int nprocs,
+	  void (*func)(void *, unsigned long), uint64_t count, unsigned unit)
+{
+	struct proc *procs[FIO_MAXPROCS];
+	struct timespec before, after, duration;
+	char name[32];
+	uint64_t ns;
+	int i, err, failed = 0;
+
+	gettime(&before);
+
+	for (i=0; i<nprocs; i++) {
+		procs[i] = proc_create_runprogram("fiotest");
+		if (procs[i] == NULL) {
+			panic("fio: proc_create_runprogram failed\n");
+		}
+		err = thread_fork("fiotest", procs[i], func,
+				  (char *)fs, i);
+		if (err) {
+			panic("fio: thread_fork failed: %s\n", strerror(err));
+		}
+	}
+	for (i=0; i<nprocs; i++) {
+		if (proc_wait(procs[i])) {
+			failed = 1;
+		}
+	}
+
+	gettime(&after);
+	timespec_sub(&after, &before, &duration);
+
+	for (i=0; i<nprocs; i++) {
+		fio_makename(name, sizeof(name), fs, i);
+		vfs_remove(name);
+	}
+	if (failed) {
+		return 0;
+	}
+
+	count *= nprocs;
+	ns = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	return (unsigned long)(count * 1000000000 / unit / ns);
+}
+
+/*
+ * A test run as rounds of processes at once (fio_rounds). Each
+ * process runs FUNC, doing COUNT of something; the rate of a round is
+ * printed in UNITs of it per second, under the name UNITNAME. CHECK,
+ * if not NULL, says whether a round of NPROCS processes went well,
+ * given its rate and the first round's.
+ */
+struct fio_test {
+	const char *cmd;
+	void (*func)(void *, unsigned long);
+	uint64_t count;
+	unsigned unit;
+	const char *unitname;
+	bool (*check)(int nprocs, unsigned long rate, unsigned long base);
+};
+
+/*
+ * Run FT on FS in rounds of NPROCS[0], NPROCS[1], ... processes, for
+ * the first N of them or as many as are no more than MAXPROCS. Prints
+ * the rate of each and its speedup over the first.
+ */
+static
+int
+fio_rounds(const char *fs, const struct fio_test *ft,
+	   const int *nprocs, unsigned n, int maxprocs)
+{
+	unsigned long rate, base = 0;
+	unsigned i;
+
+	for (i=0; i<n && nprocs[i] <= maxprocs; i++) {
+		KASSERT(nprocs[i] <= FIO_MAXPROCS);
+		rate = fio_round(fs, nprocs[i], ft->func, ft->count,
+				 ft->unit);
+		if (rate == 0) {
+			return EIO;
+		}
+		if (base == 0) {
+			base = rate;
+		}
+		kprintf("%s: %2d processes: %6lu %s, speedup %lu.%02lu\n",
+			ft->cmd, nprocs[i], rate, ft->unitname,
+			rate / base, (rate * 100 / base) % 100);
+		if (ft->check != NULL && !ft->check(nprocs[i], rate, base)) {
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Up to the number of CPUs, the rate should go up about as much as
+ * the number of processes; fail a round that doesn't get half of
+ * that.
+ */
+static
+bool
+fio_check(int nprocs, unsigned long rate, unsigned long base)
+{
+	unsigned long expect;
+
+	expect = (unsigned)nprocs < cpu_count() ? nprocs : cpu_count();
+	if (rate * 2 < base * expect) {
+		kprintf("fio: %d processes on %u CPUs should have had a "
+			"speedup of about %lu\n", nprocs, cpu_count(), expect);
+		return false;
+	}
+	return true;
+}
+
+static const struct fio_test fio_test = {
+	"fio", fio_thread, 2 * FIO_NCHUNKS * FIO_CHUNK, 1024, "KB/s",
+	fio_check,
+};
+
+int
+fileiotest(int nargs, char **args)
+{
+	char *device;
+	int maxprocs = 4;
+
+	if (fio_args(nargs, args, "maxprocs", 1, FIO_MAXPROCS, &maxprocs,
+		     &device)) {
+		return EINVAL;
+	}
+
+	kprintf("*** Starting file I/O scaling test on %s:\n", device);
+
+	if (fio_rounds(device, &fio_test, fio_nprocs,
+		       ARRAYCOUNT(fio_nprocs), maxprocs)) {
+		kprintf("*** Test failed\n");
+		return EIO;
+	}
+
+	kprintf("*** File I/O scaling test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+#define FIOB_FILENAME "fiotest2.tmp"
+#define FIOB_TOTAL    (1024*1024)
+#define FIOB_MAXSIZE  (1024*1024)
+#define FIOB_UBUF     0x10000000	/* user buffer in the test process */
+#define FIOB_PERIOD   4096	/* the smallest transfer */
+
+static const size_t fiob_sizes[] = { 4*1024, 64*1024, 1024*1024 };
+
+/*
+ * One transfer of SIZE bytes between the file open on FD and the user
+ * buffer: either through a kmalloc'd kernel copy, moved with copyin
+ * or copyout as file_read/file_write used to do, or straight through
+ * sys_read/sys_write.
+ */
+static
+int
+fiob_xfer(int fd, size_t size, enum uio_rw rw, bool bounce)
+{
+	struct openfile *of = curproc->fileTable[fd].of;
+	userptr_t ubuf = (userptr_t)FIOB_UBUF;
+	struct iovec iov;
+	struct uio ku;
+	char *kbuf;
+	int32_t n;
+	int err;
+
+	if (!bounce) {
+		if (rw == UIO_WRITE) {
+			err = sys_write(fd, ubuf, size, &n);
+		}
+		else {
+			err = sys_read(fd, ubuf, size, &n);
+		}
+		if (err) {
+			return err;
+		}
+		return n == (int32_t)size ? 0 : EIO;
+	}
+
+	kbuf = kmalloc(size);
+	if (kbuf == NULL) {
+		return ENOMEM;
+	}
+	err = 0;
+	if (rw == UIO_WRITE) {
+		err = copyin(ubuf, kbuf, size);
+	}
+	if (!err) {
+		uio_kinit(&iov, &ku, kbuf, size, 0, rw);
+		err = openfile_io(of, &ku);
+	}
+	if (!err && ku.uio_resid > 0) {
+		err = EIO;
+	}
+	if (!err && rw == UIO_READ) {
+		err = copyout(kbuf, ubuf, size);
+	}
+	kfree(kbuf);
+	return err;
+}
+
+/*
+ * Move FIOB_TOTAL bytes through the file in SIZE-byte transfers and
+ * return the bandwidth in KB/s, or 0 on error.
+ */
+static
+unsigned long
+fiob_pass(int fd, size_t size, enum uio_rw rw, bool bounce)
+{
+	struct timespec before, after, duration;
+	uint64_t ns;
+	off_t pos;
+	unsigned i;
+	int err;
+
+	err = sys_lseek(fd, 0, SEEK_SET, &pos);
+	gettime(&before);
+	for (i=0; i < FIOB_TOTAL / size && !err; i++) {
+		err = fiob_xfer(fd, size, rw, bounce);
+	}
+	gettime(&after);
+	if (err) {
+		kprintf("fio2: %s\n", strerror(err));
+		return 0;
+	}
+	timespec_sub(&after, &before, &duration);
+	ns = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	return (unsigned long)((uint64_t)FIOB_TOTAL * 1000000000 / 1024 / ns);
+}
+
+/*
+ * Copy the FIOB_PERIOD bytes at PAT to every FIOB_PERIOD bytes of the
+ * user buffer or, if CHECK is set, check that they are there.
+ */
+static
+int
+fiob_ubuf(const char *pat, bool check)
+{
+	char *kbuf;
+	userptr_t ubuf;
+	unsigned i, j;
+	int err = 0;
+
+	kbuf = kmalloc(FIOB_PERIOD);
+	if (kbuf == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i < FIOB_MAXSIZE / FIOB_PERIOD && !err; i++) {
+		ubuf = (userptr_t)(FIOB_UBUF + i * FIOB_PERIOD);
+		if (!check) {
+			err = copyout(pat, ubuf, FIOB_PERIOD);
+			continue;
+		}
+		err = copyin(ubuf, kbuf, FIOB_PERIOD);
+		for (j=0; j<FIOB_PERIOD && !err; j++) {
+			if (kbuf[j] != pat[j]) {
+				kprintf("fio2: wrong data at offset %u\n",
+					i * FIOB_PERIOD + j);
+				err = EIO;
+			}
+		}
+	}
+	kfree(kbuf);
+	return err;
+}
+
+/*
+ * Read the whole file back into the emptied user buffer, one way and
+ * then the other, and check that it holds PAT over and over. Every
+ * pass moves the start of the user buffer to or from each stretch of
+ * the file, so with PAT in the buffer to begin with, that's what the
+ * file ends up holding.
+ */
+static
+int
+fiob_verify(int fd, const char *pat, const char *zeros)
+{
+	off_t pos;
+	int err = 0, bounce;
+
+	for (bounce=0; bounce<2 && !err; bounce++) {
+		err = fiob_ubuf(zeros, false);
+		if (!err) {
+			err = sys_lseek(fd, 0, SEEK_SET, &pos);
+		}
+		if (!err) {
+			err = fiob_xfer(fd, FIOB_MAXSIZE, UIO_READ, bounce);
+		}
+		if (!err) {
+			err = fiob_ubuf(pat, true);
+		}
+	}
+	return err;
+}
+
+static
+void
+fiob_print(const char *what, unsigned long kbps)
+{
+	kprintf(" %s %4lu.%02lu MB/s", what, kbps / 1024,
+		(kbps % 1024) * 100 / 1024);
+}
+
+/*
+ * Body of the test process. It gets an address space holding just the
+ * user buffer, so that the transfers cross the user/kernel boundary
+ * the way a program's reads and writes do.
+ */
+static
+void
+fiob_thread(void *fs, unsigned long unused)
+{
+	char name[32];
+	struct addrspace *as;
+	unsigned long rates[4];
+	char *pat;
+	unsigned i;
+	int fd, err;
+
+	(void)unused;
+
+	COMPILE_ASSERT(FIOB_MAXSIZE % FIOB_PERIOD == 0);
+
+	as = as_create();
+	if (as == NULL) {
+		kprintf("fio2: out of memory\n");
+		sys__exit(1);
+	}
+	err = as_define_region(as, FIOB_UBUF, FIOB_MAXSIZE, 1, 1, 0);
+	if (err) {
+		kprintf("fio2: as_define_region: %s\n", strerror(err));
+		as_destroy(as);
+		sys__exit(1);
+	}
+	proc_setas(as);
+	as_activate();
+
+	snprintf(name, sizeof(name), "%s:%s", (const char *)fs,
+		 FIOB_FILENAME);
+	fd = sys_open((userptr_t)name, O_RDWR|O_CREAT|O_TRUNC, 0664, &err);
+	if (fd < 0) {
+		kprintf("fio2: open: %s\n", strerror(err));
+		sys__exit(1);
+	}
+
+	/* a pattern, followed by zeros to clear the user buffer with */
+	pat = kmalloc(2 * FIOB_PERIOD);
+	if (pat == NULL) {
+		kprintf("fio2: out of memory\n");
+		sys_close(fd);
+		sys__exit(1);
+	}
+	for (i=0; i<FIOB_PERIOD; i++) {
+		pat[i] = 'a' + i % 23;
+	}
+	bzero(pat + FIOB_PERIOD, FIOB_PERIOD);
+
+	/* prime the file so the reads find data */
+	err = fiob_ubuf(pat, false);
+	if (!err) {
+		err = fiob_pass(fd, FIOB_MAXSIZE, UIO_WRITE, false) ? 0 : EIO;
+	}
+
+	for (i=0; i<ARRAYCOUNT(fiob_sizes) && !err; i++) {
+		rates[0] = fiob_pass(fd, fiob_sizes[i], UIO_WRITE, true);
+		rates[1] = fiob_pass(fd, fiob_sizes[i], UIO_WRITE, false);
+		rates[2] = fiob_pass(fd, fiob_sizes[i], UIO_READ, true);
+		rates[3] = fiob_pass(fd, fiob_sizes[i], UIO_READ, false);
+		kprintf("fio2: %4luK:", (unsigned long)fiob_sizes[i] / 1024);
+		fiob_print("write bounce", rates[0]);
+		fiob_print("direct", rates[1]);
+		fiob_print("read bounce", rates[2]);
+		fiob_print("direct", rates[3]);
+		kprintf("\n");
+		if (!rates[0] || !rates[1] || !rates[2] || !rates[3]) {
+			err = EIO;
+		}
+	}
+	if (!err) {
+		err = fiob_verify(fd, pat, pat + FIOB_PERIOD);
+		if (err) {
+			kprintf("fio2: read back: %s\n", strerror(err));
+		}
+	}
+	kfree(pat);
+
+	sys_close(fd);
+	sys__exit(err ? 1 : 0);
+}
+
+int
+fileiotest2(int nargs, char **args)
+{
+	char name[32];
+	char *device;
+	struct proc *proc;
+	int err;
+
+	if (fio_args(nargs, args, NULL, 0, 0, NULL, &device)) {
+		return EINVAL;
+	}
+
+	kprintf("*** Starting bounce vs. direct I/O test on %s:\n", device);
+
+	proc = proc_create_runprogram("fiotest2");
+	if (proc == NULL) {
+		return ENOMEM;
+	}
+	err = thread_fork("fiotest2", proc, fiob_thread, device, 0);
+	if (err) {
+		panic("fio2: thread_fork failed: %s\n", strerror(err));
+	}
+	err = proc_wait(proc);
+
+	snprintf(name, sizeof(name), "%s:%s", device, FIOB_FILENAME);
+	vfs_remove(name);
+
+	if (err) {
+		kprintf("*** Test failed\n");
+		return EIO;
+	}
+	kprintf("*** Bounce vs. direct I/O test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+#define FIOS_SIZE     100	/* never a whole block */
+#define FIOS_NWRITES  512
+
+/*
+ * Body of one small-write process: FIOS_NWRITES sequential writes of
+ * FIOS_SIZE bytes to its own file, which it then reads back.
+ */
+static
+void
+fios_thread(void *fs, unsigned long num)
+{
+	char name[32];
+	char buf[FIOS_SIZE];
+	struct openfile *of;
+	off_t pos;
+	int fd, err, i;
+
+	fio_makename(name, sizeof(name), fs, num);
+	fd = sys_open((userptr_t)name, O_RDWR|O_CREAT|O_TRUNC, 0664, &err);
+	if (fd < 0) {
+		kprintf("fio3: process %lu: open: %s\n", num, strerror(err));
+		sys__exit(1);
+	}
+	of = curproc->fileTable[fd].of;
+
+	memset(buf, 'a' + num % 26, sizeof(buf));
+	err = 0;
+	for (i=0; i<FIOS_NWRITES && !err; i++) {
+		err = fio_chunk(of, buf, FIOS_SIZE, UIO_WRITE);
+	}
+	if (!err) {
+		err = sys_lseek(fd, 0, SEEK_SET, &pos);
+	}
+	for (i=0; i<FIOS_NWRITES && !err; i++) {
+		bzero(buf, sizeof(buf));
+		err = fio_chunk(of, buf, FIOS_SIZE, UIO_READ);
+		if (!err && !fio_filled(buf, FIOS_SIZE, 'a' + num % 26)) {
+			kprintf("fio3: process %lu: write %d mismatched\n",
+				num, i);
+			err = EIO;
+		}
+	}
+	if (err) {
+		kprintf("fio3: process %lu: %s\n", num, strerror(err));
+	}
+
+	sys_close(fd);
+	sys__exit(err ? 1 : 0);
+}
+
+/* (each piece is written and then read) */
+static const struct fio_test fios_test = {
+	"fio3", fios_thread, 2 * FIOS_NWRITES, 1, "I/Os/s", NULL,
+};
+
+int
+fileiotest3(int nargs, char **args)
+{
+	char *device;
+	int maxprocs = 4;
+
+	if (fio_args(nargs, args, "maxprocs", 1, FIO_MAXPROCS, &maxprocs,
+		     &device)) {
+		return EINVAL;
+	}
+
+	kprintf("*** Starting small-write scaling test on %s:\n", device);
+
+	if (fio_rounds(device, &fios_test, fio_nprocs,
+		       ARRAYCOUNT(fio_nprocs), maxprocs)) {
+		kprintf("*** Test failed\n");
+		return EIO;
+	}
+
+	kprintf("*** Small-write scaling test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+#define FIOR_FILENAME "fiotest4.tmp"
+#define FIOR_CHUNK    4096
+#define FIOR_DEFMB    2
+#define FIOR_MAXMB    64
+
+/*
+ * Read the first NBYTES of the file sequentially, checking that it
+ * holds what fileiotest4 wrote, and return the bandwidth in KB/s, or
+ * 0 on error.
+ */
+static
+unsigned long
+fior_pass(int fd, char *buf, size_t nbytes)
+{
+	struct openfile *of = curproc->fileTable[fd].of;
+	struct timespec before, after, duration;
+	uint64_t ns;
+	size_t done;
+	off_t pos;
+	int err;
+
+	err = sys_lseek(fd, 0, SEEK_SET, &pos);
+	gettime(&before);
+	for (done = 0; done < nbytes && !err; done += FIOR_CHUNK) {
+		bzero(buf, FIOR_CHUNK);
+		err = fio_chunk(of, buf, FIOR_CHUNK, UIO_READ);
+		if (!err && !fio_filled(buf, FIOR_CHUNK, 'r')) {
+			kprintf("fio4: wrong data at offset %lu\n",
+				(unsigned long)done);
+			err = EIO;
+		}
+	}
+	gettime(&after);
+	if (err) {
+		kprintf("fio4: read: %s\n", strerror(err));
+		return 0;
+	}
+	timespec_sub(&after, &before, &duration);
+	ns = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	return (unsigned long)((uint64_t)nbytes * 1000000000 / 1024 / ns);
+}
+
+int
+fileiotest4(int nargs, char **args)
+{
+	char name[32];
+	char *device, *buf;
+	unsigned long off, on, hits = 0;
+	size_t nbytes, done;
+	bool wasenabled;
+	int fd, err, mb = FIOR_DEFMB;
+
+	if (fio_args(nargs, args, "megabytes", 1, FIOR_MAXMB, &mb,
+		     &device)) {
+		return EINVAL;
+	}
+	nbytes = (size_t)mb * 1024 * 1024;
+
+	buf = kmalloc(FIOR_CHUNK);
+	if (buf == NULL) {
+		kprintf("fio4: out of memory\n");
+		return ENOMEM;
+	}
+	memset(buf, 'r', FIOR_CHUNK);
+
+	snprintf(name, sizeof(name), "%s:%s", device, FIOR_FILENAME);
+	fd = sys_open((userptr_t)name, O_RDWR|O_CREAT|O_TRUNC, 0664, &err);
+	if (fd < 0) {
+		kprintf("fio4: open: %s\n", strerror(err));
+		kfree(buf);
+		return err;
+	}
+
+	kprintf("*** Starting sequential read-ahead test on %s: (%d MB)\n",
+		device, mb);
+
+	err = 0;
+	for (done = 0; done < nbytes && !err; done += FIOR_CHUNK) {
+		err = fio_chunk(curproc->fileTable[fd].of, buf, FIOR_CHUNK,
+				UIO_WRITE);
+	}
+	if (err) {
+		kprintf("fio4: write: %s\n", strerror(err));
+		off = on = 0;
+	}
+	else {
+		/* get the writes out of the way of the timed reads */
+		vfs_sync();
+
+		wasenabled = buffer_readahead(false);
+		off = fior_pass(fd, buf, nbytes);
+		buffer_readahead(true);
+		hits = buffer_readahead_hits();
+		on = fior_pass(fd, buf, nbytes);
+		hits = buffer_readahead_hits() - hits;
+		buffer_readahead(wasenabled);
+	}
+
+	sys_close(fd);
+	snprintf(name, sizeof(name), "%s:%s", device, FIOR_FILENAME);
+	vfs_remove(name);
+	kfree(buf);
+
+	if (off == 0 || on == 0) {
+		kprintf("*** Test failed\n");
+		return EIO;
+	}
+	fiob_print("fio4: read-ahead off", off);
+	kprintf("\n");
+	fiob_print("fio4: read-ahead on ", on);
+	kprintf(", speedup %lu.%02lu\n", on / off, (on * 100 / off) % 100);
+	buffer_printstats();
+	if (hits == 0) {
+		kprintf("fio4: no block read ahead was used\n");
+		kprintf("*** Test failed\n");
+		return EIO;
+	}
+
+	kprintf("*** Sequential read-ahead test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+#define FIOD_DEFFILES 10000
+#define FIOD_STRIDE   7919	/* prime: visits every file, not in order */
+
+static
+void
+fiod_makename(char *buf, size_t buflen, const char *fs, int num)
+{
+	snprintf(buf, buflen, "%s:fiod%05d", fs, num);
+}
+
+/* Microseconds per operation for NOPS operations from BEFORE on. */
+static
+unsigned long
+fiod_usper(struct timespec *before, int nops)
+{
+	struct timespec after, duration;
+	uint64_t ns;
+
+	gettime(&after);
+	timespec_sub(&after, before, &duration);
+	ns = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	return (unsigned long)(ns / 1000 / (nops > 0 ? nops : 1));
+}
+
+/*
+ * Check that file NUM is not there to be found.
+ */
+static
+bool
+fiod_absent(const char *fs, int num)
+{
+	char name[32];
+	struct vnode *vn;
+	int err;
+
+	fiod_makename(name, sizeof(name), fs, num);
+	err = vfs_lookup(name, &vn);
+	if (err == 0) {
+		VOP_DECREF(vn);
+		kprintf("fio5: found file %d, which isn't there\n", num);
+	}
+	else if (err != ENOENT) {
+		kprintf("fio5: lookup of file %d: %s\n", num, strerror(err));
+	}
+	return err == ENOENT;
+}
+
+int
+fileiotest5(int nargs, char **args)
+{
+	char name[32];
+	char *device;
+	struct vnode *vn;
+	struct stat st;
+	struct timespec before;
+	unsigned long create, lookup, remove;
+	ino_t *inos;
+	int nfiles = FIOD_DEFFILES;
+	int i, k, made, err = 0;
+
+	if (fio_args(nargs, args, "nfiles", 1, 99999, &nfiles, &device)) {
+		return EINVAL;
+	}
+
+	/* the inode each file was created with */
+	inos = kmalloc(nfiles * sizeof(ino_t));
+	if (inos == NULL) {
+		return ENOMEM;
+	}
+
+	kprintf("*** Starting directory test on %s: (%d files)\n",
+		device, nfiles);
+
+	gettime(&before);
+	for (made=0; made<nfiles; made++) {
+		fiod_makename(name, sizeof(name), device, made);
+		err = vfs_open(name, O_WRONLY|O_CREAT|O_EXCL, 0664, &vn);
+		if (err) {
+			break;
+		}
+		inos[made] = VOP_STAT(vn, &st) ? 0 : st.st_ino;
+		vfs_close(vn);
+	}
+	create = fiod_usper(&before, made);
+	if (err) {
+		/* SFS directories and disks are small; report, go on */
+		kprintf("fio5: could only create %d files: %s\n",
+			made, strerror(err));
+		err = 0;
+	}
+
+	gettime(&before);
+	for (i=0; i<made && !err; i++) {
+		k = (int)(((unsigned)i * FIOD_STRIDE) % made);
+		fiod_makename(name, sizeof(name), device, k);
+		err = vfs_lookup(name, &vn);
+		if (!err) {
+			err = VOP_STAT(vn, &st);
+			VOP_DECREF(vn);
+		}
+		if (!err && st.st_ino != inos[k]) {
+			kprintf("fio5: file %d is inode %lu, but lookup "
+				"found %lu\n", k, (unsigned long)inos[k],
+				(unsigned long)st.st_ino);
+			err = EIO;
+		}
+	}
+	lookup = fiod_usper(&before, made);
+	if (err) {
+		kprintf("fio5: lookup: %s\n", strerror(err));
+	}
+	if (!err && !fiod_absent(device, made)) {
+		err = EIO;
+	}
+
+	gettime(&before);
+	for (i=0; i<made; i++) {
+		fiod_makename(name, sizeof(name), device, i);
+		if (vfs_remove(name) && !err) {
+			kprintf("fio5: remove %s failed\n", name);
+			err = EIO;
+		}
+	}
+	remove = fiod_usper(&before, made);
+	for (i=0; i<made && !err; i++) {
+		if (!fiod_absent(device, i)) {
+			err = EIO;
+		}
+	}
+	kfree(inos);
+
+	if (made == 0 || err) {
+		kprintf("*** Test failed\n");
+		return err ? err : EIO;
+	}
+	kprintf("fio5: %d files: create %lu us, lookup %lu us, "
+		"remove %lu us per file\n", made, create, lookup, remove);
+
+	kprintf("*** Directory test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+#define FIOV_DEFFILES 1000
+#define FIOV_ROUNDS   10
+
+int
+fileiotest6(int nargs, char **args)
+{
+	char name[32];
+	char *device;
+	struct vnode **held, *vn;
+	struct timespec before;
+	unsigned long open;
+	int nfiles = FIOV_DEFFILES;
+	int i, k, r, made, err = 0;
+
+	if (fio_args(nargs, args, "nfiles", 1, 99999, &nfiles, &device)) {
+		return EINVAL;
+	}
+
+	held = kmalloc(nfiles * sizeof(struct vnode *));
+	if (held == NULL) {
+		return ENOMEM;
+	}
+
+	kprintf("*** Starting open test on %s: (%d files)\n",
+		device, nfiles);
+
+	for (made=0; made<nfiles; made++) {
+		fiod_makename(name, sizeof(name), device, made);
+		err = vfs_open(name, O_RDONLY|O_CREAT|O_EXCL, 0664,
+			       &held[made]);
+		if (err) {
+			break;
+		}
+	}
+	if (err) {
+		/* SFS directories and disks are small; report, go on */
+		kprintf("fio6: could only create %d files: %s\n",
+			made, strerror(err));
+		err = 0;
+	}
+
+	gettime(&before);
+	for (r=0; r<FIOV_ROUNDS && !err; r++) {
+		for (i=0; i<made && !err; i++) {
+			k = (int)(((unsigned)i * FIOD_STRIDE) % made);
+			fiod_makename(name, sizeof(name), device, k);
+			err = vfs_open(name, O_RDONLY, 0, &vn);
+			if (err) {
+				break;
+			}
+			if (vn != held[k]) {
+				kprintf("fio6: file %d opened as a second "
+					"vnode\n", k);
+				err = EIO;
+			}
+			vfs_close(vn);
+		}
+	}
+	open = fiod_usper(&before, made * FIOV_ROUNDS);
+	if (err) {
+		kprintf("fio6: open: %s\n", strerror(err));
+	}
+
+	for (i=0; i<made; i++) {
+		vfs_close(held[i]);
+		fiod_makename(name, sizeof(name), device, i);
+		if (vfs_remove(name) && !err) {
+			kprintf("fio6: remove %s failed\n", name);
+			err = EIO;
+		}
+	}
+	kfree(held);
+
+	if (made == 0 || err) {
+		kprintf("*** Test failed\n");
+		return err ? err : EIO;
+	}
+	kprintf("fio6: %d files open, %d rounds: %lu us per open+close\n",
+		made, FIOV_ROUNDS, open);
+
+	kprintf("*** Open test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+#define FIOF_SIZE     100	/* bytes written before each fsync */
+#define FIOF_DEFSYNCS 64
+#define FIOF_MAXSYNCS 10000
+
+static const int fiof_rounds[] = { 1, 8, 32 };
+static int fiof_nsyncs;
+#if OPT_SFS
+static unsigned long fiof_commits;	/* before the round */
+#endif
+
+/*
+ * Body of one fsync process: fiof_nsyncs times, a write of FIOF_SIZE
+ * bytes to the end of its own file and an fsync of it.
+ */
+static
+void
+fiof_thread(void *fs, unsigned long num)
+{
+	char name[32];
+	char buf[FIOF_SIZE];
+	struct openfile *of;
+	struct iovec iov;
+	struct uio ku;
+	int fd, err, i;
+
+	fio_makename(name, sizeof(name), fs, num);
+	fd = sys_open((userptr_t)name, O_WRONLY|O_CREAT|O_TRUNC, 0664, &err);
+	if (fd < 0) {
+		kprintf("fio7: process %lu: open: %s\n", num, strerror(err));
+		sys__exit(1);
+	}
+	of = curproc->fileTable[fd].of;
+
+	memset(buf, 'a' + num % 26, sizeof(buf));
+	err = 0;
+	for (i=0; i<fiof_nsyncs && !err; i++) {
+		uio_kinit(&iov, &ku, buf, FIOF_SIZE, 0, UIO_WRITE);
+		err = openfile_io(of, &ku);
+		if (!err && ku.uio_resid > 0) {
+			err = EIO;
+		}
+		if (!err) {
+			err = VOP_FSYNC(of->vn);
+		}
+	}
+	if (err) {
+		kprintf("fio7: process %lu: %s\n", num, strerror(err));
+	}
+
+	sys_close(fd);
+	sys__exit(err ? 1 : 0);
+}
+
+/*
+ * On a journaled volume, fsyncs arriving together must share commits:
+ * a round of more than one process must take fewer commits than it
+ * does fsyncs. Without a journal there are no commits to count.
+ */
+static
+bool
+fiof_check(int nprocs, unsigned long rate, unsigned long base)
+{
+#if OPT_SFS
+	unsigned long commits, nfsyncs;
+
+	(void)rate;
+	(void)base;
+
+	commits = sfs_journal_commits() - fiof_commits;
+	fiof_commits += commits;
+	if (commits == 0) {
+		kprintf("fio7: no journal commits to count\n");
+		return true;
+	}
+	nfsyncs = (unsigned long)nprocs * fiof_nsyncs;
+	kprintf("fio7: %lu fsyncs, %lu commits\n", nfsyncs, commits);
+	if (nprocs > 1 && commits >= nfsyncs) {
+		kprintf("fio7: the fsyncs were not committed together\n");
+		return false;
+	}
+#else
+	(void)nprocs;
+	(void)rate;
+	(void)base;
+#endif
+	return true;
+}
+
+static struct fio_test fiof_test = {
+	"fio7", fiof_thread, FIOF_DEFSYNCS, 1, "fsyncs/s", fiof_check,
+};
+
+int
+fileiotest7(int nargs, char **args)
+{
+	char *device;
+
+	fiof_nsyncs = FIOF_DEFSYNCS;
+	if (fio_args(nargs, args, "fsyncs per process", 1, FIOF_MAXSYNCS,
+		     &fiof_nsyncs, &device)) {
+		return EINVAL;
+	}
+	fiof_test.count = fiof_nsyncs;
+
+	kprintf("*** Starting concurrent fsync test on %s:\n", device);
+
+#if OPT_SFS
+	fiof_commits = sfs_journal_commits();
+#endif
+	if (fio_rounds(device, &fiof_test, fiof_rounds,
+		       ARRAYCOUNT(fiof_rounds), FIO_MAXPROCS)) {
+		kprintf("*** Test failed\n");
+		return EIO;
+	}
+
+	kprintf("*** Concurrent fsync test done\n");
+	return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * forktest - cost of fork+exec
+ *
+ * First checks, on address spaces built here, that after a write a
+ * fork's parent and child really see separate memory. Then runs a
+ * user program that forks (by default /testbin/forktest, or the one
+ * named with its arguments on the command line) a number of times,
+ * each in a process of its own, and prints the time per run: that is
+ * real forks and execs through the system calls, not as_copy alone.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <thread.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <syscall.h>
+#include <test.h>
+
+#define FT_TEXT     0x00400000
+#define FT_DATA     0x10000000
+#define FT_PROGRAM  "/testbin/forktest"
+#define FT_RUNS     5
+
+/*
+ * Build an address space shaped like a loaded program: a text and a
+ * data region of NPAGES pages each, plus the stack.
+ */
+static
+struct addrspace *
+ft_makeas(unsigned npages)
+{
+	struct addrspace *as;
+	vaddr_t stackptr;
+
+	as = as_create();
+	if (as == NULL) {
+		return NULL;
+	}
+	if (as_define_region(as, FT_TEXT, npages * PAGE_SIZE, 1, 0, 1) ||
+	    as_define_region(as, FT_DATA, npages * PAGE_SIZE, 1, 1, 0) ||
+	    as_prepare_load(as) ||
+	    as_complete_load(as) ||
+	    as_define_stack(as, &stackptr)) {
+		as_destroy(as);
+		return NULL;
+	}
+	return as;
+}
+
+/* Make AS the address space of the current (menu) thread. */
+static
+struct addrspace *
+ft_switch(struct addrspace *as)
+{
+	struct addrspace *old;
+
+	old = proc_setas(as);
+	as_activate();
+	return old;
+}
+
+static
+int
+ft_check(void)
+{
+	struct addrspace *parent, *child, *old;
+	char buf[16];
+	int err;
+
+	parent = ft_makeas(4);
+	if (parent == NULL) {
+		return ENOMEM;
+	}
+	old = ft_switch(parent);
+
+	err = copyout("parent", (userptr_t)FT_DATA, 7);
+	if (!err) {
+		err = as_copy(parent, &child);
+	}
+	if (err) {
+		ft_switch(old);
+		as_destroy(parent);
+		return err;
+	}
+
+	ft_switch(child);
+	err = copyin((const_userptr_t)FT_DATA, buf, 7);
+	if (!err && strcmp(buf, "parent")) {
+		kprintf("forktest: child sees \"%s\"\n", buf);
+		err = EINVAL;
+	}
+	if (!err) {
+		err = copyout("child", (userptr_t)FT_DATA, 6);
+	}
+
+	ft_switch(parent);
+	if (!err) {
+		err = copyin((const_userptr_t)FT_DATA, buf, 7);
+	}
+	if (!err && strcmp(buf, "parent")) {
+		kprintf("forktest: child's write reached the parent\n");
+		err = EINVAL;
+	}
+
+	ft_switch(old);
+	as_destroy(child);
+	as_destroy(parent);
+	return err;
+}
+
+/*
+ * Body of one run: the program in ARGS, with its arguments. Exits
+ * through sys__exit if it cannot be started, so proc_wait returns.
+ */
+static
+void
+ft_progthread(void *ptr, unsigned long nargs)
+{
+	char **args = ptr;
+	char progname[128];
+	int err;
+
+	/* runprogram destroys the name it is given */
+	KASSERT(strlen(args[0]) < sizeof(progname));
+	strcpy(progname, args[0]);
+
+	err = runprogram(progname, args, nargs);
+	kprintf("forktest: %s: %s\n", args[0], strerror(err));
+	sys__exit(1);
+}
+
+int
+forktest(int nargs, char **args)
+{
+	char *defargs[2] = { (char *)FT_PROGRAM, NULL };
+	struct timespec before, after, duration;
+	struct proc *proc;
+	uint64_t ns;
+	unsigned i;
+	int err, status;
+
+	/* drop the "fork"; what is left names the program */
+	args++;
+	nargs--;
+	if (nargs == 0) {
+		args = defargs;
+		nargs = 1;
+	}
+
+	kprintf("*** Starting fork+exec test\n");
+
+	err = ft_check();
+	if (err) {
+		kprintf("forktest: copy check failed: %s\n", strerror(err));
+		kprintf("*** Test failed\n");
+		return err;
+	}
+
+	gettime(&before);
+	for (i=0; i<FT_RUNS; i++) {
+		proc = proc_create_runprogram(args[0]);
+		if (proc == NULL) {
+			err = ENOMEM;
+			break;
+		}
+		err = thread_fork(args[0], proc, ft_progthread, args, nargs);
+		if (err) {
+			proc_destroy(proc);
+			break;
+		}
+		status = proc_wait(proc);
+		if (status) {
+			kprintf("forktest: %s exited with %d\n",
+				args[0], status);
+			err = EINVAL;
+			break;
+		}
+	}
+	gettime(&after);
+	if (err) {
+		kprintf("*** Test failed\n");
+		return err;
+	}
+
+	timespec_sub(&after, &before, &duration);
+	ns = (uint64_t)duration.tv_sec * 1000000000 + duration.tv_nsec;
+	kprintf("forktest: %s: %lu us per run (%d runs)\n", args[0],
+		(unsigned long)(ns / FT_RUNS / 1000), FT_RUNS);
+
+	kprintf("*** fork+exec test done\n");
+	return 0;
+}
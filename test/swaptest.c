@@ -0,0 +1,149 @@
+/*
+ * swaptest - page-out and page-in through the swap device
+ *
+ * Needs a swap device (swapon). Writes a different pattern into each
+ * page of a large region of a fresh address space, going on until
+ * enough of them have been paged out, then reads every page back and
+ * checks its pattern; pages that went out must come back in intact.
+ * Prints how many pages went out and came in.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <swap.h>
+#include <test.h>
+
+#define SW_BASE      0x10000000
+#define SW_MAXPAGES  4096	/* region size: 16 MB */
+#define SW_MINOUTS   64		/* page-outs to see before reading back */
+
+/* The word at WORD of page PAGE. */
+static
+uint32_t
+sw_word(unsigned page, unsigned word)
+{
+	return page * 0x9e3779b9 + word;
+}
+
+static
+void
+sw_fill(uint32_t *buf, unsigned page)
+{
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE / sizeof(uint32_t); i++) {
+		buf[i] = sw_word(page, i);
+	}
+}
+
+static
+bool
+sw_check(const uint32_t *buf, unsigned page)
+{
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (buf[i] != sw_word(page, i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+swaptest(int nargs, char **args)
+{
+	struct addrspace *as, *old;
+	unsigned long in0, out0, in1, out1, in2, out2;
+	uint32_t *pat, *buf;
+	unsigned npages, i;
+	int err = 0;
+
+	(void)nargs;
+	(void)args;
+
+	if (!swap_enabled()) {
+		kprintf("swaptest: no swap device; use swapon first\n");
+		return EINVAL;
+	}
+
+	pat = kmalloc(PAGE_SIZE);
+	buf = kmalloc(PAGE_SIZE);
+	as = as_create();
+	if (pat == NULL || buf == NULL || as == NULL ||
+	    as_define_region(as, SW_BASE, SW_MAXPAGES * PAGE_SIZE,
+			     1, 1, 0)) {
+		if (as != NULL) {
+			as_destroy(as);
+		}
+		kfree(pat);
+		kfree(buf);
+		return ENOMEM;
+	}
+
+	kprintf("*** Starting swap test\n");
+
+	old = proc_setas(as);
+	as_activate();
+
+	swap_getstats(&in0, &out0);
+	npages = 0;
+	out1 = out0;
+	while (npages < SW_MAXPAGES && out1 - out0 < SW_MINOUTS && !err) {
+		sw_fill(pat, npages);
+		err = copyout(pat, (userptr_t)(SW_BASE + npages * PAGE_SIZE),
+			      PAGE_SIZE);
+		if (!err) {
+			npages++;
+		}
+		swap_getstats(&in1, &out1);
+	}
+	if (err) {
+		kprintf("swaptest: writing page %u: %s\n", npages,
+			strerror(err));
+	}
+	else if (out1 - out0 < SW_MINOUTS) {
+		kprintf("swaptest: only %lu page-outs in %u pages\n",
+			out1 - out0, npages);
+		err = EINVAL;
+	}
+
+	for (i=0; i<npages && !err; i++) {
+		err = copyin((const_userptr_t)(SW_BASE + i * PAGE_SIZE),
+			     buf, PAGE_SIZE);
+		if (err) {
+			kprintf("swaptest: reading page %u: %s\n", i,
+				strerror(err));
+			break;
+		}
+		if (!sw_check(buf, i)) {
+			kprintf("swaptest: page %u came back wrong\n", i);
+			err = EIO;
+		}
+	}
+	swap_getstats(&in2, &out2);
+
+	proc_setas(old);
+	as_activate();
+	as_destroy(as);
+	kfree(pat);
+	kfree(buf);
+
+	if (!err && in2 == in0) {
+		kprintf("swaptest: nothing was paged back in\n");
+		err = EINVAL;
+	}
+	if (err) {
+		kprintf("*** Test failed\n");
+		return err;
+	}
+	kprintf("swaptest: %u pages, %lu page-outs, %lu page-ins\n",
+		npages, out2 - out0, in2 - in0);
+	kprintf("*** Swap test done\n");
+	return 0;
+}
@@ -178,6 +178,13 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_tlb_victim = 0;
+	c->c_tlb_pidgen = 0;
+	c->c_tlb_nextpid = 0;
+	c->c_tlb_faults = 0;
+	c->c_tlb_replacements = 0;
+	c->c_tlb_invalidations = 0;
+	c->c_curas = NULL;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -249,6 +256,21 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Access to the cpu array for statistics code.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned n)
+{
+	return cpuarray_get(&allcpus, n);
+}
+
 /*
  * Destroy a thread.
  *
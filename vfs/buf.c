@@ -0,0 +1,920 @@
+/*
+ * Buffer cache.
+ *
+ * Up to buffer_max one-block buffers, found through a hash table on
+ * (device, block) and recycled least recently used first. A dirty
+ * buffer is written back before it is recycled. buffer_max comes from
+ * the size of RAM, but is never so small that the buffers a journal
+ * may hold plus a run of read-ahead leave the rest of the system
+ * waiting for one.
+ *
+ * buffer_lock protects the hash table, the LRU list and the header
+ * of every buffer. A buffer handed out by buffer_read or buffer_get
+ * is busy until buffer_release; so is one under device I/O, which is
+ * done without buffer_lock held. Anyone wanting a busy buffer waits
+ * on buffer_cv.
+ *
+ * Read-ahead requests from buffer_prefetch go on a small queue served
+ * by a kernel thread, so the caller does not wait for them. The
+ * thread reads each block into a buffer marked b_prefetched, which
+ * counts as used when someone reads it and as wasted if it is
+ * recycled first.
+ *
+ * Runs of consecutive blocks move in a single device transfer when
+ * they can: a dirty buffer is written back together with the dirty
+ * buffers for the blocks on either side of it, and buffer_readrun
+ * reads a run of blocks at once.
+ *
+ * A held buffer (b_held, from buffer_hold) is dirty but may not be
+ * written back yet; it is skipped by write-back, buffer_sync and
+ * recycling alike.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <device.h>
+#include <vm.h>
+#include <buf.h>
+
+#define BUFFER_MIN       (4 * (BUFFER_MAXHELD + BUFFER_MAXRUN))
+#define BUFFER_LIMIT     4096	/* most buffers, however much RAM */
+#define BUFFER_RAMSHARE  16	/* use at most 1/16 of RAM */
+#define BUFFER_SIZE      512	/* the only device block size we cache */
+#define BUFFER_HASHSIZE  61
+#define BUFFER_RAQUEUE   64	/* pending read-ahead requests */
+#define BUFFER_MAXRUN    16	/* most blocks in one transfer */
+
+struct buf {
+	struct device *b_dev;		/* NULL if the buffer holds nothing */
+	daddr_t b_block;
+	void *b_data;
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_busy;			/* handed out, or under I/O */
+	bool b_prefetched;		/* read ahead and not yet used */
+	bool b_held;			/* not to be written back yet */
+	struct buf *b_hashnext;
+	struct buf *b_lruprev, *b_lrunext;
+};
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead, *buffer_lrutail;	/* oldest first */
+static unsigned buffer_count;
+static unsigned buffer_max;
+
+/* Read-ahead queue, also under buffer_lock */
+static struct {
+	struct device *rq_dev;
+	daddr_t rq_block;
+} buffer_raq[BUFFER_RAQUEUE];
+static unsigned buffer_rahead, buffer_racount;
+static struct cv *buffer_racv;			/* queue not empty */
+static struct device *buffer_radev;		/* device being read ahead */
+static bool buffer_raenabled = true;
+
+static struct {
+	unsigned long hits, misses;
+	unsigned long writebacks;	/* dirty buffers written */
+	unsigned long recycled;		/* buffers reused for another block */
+	unsigned long clustered;	/* written back in multi-block runs */
+	unsigned long runreads;		/* read by buffer_readrun */
+	unsigned long ra_reads;		/* blocks read ahead */
+	unsigned long ra_used;		/* ...and then read by someone */
+	unsigned long ra_wasted;	/* ...or recycled before that */
+	unsigned long ra_dropped;	/* requests lost to a full queue */
+} buffer_stats;
+
+static void buffer_rathread(void *, unsigned long);
+
+void
+buffer_bootstrap(void)
+{
+	int result;
+
+	COMPILE_ASSERT(BUFFER_MIN <= BUFFER_LIMIT);
+
+	buffer_max = ram_getsize() / BUFFER_RAMSHARE / BUFFER_SIZE;
+	if (buffer_max < BUFFER_MIN) {
+		buffer_max = BUFFER_MIN;
+	}
+	if (buffer_max > BUFFER_LIMIT) {
+		buffer_max = BUFFER_LIMIT;
+	}
+
+	buffer_lock = lock_create("buffer cache");
+	buffer_cv = cv_create("buffer cache");
+	buffer_racv = cv_create("buffer read-ahead");
+	if (buffer_lock == NULL || buffer_cv == NULL || buffer_racv == NULL) {
+		panic("buffer_bootstrap: out of memory\n");
+	}
+
+	result = thread_fork("buffer read-ahead", NULL, buffer_rathread,
+			     NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list
+
+static
+unsigned
+buffer_hashfn(struct device *dev, daddr_t block)
+{
+	return (dev->d_devnumber * 31 + (unsigned)block) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[buffer_hashfn(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_unhash(struct buf *b)
+{
+	struct buf **bp;
+
+	if (b->b_dev == NULL) {
+		return;
+	}
+	bp = &buffer_hash[buffer_hashfn(b->b_dev, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_dev = NULL;
+	b->b_valid = false;
+}
+
+static
+void
+buffer_hashin(struct buf *b, struct device *dev, daddr_t block)
+{
+	unsigned h = buffer_hashfn(dev, block);
+
+	KASSERT(b->b_dev == NULL);
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+static
+void
+buffer_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put B at the recently used end of the list, or the other end. */
+static
+void
+buffer_lru_insert(struct buf *b, bool recent)
+{
+	if (recent) {
+		b->b_lruprev = buffer_lrutail;
+		b->b_lrunext = NULL;
+		if (buffer_lrutail != NULL) {
+			buffer_lrutail->b_lrunext = b;
+		}
+		else {
+			buffer_lruhead = b;
+		}
+		buffer_lrutail = b;
+	}
+	else {
+		b->b_lruprev = NULL;
+		b->b_lrunext = buffer_lruhead;
+		if (buffer_lruhead != NULL) {
+			buffer_lruhead->b_lruprev = b;
+		}
+		else {
+			buffer_lrutail = b;
+		}
+		buffer_lruhead = b;
+	}
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+/*
+ * Read or write the blocks of the N busy buffers BS, which hold
+ * consecutive blocks of one device, in one transfer straight to or
+ * from the buffers (one iovec each), retrying I/O errors. Called
+ * without buffer_lock.
+ */
+static
+int
+buffer_iorun(struct buf **bs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[BUFFER_MAXRUN];
+	struct uio ku;
+	struct device *dev = bs[0]->b_dev;
+	daddr_t block = bs[0]->b_block;
+	unsigned i;
+	int result;
+	int tries = 0;
+
+	KASSERT(n >= 1 && n <= BUFFER_MAXRUN);
+	for (i=0; i<n; i++) {
+		KASSERT(bs[i]->b_busy);
+		KASSERT(bs[i]->b_dev == dev);
+		KASSERT(bs[i]->b_block == block + i);
+	}
+
+ retry:
+	/* (the transfer uses up the iovecs, so set them up each time) */
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = bs[i]->b_data;
+		iov[i].iov_len = BUFFER_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)block * BUFFER_SIZE;
+	ku.uio_resid = n * BUFFER_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	result = DEVOP_IO(dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * The block is out of range or the offset isn't
+		 * aligned: our caller's fault, not the disk's.
+		 */
+		panic("buffer: dev %u block %u: DEVOP_IO returned EINVAL\n",
+		      dev->d_devnumber, (unsigned)block);
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: dev %u block %u I/O error, retrying\n",
+				dev->d_devnumber, (unsigned)block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: dev %u block %u I/O error, giving up "
+				"after %d retries\n", dev->d_devnumber,
+				(unsigned)block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Whether B could be written back along with a neighbour.
+ */
+static
+bool
+buffer_clusterable(struct buf *b)
+{
+	return b != NULL && !b->b_busy && b->b_dirty && b->b_valid &&
+		!b->b_held;
+}
+
+/*
+ * Write back dirty buffer B, which is not busy, along with any dirty
+ * buffers next to it on disk. Drops buffer_lock during the write, so
+ * the caller must look again at whatever it was doing afterwards.
+ */
+static
+int
+buffer_writeout(struct buf *b)
+{
+	struct buf *run[BUFFER_MAXRUN];
+	struct buf *nb;
+	unsigned i, n;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(buffer_clusterable(b));
+
+	/* Back up to the start of the run... */
+	n = 1;
+	while (n < BUFFER_MAXRUN && b->b_block > 0) {
+		nb = buffer_find(b->b_dev, b->b_block - 1);
+		if (!buffer_clusterable(nb)) {
+			break;
+		}
+		b = nb;
+		n++;
+	}
+
+	/* ...and collect it going forward */
+	run[0] = b;
+	for (n = 1; n < BUFFER_MAXRUN; n++) {
+		nb = buffer_find(b->b_dev, b->b_block + n);
+		if (!buffer_clusterable(nb)) {
+			break;
+		}
+		run[n] = nb;
+	}
+
+	for (i=0; i<n; i++) {
+		run[i]->b_busy = true;
+	}
+	lock_release(buffer_lock);
+	result = buffer_iorun(run, n, UIO_WRITE);
+	lock_acquire(buffer_lock);
+	for (i=0; i<n; i++) {
+		run[i]->b_busy = false;
+		if (result == 0) {
+			run[i]->b_dirty = false;
+		}
+	}
+	if (result == 0) {
+		buffer_stats.writebacks += n;
+		buffer_stats.clustered += n > 1 ? n : 0;
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// Getting buffers
+
+/*
+ * Allocate a fresh, empty buffer. Called without buffer_lock, since
+ * kmalloc may sleep.
+ */
+static
+struct buf *
+buffer_create(void)
+{
+	struct buf *b;
+
+	b = kmalloc(sizeof(struct buf));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUFFER_SIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_dev = NULL;
+	b->b_valid = b->b_dirty = b->b_busy = false;
+	b->b_prefetched = false;
+	b->b_held = false;
+	b->b_hashnext = NULL;
+	return b;
+}
+
+static
+void
+buffer_destroy(struct buf *b)
+{
+	kfree(b->b_data);
+	kfree(b);
+}
+
+/*
+ * Find a buffer to hold a new block: *SPARE (a buffer_create'd one the
+ * caller brought along, which is then used up) while there are fewer
+ * than buffer_max, otherwise the least recently used one not in use
+ * (which may be dirty). NULL if all of them are busy or held.
+ */
+static
+struct buf *
+buffer_victim(struct buf **spare)
+{
+	struct buf *b;
+
+	if (buffer_count < buffer_max && *spare != NULL) {
+		b = *spare;
+		*spare = NULL;
+		buffer_lru_insert(b, false);
+		buffer_count++;
+		return b;
+	}
+
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_busy && !b->b_held) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get the buffer for BLOCK of DEV, busy, whether or not it holds the
+ * block's contents yet. If WAIT is false, fail with EAGAIN instead of
+ * waiting for another thread to release a buffer.
+ */
+static
+int
+buffer_obtain(struct device *dev, daddr_t block, bool wait,
+	      struct buf **ret)
+{
+	struct buf *b, *spare = NULL;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	/* (unlocked peek; if it is wrong, the spare just goes unused) */
+	if (buffer_count < buffer_max) {
+		spare = buffer_create();
+	}
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		b = buffer_find(dev, block);
+		if (b != NULL) {
+			if (!b->b_busy) {
+				break;
+			}
+		}
+		else {
+			b = buffer_victim(&spare);
+		}
+		if (b == NULL || b->b_busy) {
+			/* wait for a buffer, or for our block's buffer */
+			if (!wait) {
+				result = EAGAIN;
+				goto fail;
+			}
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+		if (b->b_dirty) {
+			result = buffer_writeout(b);
+			if (result) {
+				goto fail;
+			}
+			/* someone may have cached our block meanwhile */
+			continue;
+		}
+		if (b->b_dev != NULL) {
+			buffer_stats.recycled++;
+		}
+		if (b->b_prefetched) {
+			buffer_stats.ra_wasted++;
+			b->b_prefetched = false;
+		}
+		buffer_unhash(b);
+		buffer_hashin(b, dev, block);
+		break;
+	}
+	b->b_busy = true;
+	buffer_lru_remove(b);
+	buffer_lru_insert(b, true);
+	lock_release(buffer_lock);
+
+	if (spare != NULL) {
+		buffer_destroy(spare);
+	}
+	*ret = b;
+	return 0;
+
+ fail:
+	lock_release(buffer_lock);
+	if (spare != NULL) {
+		buffer_destroy(spare);
+	}
+	return result;
+}
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_obtain(dev, block, true, &b);
+	if (result) {
+		return result;
+	}
+
+	/* b_valid only changes while the buffer is busy, which it is */
+	if (b->b_valid) {
+		lock_acquire(buffer_lock);
+		buffer_stats.hits++;
+		if (b->b_prefetched) {
+			buffer_stats.ra_used++;
+			b->b_prefetched = false;
+		}
+		lock_release(buffer_lock);
+		*ret = b;
+		return 0;
+	}
+
+	result = buffer_iorun(&b, 1, UIO_READ);
+
+	lock_acquire(buffer_lock);
+	buffer_stats.misses++;
+	if (result) {
+		b->b_busy = false;
+		cv_broadcast(buffer_cv, buffer_lock);
+		lock_release(buffer_lock);
+		return result;
+	}
+	b->b_valid = true;
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buffer_obtain(dev, block, true, ret);
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	b->b_dirty = true;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_hold(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+	b->b_held = true;
+}
+
+void
+buffer_unhold(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_held);
+	b->b_held = false;
+}
+
+void
+buffer_discard(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_held = false;
+}
+
+int
+buffer_readrun(struct device *dev, daddr_t block, unsigned n)
+{
+	struct buf *run[BUFFER_MAXRUN];
+	unsigned i, j;
+	int result = 0, res;
+
+	if (n > BUFFER_MAXRUN) {
+		n = BUFFER_MAXRUN;
+	}
+
+	/*
+	 * Get the buffers. Only the first may wait: holding some
+	 * buffers while waiting for others could deadlock.
+	 */
+	for (i=0; i<n; i++) {
+		result = buffer_obtain(dev, block + i, i == 0, &run[i]);
+		if (result) {
+			break;
+		}
+	}
+	n = i;
+	if (result == EAGAIN && n > 0) {
+		result = 0;
+	}
+
+	/* Read each stretch of them not holding their blocks yet */
+	for (i=0; i<n; i=j) {
+		if (run[i]->b_valid) {
+			j = i + 1;
+			continue;
+		}
+		for (j=i+1; j<n && !run[j]->b_valid; j++) {
+			/* nothing */
+		}
+		res = buffer_iorun(&run[i], j - i, UIO_READ);
+		lock_acquire(buffer_lock);
+		if (res == 0) {
+			unsigned k;
+
+			for (k=i; k<j; k++) {
+				run[k]->b_valid = true;
+			}
+			buffer_stats.runreads += j - i;
+		}
+		lock_release(buffer_lock);
+		if (res && !result) {
+			result = res;
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		buffer_release(run[i]);
+	}
+	return result;
+}
+
+bool
+buffer_incore(struct device *dev, daddr_t block)
+{
+	bool ret;
+
+	lock_acquire(buffer_lock);
+	ret = buffer_find(dev, block) != NULL;
+	lock_release(buffer_lock);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+// Read-ahead
+
+void
+buffer_prefetch(struct device *dev, daddr_t block)
+{
+	unsigned slot;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+
+	lock_acquire(buffer_lock);
+	if (!buffer_raenabled || buffer_find(dev, block) != NULL) {
+		/* off, or already cached or on its way */
+		lock_release(buffer_lock);
+		return;
+	}
+	if (buffer_racount == BUFFER_RAQUEUE) {
+		buffer_stats.ra_dropped++;
+		lock_release(buffer_lock);
+		return;
+	}
+	slot = (buffer_rahead + buffer_racount) % BUFFER_RAQUEUE;
+	buffer_raq[slot].rq_dev = dev;
+	buffer_raq[slot].rq_block = block;
+	buffer_racount++;
+	cv_signal(buffer_racv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+bool
+buffer_readahead(bool on)
+{
+	bool old;
+
+	lock_acquire(buffer_lock);
+	old = buffer_raenabled;
+	buffer_raenabled = on;
+	lock_release(buffer_lock);
+	return old;
+}
+
+unsigned long
+buffer_readahead_hits(void)
+{
+	unsigned long ret;
+
+	lock_acquire(buffer_lock);
+	ret = buffer_stats.ra_used;
+	lock_release(buffer_lock);
+	return ret;
+}
+
+/*
+ * The read-ahead thread. Takes requests off the queue and reads the
+ * blocks into the cache, one at a time.
+ */
+static
+void
+buffer_rathread(void *unused1, unsigned long unused2)
+{
+	struct device *dev;
+	daddr_t block;
+	struct buf *b;
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_racount == 0) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+		dev = buffer_raq[buffer_rahead].rq_dev;
+		block = buffer_raq[buffer_rahead].rq_block;
+		buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUE;
+		buffer_racount--;
+		buffer_radev = dev;
+		lock_release(buffer_lock);
+
+		result = buffer_obtain(dev, block, true, &b);
+		if (result == 0) {
+			if (!b->b_valid) {
+				result = buffer_iorun(&b, 1, UIO_READ);
+				lock_acquire(buffer_lock);
+				if (result == 0) {
+					b->b_valid = true;
+					b->b_prefetched = true;
+					buffer_stats.ra_reads++;
+				}
+				lock_release(buffer_lock);
+			}
+			buffer_release(b);
+		}
+
+		lock_acquire(buffer_lock);
+		buffer_radev = NULL;
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Whole-device operations
+
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buffer_lock);
+ again:
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dev != dev || !b->b_dirty || b->b_held) {
+			continue;
+		}
+		if (b->b_busy) {
+			/* in use; it may get dirtier, so wait it out */
+			cv_wait(buffer_cv, buffer_lock);
+		}
+		else {
+			result = buffer_writeout(b);
+			if (result) {
+				lock_release(buffer_lock);
+				return result;
+			}
+		}
+		/* the list may have changed while we slept */
+		goto again;
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+/*
+ * Write back the dirty buffers for N blocks of DEV from BLOCK on,
+ * leaving the rest of the cache alone; for fsync of one file.
+ */
+int
+buffer_flush(struct device *dev, daddr_t block, unsigned n)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	lock_acquire(buffer_lock);
+	i = 0;
+	while (i < n) {
+		b = buffer_find(dev, block + i);
+		if (b == NULL || !b->b_dirty || b->b_held) {
+			i++;
+		}
+		else if (b->b_busy) {
+			/* in use; wait, then look at this block again */
+			cv_wait(buffer_cv, buffer_lock);
+		}
+		else {
+			result = buffer_writeout(b);
+			if (result) {
+				lock_release(buffer_lock);
+				return result;
+			}
+		}
+	}
+	lock_release(buffer_lock);
+	return 0;
+}
+
+void
+buffer_invalidate(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i, n;
+
+	lock_acquire(buffer_lock);
+
+	/* Drop queued read-ahead for DEV and wait out any in progress */
+	n = buffer_racount;
+	buffer_racount = 0;
+	for (i=0; i<n; i++) {
+		unsigned from = (buffer_rahead + i) % BUFFER_RAQUEUE;
+		unsigned to = (buffer_rahead + buffer_racount) % BUFFER_RAQUEUE;
+
+		if (buffer_raq[from].rq_dev != dev) {
+			buffer_raq[to] = buffer_raq[from];
+			buffer_racount++;
+		}
+	}
+	while (buffer_radev == dev) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+
+	for (b = buffer_lruhead; b != NULL; b = next) {
+		next = b->b_lrunext;
+		if (b->b_dev != dev) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		KASSERT(!b->b_dirty);
+		KASSERT(!b->b_held);
+		buffer_unhash(b);
+		b->b_prefetched = false;
+		/* empty buffers are the first to be reused */
+		buffer_lru_remove(b);
+		buffer_lru_insert(b, false);
+	}
+	lock_release(buffer_lock);
+}
+
+void
+buffer_printstats(void)
+{
+	unsigned long lookups;
+	unsigned dirty = 0, busy = 0;
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dirty) {
+			dirty++;
+		}
+		if (b->b_busy) {
+			busy++;
+		}
+	}
+	lookups = buffer_stats.hits + buffer_stats.misses;
+	kprintf("Buffer cache: %u of %u buffers, %u dirty, %u in use\n",
+		buffer_count, buffer_max, dirty, busy);
+	kprintf("  %lu hits, %lu misses, hit rate %lu%%\n",
+		buffer_stats.hits, buffer_stats.misses,
+		lookups ? buffer_stats.hits * 100 / lookups : 0);
+	kprintf("  %lu recycled, %lu written back (%lu in runs), "
+		"%lu read in runs\n", buffer_stats.recycled,
+		buffer_stats.writebacks, buffer_stats.clustered,
+		buffer_stats.runreads);
+	kprintf("  read-ahead %s: %lu blocks read, %lu used, %lu wasted, "
+		"%lu dropped\n", buffer_raenabled ? "on" : "off",
+		buffer_stats.ra_reads, buffer_stats.ra_used,
+		buffer_stats.ra_wasted, buffer_stats.ra_dropped);
+	lock_release(buffer_lock);
+}
@@ -39,10 +39,13 @@
 #include <lib.h>
 #include <array.h>
 #include <synch.h>
+#include <thread.h>
+#include <clock.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
 
 /*
  * Structure for a single named device.
@@ -94,6 +97,11 @@ static struct knowndevarray *knowndevs;
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
+/* How often the syncer writes dirty data back, in seconds */
+#define VFS_SYNCINTERVAL  5
+
+static void vfs_syncer(void *, unsigned long);
+
 
 /*
  * Setup function
@@ -101,6 +109,8 @@ static unsigned vfs_biglock_depth;
 void
 vfs_bootstrap(void)
 {
+	int result;
+
 	knowndevs = knowndevarray_create();
 	if (knowndevs==NULL) {
 		panic("vfs: Could not create knowndevs array\n");
@@ -112,10 +122,36 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	buffer_bootstrap();
+
+	result = thread_fork("vfs syncer", NULL, vfs_syncer, NULL, 0);
+	if (result) {
+		panic("vfs: Could not start syncer: %s\n", strerror(result));
+	}
+
 	devnull_create();
 	semfs_bootstrap();
 }
 
+/*
+ * The syncer. Filesystems hold dirty data in memory (the buffer
+ * cache, and blocks SFS hasn't allocated yet) until it is evicted or
+ * synced; this flushes it all every VFS_SYNCINTERVAL seconds, so that
+ * it is written back in batches but doesn't stay unwritten for long.
+ */
+static
+void
+vfs_syncer(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(VFS_SYNCINTERVAL);
+		vfs_sync();
+	}
+}
+
 /*
  * Operations on vfs_biglock. We make it recursive to avoid having to
  * think about where we do and don't already hold it. This is an
@@ -634,6 +670,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* the lookup cache holds vnodes of the fs */
+	vfs_lookcache_purge();
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -706,6 +745,9 @@ vfs_unmountall(void)
 
 	vfs_biglock_acquire();
 
+	/* the lookup cache holds vnodes of the filesystems */
+	vfs_lookcache_purge();
+
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		dev = knowndevarray_get(knowndevs, i);
@@ -35,6 +35,7 @@
 #include <kern/errno.h>
 #include <limits.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
@@ -115,6 +116,7 @@ void
 vfs_clearbootfs(void)
 {
 	vfs_biglock_acquire();
+	vfs_lookcache_purge();
 	change_bootfs(NULL);
 	vfs_biglock_release();
 }
@@ -227,6 +229,243 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+// Lookup cache
+//
+// A small table of recent lookups: the vnode the lookup started from,
+// the rest of the path, and the vnode found, or NULL if there was no
+// such file. An entry holds references to both vnodes. Entries are
+// replaced least recently used first.
+//
+// Since VOP_LOOKUP takes a whole path, not a single name, the cache
+// can't tell which directory a name change touches. So vfs_remove and
+// the calls that create names forget every entry whose path ends in
+// the name concerned, and rename, rmdir and unmount forget them all.
+//
+// A lookup that raced with one of those may have seen the name before
+// the change and would otherwise enter that stale answer after the
+// forget. So every forget bumps a generation number, and a lookup
+// only enters its result if the number hasn't moved since it began.
+
+#define LOOKCACHE_SIZE     64
+#define LOOKCACHE_PATHLEN  48	/* longer paths aren't cached */
+
+struct lookcache_entry {
+	struct vnode *lc_dir;		/* starting point; NULL if unused */
+	struct vnode *lc_vn;		/* what was found; NULL if nothing */
+	unsigned lc_hash;		/* of lc_path */
+	unsigned lc_lastuse;
+	char lc_path[LOOKCACHE_PATHLEN];
+};
+
+static struct lookcache_entry lookcache[LOOKCACHE_SIZE];
+static unsigned lookcache_clock;
+static unsigned lookcache_gen;
+static struct spinlock lookcache_lock = SPINLOCK_INITIALIZER;
+
+static
+unsigned
+lookcache_hashfn(const char *path)
+{
+	unsigned h = 0;
+
+	while (*path) {
+		h = h * 33 + (unsigned char)*path++;
+	}
+	return h;
+}
+
+/*
+ * Look for the lookup of PATH from DIR. If it's there, hand back the
+ * result: 0 with a new reference to the vnode, or ENOENT.
+ */
+static
+bool
+lookcache_find(struct vnode *dir, const char *path, int *result,
+	       struct vnode **ret)
+{
+	struct lookcache_entry *lc;
+	unsigned h, i;
+
+	h = lookcache_hashfn(path);
+
+	spinlock_acquire(&lookcache_lock);
+	for (i=0; i<LOOKCACHE_SIZE; i++) {
+		lc = &lookcache[i];
+		if (lc->lc_dir == dir && lc->lc_hash == h &&
+		    !strcmp(lc->lc_path, path)) {
+			lc->lc_lastuse = ++lookcache_clock;
+			if (lc->lc_vn != NULL) {
+				VOP_INCREF(lc->lc_vn);
+				*ret = lc->lc_vn;
+				*result = 0;
+			}
+			else {
+				*result = ENOENT;
+			}
+			spinlock_release(&lookcache_lock);
+			return true;
+		}
+	}
+	spinlock_release(&lookcache_lock);
+	return false;
+}
+
+/*
+ * Get the generation to pass to lookcache_enter; call it before
+ * doing the lookup.
+ */
+static
+unsigned
+lookcache_getgen(void)
+{
+	unsigned gen;
+
+	spinlock_acquire(&lookcache_lock);
+	gen = lookcache_gen;
+	spinlock_release(&lookcache_lock);
+	return gen;
+}
+
+/*
+ * Remember that looking up PATH from DIR found VN (or nothing),
+ * unless something has been forgotten since generation GEN.
+ */
+static
+void
+lookcache_enter(struct vnode *dir, const char *path, struct vnode *vn,
+		unsigned gen)
+{
+	struct lookcache_entry *lc, *victim = NULL;
+	struct vnode *olddir, *oldvn;
+	unsigned h, i;
+
+	if (strlen(path) >= LOOKCACHE_PATHLEN) {
+		return;
+	}
+	h = lookcache_hashfn(path);
+
+	spinlock_acquire(&lookcache_lock);
+	if (gen != lookcache_gen) {
+		/* the answer may already be stale */
+		spinlock_release(&lookcache_lock);
+		return;
+	}
+	for (i=0; i<LOOKCACHE_SIZE; i++) {
+		lc = &lookcache[i];
+		if (lc->lc_dir == dir && lc->lc_hash == h &&
+		    !strcmp(lc->lc_path, path)) {
+			/* someone beat us to it */
+			spinlock_release(&lookcache_lock);
+			return;
+		}
+		/* an unused entry, or else the least recently used */
+		if (victim == NULL ||
+		    (victim->lc_dir != NULL &&
+		     (lc->lc_dir == NULL ||
+		      lc->lc_lastuse < victim->lc_lastuse))) {
+			victim = lc;
+		}
+	}
+
+	olddir = victim->lc_dir;
+	oldvn = victim->lc_vn;
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	victim->lc_dir = dir;
+	victim->lc_vn = vn;
+	victim->lc_hash = h;
+	victim->lc_lastuse = ++lookcache_clock;
+	strcpy(victim->lc_path, path);
+	spinlock_release(&lookcache_lock);
+
+	/* This may reclaim the vnodes, so not under the spinlock */
+	if (olddir != NULL) {
+		VOP_DECREF(olddir);
+	}
+	if (oldvn != NULL) {
+		VOP_DECREF(oldvn);
+	}
+}
+
+/*
+ * Whether the last component of PATH is NAME.
+ */
+static
+bool
+lookcache_endsin(const char *path, const char *name)
+{
+	size_t end, start, i;
+
+	end = strlen(path);
+	while (end > 0 && path[end-1] == '/') {
+		end--;
+	}
+	start = end;
+	while (start > 0 && path[start-1] != '/') {
+		start--;
+	}
+	for (i=0; start + i < end; i++) {
+		if (path[start + i] != name[i]) {
+			return false;
+		}
+	}
+	return name[i] == 0;
+}
+
+/*
+ * Forget the entries for paths ending in NAME (or all, if NAME is
+ * NULL), or only the negative ones among them if NEGONLY. One at a
+ * time, as the references must be dropped without the spinlock.
+ */
+static
+void
+lookcache_drop(const char *name, bool negonly)
+{
+	struct lookcache_entry *lc;
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	spinlock_acquire(&lookcache_lock);
+	lookcache_gen++;
+	for (i=0; i<LOOKCACHE_SIZE; i++) {
+		lc = &lookcache[i];
+		if (lc->lc_dir == NULL ||
+		    (negonly && lc->lc_vn != NULL) ||
+		    (name != NULL && !lookcache_endsin(lc->lc_path, name))) {
+			continue;
+		}
+		olddir = lc->lc_dir;
+		oldvn = lc->lc_vn;
+		lc->lc_dir = NULL;
+		lc->lc_vn = NULL;
+		spinlock_release(&lookcache_lock);
+
+		VOP_DECREF(olddir);
+		if (oldvn != NULL) {
+			VOP_DECREF(oldvn);
+		}
+
+		spinlock_acquire(&lookcache_lock);
+	}
+	spinlock_release(&lookcache_lock);
+}
+
+void
+vfs_lookcache_forget(const char *name, bool negonly)
+{
+	lookcache_drop(name, negonly);
+}
+
+void
+vfs_lookcache_purge(void)
+{
+	lookcache_drop(NULL, false);
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -269,6 +508,9 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	char key[LOOKCACHE_PATHLEN];
+	bool cacheable;
+	unsigned gen;
 	int result;
 
 	vfs_biglock_acquire();
@@ -285,8 +527,25 @@ vfs_lookup(char *path, struct vnode **retval)
 		return 0;
 	}
 
+	if (lookcache_find(startvn, path, &result, retval)) {
+		VOP_DECREF(startvn);
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* VOP_LOOKUP may destroy the path */
+	cacheable = strlen(path) < sizeof(key);
+	if (cacheable) {
+		strcpy(key, path);
+	}
+
+	gen = lookcache_getgen();
 	result = VOP_LOOKUP(startvn, path, retval);
 
+	if (cacheable && (result == 0 || result == ENOENT)) {
+		lookcache_enter(startvn, key, result ? NULL : *retval, gen);
+	}
+
 	VOP_DECREF(startvn);
 	vfs_biglock_release();
 	return result;
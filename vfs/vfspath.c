@@ -74,6 +74,9 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		if (result == 0) {
+			vfs_lookcache_forget(name, true);
+		}
 
 		VOP_DECREF(dir);
 	}
@@ -146,6 +149,9 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	if (result == 0) {
+		vfs_lookcache_forget(name, false);
+	}
 	VOP_DECREF(dir);
 
 	return result;
@@ -179,6 +185,9 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	if (result == 0) {
+		vfs_lookcache_purge();
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -213,6 +222,9 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	if (result == 0) {
+		vfs_lookcache_forget(newname, true);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -240,6 +252,9 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	if (result == 0) {
+		vfs_lookcache_forget(newname, true);
+	}
 	VOP_DECREF(newdir);
 
 	return result;
@@ -286,6 +301,9 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	if (result == 0) {
+		vfs_lookcache_forget(name, true);
+	}
 
 	VOP_DECREF(parent);
 
@@ -308,6 +326,9 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	if (result == 0) {
+		vfs_lookcache_purge();
+	}
 
 	VOP_DECREF(parent);
 
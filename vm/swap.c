@@ -0,0 +1,231 @@
+/*
+ * Swap slot management and swap I/O.
+ *
+ * Slots are tracked with a bitmap plus a reference count per slot.
+ * All of that is protected by swap_lock, a spinlock, since slots are
+ * allocated and freed with the VM's own locks held. The I/O itself
+ * goes straight to the raw device vnode vfs_swapon hands back.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode = NULL;
+static struct bitmap *swap_map;
+static unsigned short *swap_refcount;
+static unsigned swap_nslots;
+static unsigned swap_nused;
+
+static struct {
+	unsigned long pageins, pageouts;
+	unsigned long failures;		/* swap full */
+} swap_stats;
+
+int
+swap_attach(const char *devname)
+{
+	struct vnode *v;
+	struct stat st;
+	struct bitmap *map;
+	unsigned short *refcount;
+	unsigned nslots;
+	char name[32];
+	size_t len;
+	int result;
+
+	if (swap_enabled()) {
+		return EBUSY;
+	}
+
+	/* vfs_swapoff, unlike vfs_swapon, wants no trailing colon */
+	snprintf(name, sizeof(name), "%s", devname);
+	len = strlen(name);
+	if (len > 0 && name[len-1] == ':') {
+		name[len-1] = 0;
+	}
+
+	result = vfs_swapon(name, &v);
+	if (result) {
+		return result;
+	}
+	result = VOP_STAT(v, &st);
+	if (result) {
+		goto fail;
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots == 0) {
+		result = ENOSPC;
+		goto fail;
+	}
+
+	map = bitmap_create(nslots);
+	refcount = kmalloc(nslots * sizeof(unsigned short));
+	if (map == NULL || refcount == NULL) {
+		if (map != NULL) {
+			bitmap_destroy(map);
+		}
+		if (refcount != NULL) {
+			kfree(refcount);
+		}
+		result = ENOMEM;
+		goto fail;
+	}
+	bzero(refcount, nslots * sizeof(unsigned short));
+
+	spinlock_acquire(&swap_lock);
+	swap_map = map;
+	swap_refcount = refcount;
+	swap_nslots = nslots;
+	swap_nused = 0;
+	swap_vnode = v;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u pages on %s\n", nslots, name);
+	return 0;
+
+ fail:
+	VOP_DECREF(v);
+	vfs_swapoff(name);
+	return result;
+}
+
+bool
+swap_enabled(void)
+{
+	bool enabled;
+
+	spinlock_acquire(&swap_lock);
+	enabled = swap_vnode != NULL;
+	spinlock_release(&swap_lock);
+	return enabled;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	spinlock_acquire(&swap_lock);
+	if (swap_vnode == NULL) {
+		result = ENOSPC;
+	}
+	else {
+		result = bitmap_alloc(swap_map, slot);
+	}
+	if (result) {
+		swap_stats.failures++;
+	}
+	else {
+		swap_refcount[*slot] = 1;
+		swap_nused++;
+	}
+	spinlock_release(&swap_lock);
+	return result;
+}
+
+void
+swap_share(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refcount[slot] > 0);
+	swap_refcount[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(swap_refcount[slot] > 0);
+	if (--swap_refcount[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+		swap_nused--;
+	}
+	spinlock_release(&swap_lock);
+}
+
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	return ku.uio_resid == 0 ? 0 : EIO;
+}
+
+int
+swap_out(paddr_t paddr, unsigned slot)
+{
+	int result;
+
+	result = swap_io(paddr, slot, UIO_WRITE);
+	if (!result) {
+		spinlock_acquire(&swap_lock);
+		swap_stats.pageouts++;
+		spinlock_release(&swap_lock);
+	}
+	return result;
+}
+
+int
+swap_in(paddr_t paddr, unsigned slot)
+{
+	int result;
+
+	result = swap_io(paddr, slot, UIO_READ);
+	if (!result) {
+		spinlock_acquire(&swap_lock);
+		swap_stats.pageins++;
+		spinlock_release(&swap_lock);
+	}
+	return result;
+}
+
+void
+swap_getstats(unsigned long *pageins, unsigned long *pageouts)
+{
+	spinlock_acquire(&swap_lock);
+	*pageins = swap_stats.pageins;
+	*pageouts = swap_stats.pageouts;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_printstats(void)
+{
+	if (!swap_enabled()) {
+		kprintf("Swap: none attached\n");
+		return;
+	}
+	kprintf("Swap: %u of %u pages used\n", swap_nused, swap_nslots);
+	kprintf("  %lu page-ins, %lu page-outs, %lu times full\n",
+		swap_stats.pageins, swap_stats.pageouts, swap_stats.failures);
+}